@@ -10,14 +10,28 @@
 #include "quad.h"
 #include "interval.h"
 #include "constant_medium.h"
+#include "scene_loader.h"
+#include "compiled_scene.h"
+#include "options.h"
+#include "distributed.h"
+#include "scene_generators.h"
 
+// Replace analytic Perlin turbulence with baked lookup grids (faster shading, lower detail).
+const bool bake_noise_textures = false;
 
-void scene1() {
+void scene1(const render_options& options) {
+    trace_scope build_trace("scene build");
     hittable_list world;
 
     auto checker = make_shared<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
     auto pertext = make_shared<noise_texture>(4, color(0.8, 0.6, 0.2));
-    auto pertext1 = make_shared<noise_texture>(4, color(0.8, 0.1, 0.7));
+    auto pertext1 = make_shared<noise_texture>(4, color(0.8, 0.1, 0.7), 1);
+
+    // Each baked cube covers the spheres that use the texture
+    if (bake_noise_textures) {
+        pertext->bake(128, 4.0, point3(-1, -2, -3)).print(std::clog);
+        pertext1->bake(128, 4.0, point3(-4, -2, -1)).print(std::clog);
+    }
 
 
 
@@ -97,6 +111,7 @@ void scene1() {
     //}
 
     world = hittable_list(make_shared<bvh_node>(world));
+    build_trace.end();
 
     // Set up the camera's public variables
     camera cam;
@@ -119,12 +134,132 @@ void scene1() {
     cam.defocus_angle = 1.0; // Low values leads to less defocus blur
     cam.focus_dist = 4.4; // The focus distance should match the distance from the camera to the object of interest
 
+    options.apply(cam);
+    cam.render(world);
+}
+
+// Render a scene described by a scene file (see scene_loader.h for the format).
+int render_scene_file(const render_options& options) {
+    scene_description scene;
+    {
+        trace_scope trace("scene parse", options.scene_file);
+        if (!load_scene_description(options.scene_file, scene))
+            return 1;
+    }
+
+    hittable_list world;
+    scene_builder builder(scene);
+    {
+        trace_scope trace("scene build");
+        builder.bvh_threads = std::max(0, options.threads);
+        builder.bvh_method = options.bvh_method;
+        builder.bvh_compact = options.compact_bvh;
+        world = builder.build();
+        if (builder.bvh)
+            builder.bvh->build_stats().print(std::clog);
+    }
+
+    if (scene.frames == 1) {
+        options.apply(scene.cam);
+        scene.cam.render(world);
+        return 0;
+    }
+
+    // An animation: the scene stays built, and each frame only moves it and refits the BVH. Every
+    // frame gets its own numbered output, checkpoint and statistics files.
+    using clock = std::chrono::steady_clock;
+    for (int frame = 0; frame < scene.frames; frame++) {
+        trace_scope trace("frame", frame);
+        auto start = clock::now();
+
+        auto cam = scene.cam;
+        cam.scene_hash = mix_bits(scene.cam.scene_hash ^ static_cast<uint64_t>(frame));
+        bool rebuilt = builder.set_frame(frame, cam);
+        auto posed = clock::now();
+
+        options.apply(cam);
+        cam.output_file = frame_file_name(cam.output_file, frame);
+        cam.checkpoint_file = frame_file_name(cam.checkpoint_file, frame);
+        cam.stats_file = frame_file_name(cam.stats_file, frame);
+        cam.ppm_to_stdout = false;
+        cam.render(world);
+
+        std::chrono::duration<double> update_seconds = posed - start, render_seconds = clock::now() - posed;
+        std::clog << "Frame " << frame << " (" << cam.output_file << "): updated in " << update_seconds.count()
+                  << " s" << (rebuilt ? " (BVH rebuilt)" : "") << ", rendered in " << render_seconds.count() << " s\n";
+    }
+    return 0;
+}
+
+// Render a scene file through its compiled cache ("<scene file>.rtsc"), compiling it on first use.
+int render_compiled_scene_file(const render_options& options) {
+    camera cam;
+    shared_ptr<compiled_scene> world;
+    {
+        trace_scope trace("scene load", options.scene_file);
+        world = load_compiled_scene(options.scene_file, cam);
+    }
+    if (!world)
+        return 1;
+
+    options.apply(cam);
+    cam.render(*world);
+    return 0;
+}
+
+// Render a procedurally generated scene (see scene_generators.h).
+int render_generated_scene(const render_options& options) {
+    hittable_list world;
+    camera cam;
+    {
+        auto name = options.generator + ":" + std::to_string(options.generator_count);
+        trace_scope trace("scene build", name);
+        generate_scene(options.generator, options.generator_count, world, cam);
+        cam.scene_hash = fnv1a_hash(name.data(), name.size());
+        auto bvh = make_shared<bvh_node>(world, std::max(0, options.threads), options.bvh_method,
+                                         options.compact_bvh);
+        bvh->build_stats().print(std::clog);
+        world = hittable_list(bvh, world.arena);
+    }
+    options.apply(cam);
     cam.render(world);
+    return 0;
 }
 
-int main() {
+int run(const render_options& options, const char* executable) {
+    if (!options.worker_address.empty())
+        return run_worker(options);
+    if (!options.listen_address.empty())
+        return run_coordinator(options, executable);
+    if (options.scene_cache)
+        return render_compiled_scene_file(options);
+    if (!options.scene_file.empty())
+        return render_scene_file(options);
+    if (!options.generator.empty())
+        return render_generated_scene(options);
+
     switch (1) {
-        case 1: scene1(); break;
+        case 1: scene1(options); break;
     }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    render_options options;
+    if (!parse_options(argc, argv, options))
+        return 1;
+
+    if (options.help) {
+        print_usage(std::cout);
+        return 0;
+    }
+
+    if (!options.trace_file.empty())
+        trace_log::global().enable();
+
+    auto status = run(options, argv[0]);
 
+    if (!options.trace_file.empty() && !trace_log::global().write(options.trace_file))
+        return 1;
+    return status;
 }
@@ -3,6 +3,7 @@
 
 #include "helper.h"
 #include "interval.h"
+#include "stats.h"
 
 class aabb {
 public:
@@ -40,6 +41,12 @@ public:
 
 
 
+    // Surface area, for the surface area heuristic; 0 for an empty box.
+    double surface_area() const {
+        if (x.size() < 0 || y.size() < 0 || z.size() < 0) return 0;
+        return 2 * (x.size() * y.size() + y.size() * z.size() + z.size() * x.size());
+    }
+
     const interval& axis(int n) const {
         if (n == 1) return y;
         if (n == 2) return z;
@@ -47,6 +54,7 @@ public:
     }
 
     bool hit(const ray& r, interval ray_t) const {
+        RT_STAT(box_tests);
         for (int a = 0; a < 3; a++) {
             auto invD = 1 / r.direction()[a];
             auto orig = r.origin()[a];
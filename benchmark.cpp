@@ -0,0 +1,506 @@
+// benchmark: times the intersection and shading kernels in isolation, each on a fixed, seeded set
+// of random rays, and prints ns per call and calls (rays) per second. The inputs are identical
+// from run to run, so two builds can be compared kernel by kernel.
+//
+// With --scaling, it instead builds and renders the generated scenes of scene_generators.h at
+// 10, 100, 1000, ... objects and prints the build and BVH refit times, memory, render speed and
+// teardown time at each size. The "bvh cost" column is the tree's SAH cost (see bvh_build_stats),
+// a measure of its quality independent of the machine, and "bvh MiB" the size of its nodes.
+//
+// With --convergence, it renders one scene once per time budget and prints, as CSV, the error of
+// each render against a high-spp reference. Plotted against time, this compares renderer options
+// by the image quality they reach in equal time rather than by raw ray throughput.
+//
+// Usage: benchmark [--time seconds] [filter]
+//        Only kernels whose name contains `filter` are run; each one runs for about `seconds`
+//        (default 0.5).
+//        benchmark --scaling [--max count] [--step-limit seconds] [--threads count] [--lbvh]
+//                  [--compact] [filter]
+//        Only generators whose name contains `filter` are run, up to `count` objects (default
+//        10 million); a generator stops growing once a step would take more than about `seconds`
+//        (default 60). BVHs are built on `count` threads (default 0, one per hardware thread), with
+//        the LBVH builder if --lbvh is given, and in compact nodes if --compact is.
+//        Build with RT_STATS on to also get rays per second.
+//        benchmark --convergence source [--budgets s,s,...] [--reference file.hdr]
+//                  [--reference-spp count] [--width pixels] [--pass-spp count]
+//        `source` is a scene file or generate:<kind>[:<count>]. Each render runs passes of
+//        --pass-spp (default 1) samples per pixel until its budget (default 0.25,0.5,1,2,4,8 s) is
+//        spent. The reference is read from --reference if it exists, else rendered at
+//        --reference-spp (default 1024) and saved there.
+
+#include "helper.h"
+
+#include "bvh.h"
+#include "constant_medium.h"
+#include "hittable_list.h"
+#include "image_metrics.h"
+#include "image_output.h"
+#include "material.h"
+#include "quad.h"
+#include "scene_generators.h"
+#include "sphere.h"
+#include "sphere_set.h"
+#include "stats.h"
+#include "texture.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+const uint64_t benchmark_seed = 0x5eed;
+const size_t ray_count = 4096;
+
+// Accumulates kernel results so the compiler cannot discard the calls being timed.
+static volatile double benchmark_sink;
+
+// Rays from random points on a sphere of radius 4 towards random points in the cube [-1,1]^3, so
+// that primitives at the origin are hit by some rays and missed by others.
+std::vector<ray> make_rays(size_t count) {
+    seed_random(benchmark_seed);
+    std::vector<ray> rays;
+    rays.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        auto origin = 4 * random_unit_vector();
+        auto target = vec3::random(-1, 1);
+        rays.emplace_back(origin, target - origin, random_double());
+    }
+    return rays;
+}
+
+// Hit records for rays that strike `object`, as inputs for the shading kernels.
+std::vector<hit_record> make_hits(const hittable& object, const std::vector<ray>& rays, std::vector<ray>& hit_rays) {
+    std::vector<hit_record> hits;
+    for (const auto& r : rays) {
+        hit_record rec;
+        if (object.hit(r, interval(0.001, infinity), rec)) {
+            hits.push_back(rec);
+            hit_rays.push_back(r);
+        }
+    }
+    return hits;
+}
+
+// A procedural 256x128 image for image_texture, written as PNG to the temporary directory.
+std::string make_test_image() {
+    const int width = 256, height = 128;
+    std::vector<color> pixels(width * height);
+    for (int j = 0; j < height; j++)
+        for (int i = 0; i < width; i++)
+            pixels[j * width + i] = color(double(i) / width, double(j) / height, ((i ^ j) & 8) ? 0.8 : 0.2);
+
+    auto path = (std::filesystem::temp_directory_path() / "rtbench_texture.png").string();
+    return write_image(path, width, height, pixels) ? path : std::string();
+}
+
+struct benchmark_case {
+    std::string name;
+    size_t ops;                  // Kernel calls per round
+    std::function<double()> round;
+};
+
+// Run one case for at least `min_seconds` (after a warm-up round) and print its line.
+void run_benchmark(const benchmark_case& bench, double min_seconds) {
+    benchmark_sink = benchmark_sink + bench.round();
+
+    size_t rounds = 0;
+    double seconds = 0;
+    auto start = std::chrono::steady_clock::now();
+    do {
+        seed_random(benchmark_seed);
+        benchmark_sink = benchmark_sink + bench.round();
+        rounds++;
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (seconds < min_seconds);
+
+    auto ops = double(rounds) * bench.ops;
+    printf("%-28s %10.2f %12.3f\n", bench.name.c_str(), 1e9 * seconds / ops, ops / seconds / 1e6);
+}
+
+// Resident memory of this process in bytes (0 where that is not available).
+size_t resident_bytes() {
+#ifdef __linux__
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#else
+    return 0;
+#endif
+}
+
+// Build and render one generator's scenes at growing sizes, one line per size.
+void run_scaling(const std::string& kind, size_t max_count, double step_limit, int build_threads,
+                 bvh_build_method method, bool compact) {
+    using clock = std::chrono::steady_clock;
+    auto seconds_between = [](clock::time_point a, clock::time_point b) { return std::chrono::duration<double>(b - a).count(); };
+
+    for (size_t count = 10; count <= max_count; count *= 10) {
+        auto memory_before = resident_bytes();
+        auto start = clock::now();
+
+        hittable_list world;
+        camera cam;
+        generate_scene(kind, count, world, cam);
+        auto primitives = world.objects.size();
+        auto generated = clock::now();
+
+        auto bvh = make_shared<bvh_node>(world, build_threads, method, compact);
+        auto sah_cost = bvh->build_stats().sah_cost;
+        auto node_bytes = bvh->build_stats().node_bytes;
+        world.clear();
+        auto built = clock::now();
+        bvh->refit();
+        auto refitted = clock::now();
+        auto memory = resident_bytes();
+        memory = memory > memory_before ? memory - memory_before : 0;
+
+        // A small image is enough: the render is there to measure traversal of the whole scene.
+        cam.image_width = 128;
+        cam.samples_per_pixel = 4;
+        cam.max_depth = 8;
+        cam.begin_tiles();
+        camera_tile tile;
+        tile.x1 = cam.image_width;
+        tile.y1 = cam.height();
+        tile.samples = cam.samples_per_pixel;
+
+        stats_collector::global().reset();
+        cam.render_tile(*bvh, tile);
+        auto rendered = clock::now();
+
+        auto render_seconds = seconds_between(refitted, rendered);
+        auto samples = double(tile.x1) * tile.y1 * tile.samples;
+        auto stats = stats_collector::global().snapshot();
+
+        bvh.reset();
+        world = hittable_list();
+        auto destroyed = clock::now();
+
+        printf("%-8s %10zu %10zu %10.3f %10.3f %10.3f %10.1f %10.2f %10.1f %10.3f %10.3f %10.3f ", kind.c_str(),
+               count, primitives, seconds_between(start, generated), seconds_between(generated, built),
+               seconds_between(built, refitted), sah_cost, node_bytes / (1024.0 * 1024.0),
+               memory / (1024.0 * 1024.0), render_seconds, seconds_between(rendered, destroyed),
+               samples / render_seconds / 1e6);
+        if (RT_STATS)
+            printf("%10.3f\n", (stats.primary_rays + stats.secondary_rays) / render_seconds / 1e6);
+        else
+            printf("%10s\n", "-");
+        fflush(stdout);
+
+        // Steps grow tenfold, so stop when the next one would exceed the limit.
+        if (10 * seconds_between(start, clock::now()) > step_limit && count < max_count) {
+            std::clog << kind << ": stopping, the next step would take over " << step_limit << " s\n";
+            break;
+        }
+    }
+}
+
+struct convergence_settings {
+    std::vector<double> budgets = { 0.25, 0.5, 1, 2, 4, 8 };
+    std::string reference_file;
+    int reference_samples = 1024;
+    int image_width = 0;       // 0 = the scene's width
+    int pass_samples = 1;
+};
+
+// Render whole-image passes of `pass_samples` samples per pixel until `budget` seconds have passed
+// or `max_samples` are taken (the first pass always completes). Returns the linear image.
+std::vector<color> render_for(const hittable& world, camera& cam, double budget, int pass_samples, int max_samples,
+                              int& samples, double& seconds) {
+    auto start = std::chrono::steady_clock::now();
+    cam.begin_tiles();
+    camera_tile tile;
+    tile.x1 = cam.image_width;
+    tile.y1 = cam.height();
+    std::vector<color> sum(static_cast<size_t>(tile.x1) * tile.y1, color(0, 0, 0));
+
+    samples = 0;
+    do {
+        tile.first_sample = samples;
+        tile.samples = std::min(pass_samples, max_samples - samples);
+        cam.render_tile(world, tile);
+        for (size_t i = 0; i < sum.size(); i++)
+            sum[i] += tile.accumulated[i];
+        samples += tile.samples;
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (seconds < budget && samples < max_samples);
+
+    for (auto& pixel : sum)
+        pixel /= samples;
+    return sum;
+}
+
+int run_convergence(const std::string& source, const convergence_settings& settings) {
+    hittable_list world;
+    camera cam;
+    if (!load_scene_source(source, "", world, cam))
+        return 1;
+    if (settings.image_width > 0) cam.image_width = settings.image_width;
+    cam.begin_tiles();
+    auto width = cam.image_width, height = cam.height();
+
+    std::vector<color> reference;
+    int reference_width = 0, reference_height = 0;
+    bool have_reference = !settings.reference_file.empty() && std::filesystem::exists(settings.reference_file)
+                       && read_linear_image(settings.reference_file, reference_width, reference_height, reference);
+    if (have_reference && (reference_width != width || reference_height != height)) {
+        std::cerr << "ERROR: Reference image '" << settings.reference_file << "' is " << reference_width << "x"
+                  << reference_height << ", the render is " << width << "x" << height << ".\n";
+        return 1;
+    }
+    if (!have_reference) {
+        // A different seed from the timed renders, so the reference's noise is independent of theirs.
+        std::clog << "Rendering the " << settings.reference_samples << " spp reference...\n";
+        int samples;
+        double seconds;
+        cam.seed = 1;
+        reference = render_for(world, cam, infinity, 64, settings.reference_samples, samples, seconds);
+        cam.seed = 0;
+        std::clog << "Reference took " << seconds << " s.\n";
+        if (!settings.reference_file.empty() && !write_image(settings.reference_file, width, height, reference))
+            return 1;
+    }
+
+    // efficiency = 1 / (relMSE * seconds): higher is better, and constant for an unbiased renderer
+    // whose error falls as 1/time.
+    printf("budget,seconds,spp,rmse,relmse,efficiency\n");
+    for (auto budget : settings.budgets) {
+        int samples;
+        double seconds;
+        auto image = render_for(world, cam, budget, settings.pass_samples, std::numeric_limits<int>::max(), samples, seconds);
+        auto error = compare_images(image, reference);
+        printf("%g,%.4f,%d,%.6g,%.6g,%.6g\n", budget, seconds, samples, error.rmse, error.relmse,
+               error.relmse > 0 ? 1 / (error.relmse * seconds) : 0.0);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// Parse a comma-separated list of positive numbers.
+bool parse_budgets(const std::string& text, std::vector<double>& budgets) {
+    budgets.clear();
+    std::istringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        auto value = atof(item.c_str());
+        if (value <= 0) return false;
+        budgets.push_back(value);
+    }
+    return !budgets.empty();
+}
+
+int main(int argc, char* argv[]) {
+    double min_seconds = 0.5;
+    bool scaling = false;
+    size_t max_count = 10000000;
+    double step_limit = 60;
+    int build_threads = 0;
+    auto bvh_method = bvh_build_method::sah;
+    bool compact_bvh = false;
+    std::string filter, convergence_source;
+    convergence_settings convergence;
+    bool usage_error = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--time") == 0 && i + 1 < argc) {
+            min_seconds = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--scaling") == 0) {
+            scaling = true;
+        }
+        else if (strcmp(argv[i], "--max") == 0 && i + 1 < argc) {
+            max_count = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--step-limit") == 0 && i + 1 < argc) {
+            step_limit = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            build_threads = std::max(0, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--lbvh") == 0) {
+            bvh_method = bvh_build_method::lbvh;
+        }
+        else if (strcmp(argv[i], "--compact") == 0) {
+            compact_bvh = true;
+        }
+        else if (strcmp(argv[i], "--convergence") == 0 && i + 1 < argc) {
+            convergence_source = argv[++i];
+        }
+        else if (strcmp(argv[i], "--budgets") == 0 && i + 1 < argc) {
+            usage_error |= !parse_budgets(argv[++i], convergence.budgets);
+        }
+        else if (strcmp(argv[i], "--reference") == 0 && i + 1 < argc) {
+            convergence.reference_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "--reference-spp") == 0 && i + 1 < argc) {
+            convergence.reference_samples = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--width") == 0 && i + 1 < argc) {
+            convergence.image_width = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--pass-spp") == 0 && i + 1 < argc) {
+            convergence.pass_samples = std::max(1, atoi(argv[++i]));
+        }
+        else if (argv[i][0] == '-') {
+            usage_error = true;
+        }
+        else {
+            filter = argv[i];
+        }
+    }
+    if (usage_error) {
+        std::cerr << "Usage: benchmark [--time seconds] [filter]\n"
+                  << "       benchmark --scaling [--max count] [--step-limit seconds] [--threads count] [--lbvh]\n"
+                  << "                 [--compact] [filter]\n"
+                  << "       benchmark --convergence source [--budgets s,s,...] [--reference file.hdr]\n"
+                  << "                 [--reference-spp count] [--width pixels] [--pass-spp count]\n";
+        return 1;
+    }
+
+    if (!convergence_source.empty())
+        return run_convergence(convergence_source, convergence);
+
+    if (scaling) {
+        printf("%-8s %10s %10s %10s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "scene", "objects",
+               "primitives", "generate s", "bvh s", "refit s", "bvh cost", "bvh MiB", "memory MiB", "render s", "teardown s", "Msamples/s", "Mrays/s");
+        for (const auto& kind : scene_generator_names())
+            if (filter.empty() || kind.find(filter) != std::string::npos)
+                run_scaling(kind, max_count, step_limit, build_threads, bvh_method, compact_bvh);
+        return 0;
+    }
+
+    auto rays = make_rays(ray_count);
+    auto gray = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+
+    // Primitives, each straddling the ray targets
+    auto ball = make_shared<sphere>(point3(0, 0, 0), 0.8, gray);
+    auto moving_ball = make_shared<sphere>(point3(0, -0.2, 0), point3(0, 0.2, 0), 0.8, gray);
+    auto panel = make_shared<quad>(point3(-0.8, -0.8, 0), vec3(1.6, 0, 0), vec3(0, 1.6, 0), gray);
+    auto box = aabb(point3(-0.5, -0.5, -0.5), point3(0.5, 0.5, 0.5));
+    auto fog = make_shared<constant_medium>(ball, 1.0, color(1, 1, 1));
+
+    // A BVH over 1000 small random spheres filling the target cube, and the same spheres as a sphere_set
+    seed_random(benchmark_seed + 1);
+    hittable_list field;
+    sphere_set field_set;
+    for (int n = 0; n < 1000; n++) {
+        auto center = vec3::random(-1, 1);
+        field.add(make_shared<sphere>(center, 0.03, gray));
+        field_set.add(center, 0.03, gray);
+    }
+    bvh_node field_bvh(field);
+    bvh_node field_compact_bvh(field, 0, bvh_build_method::sah, true);
+    field_set.build();
+
+    // Shading inputs: the hits of the ray set on the ball
+    std::vector<ray> hit_rays;
+    auto hits = make_hits(*ball, rays, hit_rays);
+
+    auto texture_path = make_test_image();
+    auto noise = make_shared<noise_texture>(4, color(0.8, 0.6, 0.2));
+    auto image = make_shared<image_texture>(texture_path.c_str());
+
+    auto intersect = [&](const hittable& object) {
+        return [&rays, object = &object]() {
+            double sum = 0;
+            hit_record rec;
+            for (const auto& r : rays)
+                if (object->hit(r, interval(0.001, infinity), rec)) sum += rec.t;
+            return sum;
+        };
+    };
+
+    auto scatter = [&](shared_ptr<material> mat) {
+        return [&hits, &hit_rays, mat]() {
+            double sum = 0;
+            color attenuation;
+            ray scattered;
+            for (size_t i = 0; i < hits.size(); i++)
+                if (mat->scatter(hit_rays[i], hits[i], attenuation, scattered)) sum += scattered.direction().x();
+            return sum;
+        };
+    };
+
+    // turb() point by point and turb_batch() over the same points, the shading points scaled as
+    // noise_texture scales them. The batch must agree with the scalar path before it is timed, up
+    // to float rounding: it sums the octaves in a different order.
+    perlin turbulence;
+    std::vector<point3> turb_points;
+    for (const auto& rec : hits)
+        turb_points.push_back(4 * rec.p);
+    std::vector<double> turb_values(turb_points.size());
+    turbulence.turb_batch(turb_points.data(), turb_values.data(), turb_points.size());
+    for (size_t i = 0; i < turb_points.size(); i++) {
+        auto expected = turbulence.turb(turb_points[i]);
+        if (fabs(turb_values[i] - expected) > 1e-5) {
+            std::cerr << "ERROR: perlin::turb_batch gives " << turb_values[i] << " at point " << i
+                      << ", perlin::turb gives " << expected << ".\n";
+            return 1;
+        }
+    }
+
+    auto lookup = [&](shared_ptr<texture> tex) {
+        return [&hits, tex]() {
+            double sum = 0;
+            for (const auto& rec : hits)
+                sum += tex->value(rec.u, rec.v, rec.p).x();
+            return sum;
+        };
+    };
+
+    std::vector<benchmark_case> cases = {
+        { "sphere::hit", rays.size(), intersect(*ball) },
+        { "sphere::hit (moving)", rays.size(), intersect(*moving_ball) },
+        { "quad::hit", rays.size(), intersect(*panel) },
+        { "aabb::hit", rays.size(), [&]() {
+            double sum = 0;
+            for (const auto& r : rays)
+                if (box.hit(r, interval(0.001, infinity))) sum += 1;
+            return sum;
+        } },
+        { "bvh_node::hit (1000 spheres)", rays.size(), intersect(field_bvh) },
+        { "bvh_node::hit compact", rays.size(), intersect(field_compact_bvh) },
+        { "sphere_set::hit (1000 spheres)", rays.size(), intersect(field_set) },
+        { "constant_medium::hit", rays.size(), intersect(*fog) },
+        { "lambertian::scatter", hits.size(), scatter(make_shared<lambertian>(color(0.5, 0.5, 0.5))) },
+        { "metal::scatter", hits.size(), scatter(make_shared<metal>(color(0.8, 0.8, 0.8), 0.3)) },
+        { "dielectric::scatter", hits.size(), scatter(make_shared<dielectric>(1.5)) },
+        { "isotropic::scatter", hits.size(), scatter(make_shared<isotropic>(color(1, 1, 1))) },
+        { "noise_texture::value", hits.size(), lookup(noise) },
+        { "perlin::turb", turb_points.size(), [&]() {
+            double sum = 0;
+            for (const auto& p : turb_points)
+                sum += turbulence.turb(p);
+            return sum;
+        } },
+        { "perlin::turb_batch", turb_points.size(), [&]() {
+            turbulence.turb_batch(turb_points.data(), turb_values.data(), turb_points.size());
+            return turb_values[0];
+        } },
+        { "image_texture::value", hits.size(), lookup(image) },
+    };
+
+    std::clog << rays.size() << " rays, " << hits.size() << " shading points, seed " << benchmark_seed << "\n";
+    printf("%-28s %10s %12s\n", "kernel", "ns/op", "Mrays/s");
+    for (const auto& bench : cases)
+        if (filter.empty() || bench.name.find(filter) != std::string::npos)
+            run_benchmark(bench, min_seconds);
+
+    if (!texture_path.empty()) {
+        std::error_code ec;
+        std::filesystem::remove(texture_path, ec);
+    }
+    return 0;
+}
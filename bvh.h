@@ -4,98 +4,962 @@
 #include "helper.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <vector>
 
-// Bounding Volume Hierarchy
+enum class bvh_build_method {
+    sah,    // Binned surface area heuristic: the best trees, for static scenes
+    lbvh    // Linear BVH from sorted Morton codes: much faster to build, somewhat slower to trace
+};
+
+// Measurements of one BVH build.
+struct bvh_build_stats {
+    bvh_build_method method = bvh_build_method::sah;
+    bool compact = false;
+    double seconds = 0;
+    int threads = 1;
+    size_t objects = 0;
+    size_t nodes = 0;
+    size_t node_bytes = 0;
+    size_t leaves = 0;
+    int max_depth = 0;
+    double sah_cost = 0;    // Expected cost of a ray through the root box, in object tests
+
+    void print(std::ostream& out) const {
+        out << "BVH: " << objects << " objects, " << nodes << (compact ? " compact" : "") << " nodes in "
+            << node_bytes / 1024.0 << " KiB (" << leaves << " leaves, depth " << max_depth << ", SAH cost "
+            << sah_cost << "), built by " << (method == bvh_build_method::lbvh ? "LBVH" : "SAH") << " in "
+            << seconds << " s on " << threads << (threads == 1 ? " thread\n" : " threads\n");
+    }
+};
+
+// Bounding Volume Hierarchy, stored flat: the objects are copied once into leaf order, and each
+// leaf covers a short run of them that is tested in a loop. Leaf sizes and split planes are
+// chosen by the surface area heuristic (SAH), evaluated over a few bins of object centroids.
+//
+// The LBVH method instead sorts the objects by the Morton codes of their centroids (a radix
+// sort) and splits each run where the highest differing code bit changes. That takes a few
+// linear passes, so it suits scenes rebuilt every frame.
+//
+// Both builds run on several threads: large nodes are processed in parallel chunks, and below
+// them the two halves of a split are built as separate tasks. The tree does not depend on the
+// number of threads.
+//
+// A compact BVH packs the built tree into 32-byte nodes holding the boxes of their two children,
+// quantized to 8 bits per coordinate on a grid over the node's own box (see packed_node); leaves
+// need no node of their own. That takes under a third of the memory, for scenes too big to fit
+// otherwise, but the coarser boxes cost some traversal speed: thin boxes such as walls get a
+// grid cell thick, so rays leaving a wall still test it.
 class bvh_node : public hittable {
 public:
-    // Constructor for building a BVH from a hittable_list
-    bvh_node(const hittable_list& list) : bvh_node(list.objects, 0, list.objects.size()) {}
+    // Constructor for building a BVH from a hittable_list, on `threads` threads (0 = one per
+    // hardware thread)
+    bvh_node(const hittable_list& list, int threads = 0, bvh_build_method method = bvh_build_method::sah,
+             bool compact = false)
+        : bvh_node(list.objects, 0, list.objects.size(), threads, method, compact) {}
 
     // Constructor for building a BVH from a vector of hittable objects within a given range
-    bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end) {
-        auto objects = src_objects; // Create a modifiable array of the source scene objects
-
-        // Randomly choose an axis for splitting
-        int axis = random_int(0, 2);
-        auto comparator = (axis == 0) ? box_x_compare
-            : (axis == 1) ? box_y_compare
-            : box_z_compare;
-
-        size_t object_span = end - start;
+    bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, int threads = 0,
+             bvh_build_method method = bvh_build_method::sah, bool compact = false) {
+        build_from(src_objects, start, end, threads, method, compact);
+    }
 
-        // If there is only one object, set both left and right pointers to it
-        if (object_span == 1) {
-            left = right = objects[start];
+    // Update the bounds to objects that have moved (whose bounding boxes have changed), keeping
+    // the tree. Much faster than a rebuild, but the tree gets worse as objects drift away from
+    // where it was built for.
+    void refit() {
+        trace_scope trace("bvh_node refit");
+        if (stats.compact) {
+            refit_compact();
+            return;
         }
-        // If there are two objects, compare them based on the chosen axis and assign accordingly
-        else if (object_span == 2) {
-            if (comparator(objects[start], objects[start + 1])) {
-                left = objects[start];
-                right = objects[start + 1];
+
+        // Children follow their parent, so a reverse sweep sees both children before the parent.
+        for (auto i = nodes.size(); i-- > 0;) {
+            auto& node = nodes[i];
+            if (node.count > 0) {
+                aabb box;
+                for (uint32_t j = node.offset; j < node.offset + node.count; j++)
+                    box = aabb(box, objects[j]->bounding_box());
+                node.bbox = box;
             }
             else {
-                left = objects[start + 1];
-                right = objects[start];
+                node.bbox = aabb(nodes[i + 1].bbox, nodes[node.offset].bbox);
             }
         }
-        // If there are more than two objects, sort them along the chosen axis and recursively build the BVH
-        else {
-            std::sort(objects.begin() + start, objects.begin() + end, comparator);
+        if (!nodes.empty()) bbox = nodes[0].bbox;
+    }
 
-            auto mid = start + object_span / 2;
-            left = make_shared<bvh_node>(objects, start, mid);
-            right = make_shared<bvh_node>(objects, mid, end);
-        }
+    // Refit after objects have moved, or rebuild (with the same settings) once that would leave
+    // the SAH cost more than `max_degradation` times what it was after the last build. Returns
+    // true if it rebuilt.
+    bool update(double max_degradation = 1.5) {
+        refit();
+        if (node_count() == 0 || !(sah_cost() > max_degradation * stats.sah_cost))
+            return false;
+
+        auto current = objects;
+        build_from(current, 0, current.size(), stats.threads, stats.method, stats.compact);
+        return true;
+    }
 
-        // Compute the bounding box for the current node
-        bbox = aabb(left->bounding_box(), right->bounding_box());
+    // Expected cost of a ray through the root box, in object tests, for the current bounds.
+    double sah_cost() const {
+        if (stats.compact) return compact_sah_cost();
+        if (nodes.empty()) return 0;
+        auto root_area = nodes[0].bbox.surface_area();
+        double cost = 0;
+        for (const auto& node : nodes) {
+            auto weight = root_area > 0 ? node.bbox.surface_area() / root_area : 1.0;
+            cost += weight * (node.count > 0 ? node.count : traversal_cost);
+        }
+        return cost;
     }
 
-    // Check if the ray hits the BVH node
+    // Check if the ray hits any object in the BVH
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        if (!bbox.hit(r, ray_t))
-            return false;
+        if (stats.compact) return hit_compact(r, ray_t, rec);
+        if (nodes.empty()) return false;
 
-        // Check for intersections with the left and right subtrees
-        bool hit_left = left->hit(r, ray_t, rec);
-        bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+        uint32_t stack[2 * max_sah_depth];
+        int stack_size = 0;
+        uint32_t node_index = 0;
+        bool hit_anything = false;
 
-        // Return true if the ray hits either the left or right subtree
-        return hit_left || hit_right;
+        while (true) {
+            const auto& node = nodes[node_index];
+            RT_STAT(bvh_nodes);
+            if (node.bbox.hit(r, ray_t)) {
+                if (node.count > 0) {
+                    for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                        if (objects[i]->hit(r, ray_t, rec)) {
+                            hit_anything = true;
+                            ray_t.max = rec.t;
+                        }
+                    }
+                }
+                else {
+                    // Visit the child on the ray's side of the split first, so that later boxes
+                    // are more often culled by the nearer hit.
+                    auto near = node_index + 1, far = node.offset;
+                    if (r.direction()[node.axis] < 0) std::swap(near, far);
+                    stack[stack_size++] = far;
+                    node_index = near;
+                    continue;
+                }
+            }
+
+            if (stack_size == 0) break;
+            node_index = stack[--stack_size];
+        }
+
+        return hit_anything;
     }
 
     // Get the bounding box of the BVH node
     aabb bounding_box() const override { return bbox; }
 
+    size_t node_count() const { return stats.compact ? packed_nodes.size() : nodes.size(); }
+    const bvh_build_stats& build_stats() const { return stats; }
+
+    // Bytes held by the nodes and the object pointers.
+    size_t memory_used() const {
+        return nodes.capacity() * sizeof(flat_node) + packed_nodes.capacity() * sizeof(packed_node)
+             + objects.capacity() * sizeof(shared_ptr<hittable>);
+    }
+
 private:
-    shared_ptr<hittable> left;
-    shared_ptr<hittable> right;
+    // Flat BVH node. Leaves (count > 0) cover objects [offset, offset + count); interior nodes
+    // have their left child right after them and their right child at `offset`.
+    struct flat_node {
+        aabb bbox;
+        uint32_t offset;
+        uint16_t count;
+        uint16_t axis;        // Split axis of an interior node
+    };
+
+    // Interior node of a compact BVH. Its children's boxes are stored in cells of a grid whose
+    // corner is `origin` and whose cells are 2^exponent wide, one exponent per axis: coordinate q
+    // maps to origin + q * 2^exponent. Packing rounds each box outward, so an unpacked box
+    // contains the exact one.
+    //
+    // Nodes are in depth-first order and objects in leaf order, so one link locates both children:
+    // a non-leaf left child is the next node, and so is a non-leaf right child after a leaf; a
+    // right leaf's objects follow the left leaf's, if there is one.
+    struct packed_node {
+        float origin[3];
+        int8_t exponent[3];
+        uint8_t split;        // Split axis, | the left child's object count << 2 (0 = not a leaf)
+        uint8_t lo[2][3];     // Child boxes, in grid cells
+        uint8_t hi[2][3];
+        uint32_t link;        // The right child's object count << 28 | first object of the leaves,
+                              // or the right child's node index if neither child is a leaf
+    };
+    static_assert(sizeof(packed_node) == 32);
+
+    static constexpr int count_shift = 28;
+    static constexpr uint32_t index_mask = (uint32_t(1) << count_shift) - 1;
+
+    // Child c of packed_nodes[node_index]: the object count and first object of a leaf, or a count
+    // of 0 and the node index.
+    static void child_of(const packed_node& node, uint32_t node_index, int c, uint32_t& count, uint32_t& index) {
+        uint32_t left_count = node.split >> 2, right_count = node.link >> count_shift;
+        auto link = node.link & index_mask;
+        if (c == 0) {
+            count = left_count;
+            index = left_count > 0 ? link : node_index + 1;
+        }
+        else {
+            count = right_count;
+            index = right_count > 0 ? link + left_count : left_count > 0 ? node_index + 1 : link;
+        }
+    }
+
+    // Box grown from raw coordinates while building; cheaper to extend than an aabb.
+    struct bounds {
+        double lo[3] = { infinity, infinity, infinity };
+        double hi[3] = { -infinity, -infinity, -infinity };
+
+        void grow(const aabb& b) {
+            for (int k = 0; k < 3; k++) {
+                lo[k] = std::min(lo[k], b.axis(k).min);
+                hi[k] = std::max(hi[k], b.axis(k).max);
+            }
+        }
+        void grow(const bounds& b) {
+            for (int k = 0; k < 3; k++) {
+                lo[k] = std::min(lo[k], b.lo[k]);
+                hi[k] = std::max(hi[k], b.hi[k]);
+            }
+        }
+        void grow_point(const double p[3]) {
+            for (int k = 0; k < 3; k++) {
+                lo[k] = std::min(lo[k], p[k]);
+                hi[k] = std::max(hi[k], p[k]);
+            }
+        }
+        double size(int axis) const { return hi[axis] - lo[axis]; }
+        double area() const {
+            if (lo[0] > hi[0]) return 0;
+            return 2 * (size(0) * size(1) + size(1) * size(2) + size(2) * size(0));
+        }
+        aabb box() const {
+            return aabb(interval(lo[0], hi[0]), interval(lo[1], hi[1]), interval(lo[2], hi[2]));
+        }
+    };
+
+    // An object while building: its box, computed once.
+    struct build_entry {
+        bounds box;
+        uint32_t index;       // Into the source objects
+
+        double centroid(int axis) const { return 0.5 * (box.lo[axis] + box.hi[axis]); }
+    };
+
+    static constexpr int bin_count = 16;
+
+    // Object boxes binned by centroid along each axis.
+    struct bin_set {
+        bounds boxes[3][bin_count];
+        size_t counts[3][bin_count] = {};
+
+        void merge(const bin_set& other) {
+            for (int axis = 0; axis < 3; axis++) {
+                for (int b = 0; b < bin_count; b++) {
+                    boxes[axis][b].grow(other.boxes[axis][b]);
+                    counts[axis][b] += other.counts[axis][b];
+                }
+            }
+        }
+    };
+
+    static constexpr size_t max_leaf_size = 8;
+    static constexpr size_t lbvh_leaf_size = 4;     // LBVH runs this short become leaves
+    static constexpr double traversal_cost = 2.0;   // Visiting a node, relative to testing one object
+    static constexpr int max_sah_depth = 64;        // Deeper than this, split at the median instead
+                                                    // (LBVH trees are at most 63 + 32 deep)
+    static constexpr size_t parallel_bin_size = 1 << 16;    // Bin nodes this large on all threads
+    static constexpr size_t parallel_task_size = 1 << 12;   // Build subtrees this large as tasks
+
+    std::vector<flat_node> nodes;
+    std::vector<packed_node> packed_nodes;    // Instead of `nodes` in a compact BVH
+    std::vector<shared_ptr<hittable>> objects;
     aabb bbox;
+    bvh_build_stats stats;
+
+    // Build the tree over src_objects[start, end), replacing any earlier one.
+    void build_from(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, int threads,
+                    bvh_build_method method, bool compact) {
+        trace_scope trace("bvh_node build");
+        auto build_start = std::chrono::steady_clock::now();
+        if (threads <= 0) threads = static_cast<int>(std::thread::hardware_concurrency());
+        threads = std::max(1, threads);
+        nodes.clear();
+        packed_nodes.clear();
+        objects.clear();
+        bbox = aabb();
+        stats = bvh_build_stats();
+        stats.threads = threads;
+        stats.method = method;
+        stats.compact = compact;
+        stats.objects = end > start ? end - start : 0;
+        if (start >= end) return;
+        if (compact && end - start > index_mask + 1) {
+            std::cerr << "ERROR: A compact bvh_node holds at most " << index_mask + 1 << " objects.\n";
+            stats.objects = 0;
+            return;
+        }
+
+        std::vector<build_entry> entries(end - start);
+        for_chunks(0, entries.size(), entries.size() >= parallel_bin_size ? threads : 1,
+                   [&](size_t first, size_t last, int) {
+            for (size_t i = first; i < last; i++) {
+                auto box = src_objects[start + i]->bounding_box();
+                for (int k = 0; k < 3; k++) {
+                    entries[i].box.lo[k] = box.axis(k).min;
+                    entries[i].box.hi[k] = box.axis(k).max;
+                }
+                entries[i].index = static_cast<uint32_t>(start + i);
+            }
+        });
 
-    // Static helper function for comparing bounding boxes along a specified axis
-    static bool box_compare(
-        const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis_index
-    ) {
-        return a->bounding_box().axis(axis_index).min < b->bounding_box().axis(axis_index).min;
+        nodes.reserve(entries.size());
+        if (method == bvh_build_method::lbvh)
+            build_lbvh(entries, threads);
+        else
+            build(entries, 0, entries.size(), 0, threads, nodes);
+
+        // Copy the objects, once, into leaf order
+        objects.reserve(entries.size());
+        for (const auto& e : entries)
+            objects.push_back(src_objects[e.index]);
+        bbox = nodes[0].bbox;
+
+        if (compact) {
+            pack_tree(threads);
+            std::vector<flat_node>().swap(nodes);
+        }
+
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - build_start).count();
+        measure_tree();
     }
 
-    // Static helper function for comparing bounding boxes along the x-axis
-    static bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-        return box_compare(a, b, 0);
+    // Call f(first, last, chunk) on `chunks` consecutive pieces of [start, end), each on its own
+    // thread, the first on the calling one.
+    template <class F>
+    static void for_chunks(size_t start, size_t end, int chunks, F f) {
+        if (chunks <= 1) {
+            f(start, end, 0);
+            return;
+        }
+        auto size = (end - start + chunks - 1) / chunks;
+        auto piece = [&](int c) { return std::min(end, start + c * size); };
+        std::vector<std::thread> workers;
+        for (int c = 1; c < chunks; c++)
+            workers.emplace_back(f, piece(c), piece(c + 1), c);
+        f(start, piece(1), 0);
+        for (auto& w : workers)
+            w.join();
     }
 
-    // Static helper function for comparing bounding boxes along the y-axis
-    static bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-        return box_compare(a, b, 1);
+    // Build the subtree over entries[start, end) into `out`, with its root at the current end of
+    // `out`, reordering the entries into leaf order. Uses up to `threads` threads.
+    void build(std::vector<build_entry>& entries, size_t start, size_t end, int depth, int threads,
+               std::vector<flat_node>& out) {
+        auto node_index = out.size();
+        out.emplace_back();
+        auto count = end - start;
+        int chunks = count >= parallel_bin_size ? threads : 1;
+
+        // Bounds of the boxes and of their centroids, gathered per chunk on large nodes
+        bounds box, centroids;
+        auto gather_bounds = [&](size_t first, size_t last, bounds& chunk_box, bounds& chunk_centroids) {
+            for (size_t i = first; i < last; i++) {
+                const auto& e = entries[i];
+                double centroid[3] = { e.centroid(0), e.centroid(1), e.centroid(2) };
+                chunk_box.grow(e.box);
+                chunk_centroids.grow_point(centroid);
+            }
+        };
+        if (chunks == 1) {
+            gather_bounds(start, end, box, centroids);
+        }
+        else {
+            std::vector<bounds> chunk_boxes(chunks), chunk_centroids(chunks);
+            for_chunks(start, end, chunks, [&](size_t first, size_t last, int c) {
+                gather_bounds(first, last, chunk_boxes[c], chunk_centroids[c]);
+            });
+            for (int c = 0; c < chunks; c++) {
+                box.grow(chunk_boxes[c]);
+                centroids.grow(chunk_centroids[c]);
+            }
+        }
+
+        flat_node node{ box.box(), static_cast<uint32_t>(start), 0, 0 };
+
+        // Pick the cheapest binned split over all three axes.
+        bool binnable[3];
+        for (int axis = 0; axis < 3; axis++) {
+            auto size = centroids.size(axis);
+            binnable[axis] = count > 1 && depth < max_sah_depth && size > 0 && !std::isinf(size);
+        }
+
+        int best_axis = -1;
+        int best_bin = 0;
+        double best_cost = infinity;
+        if (binnable[0] || binnable[1] || binnable[2]) {
+            auto fill_bins = [&](size_t first, size_t last, bin_set& bins) {
+                for (size_t i = first; i < last; i++) {
+                    for (int axis = 0; axis < 3; axis++) {
+                        if (!binnable[axis]) continue;
+                        auto b = bin_of(entries[i].centroid(axis), centroids, axis);
+                        bins.boxes[axis][b].grow(entries[i].box);
+                        bins.counts[axis][b]++;
+                    }
+                }
+            };
+            bin_set bins;
+            if (chunks == 1) {
+                fill_bins(start, end, bins);
+            }
+            else {
+                std::vector<bin_set> chunk_bins(chunks);
+                for_chunks(start, end, chunks, [&](size_t first, size_t last, int c) {
+                    fill_bins(first, last, chunk_bins[c]);
+                });
+                for (const auto& b : chunk_bins)
+                    bins.merge(b);
+            }
+
+            for (int axis = 0; axis < 3; axis++) {
+                if (!binnable[axis]) continue;
+
+                // Sweep from the right to get the area and count of every right-hand side.
+                double right_area[bin_count];
+                size_t right_count[bin_count];
+                bounds right;
+                size_t n = 0;
+                for (int b = bin_count - 1; b > 0; b--) {
+                    right.grow(bins.boxes[axis][b]);
+                    n += bins.counts[axis][b];
+                    right_area[b] = right.area();
+                    right_count[b] = n;
+                }
+
+                bounds left;
+                n = 0;
+                for (int b = 0; b < bin_count - 1; b++) {
+                    left.grow(bins.boxes[axis][b]);
+                    n += bins.counts[axis][b];
+                    if (n == 0 || right_count[b + 1] == 0) continue;
+                    auto cost = left.area() * n + right_area[b + 1] * right_count[b + 1];
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_bin = b;
+                    }
+                }
+            }
+        }
+
+        // Make a leaf if that is cheaper than the best split and small enough.
+        auto area = box.area();
+        auto split_cost = area > 0 ? traversal_cost + best_cost / area : infinity;
+        if (count == 1 || (count <= max_leaf_size && (best_axis < 0 || !(split_cost < count)))) {
+            node.count = static_cast<uint16_t>(count);
+            out[node_index] = node;
+            return;
+        }
+
+        size_t mid;
+        if (best_axis >= 0) {
+            auto split = std::partition(entries.begin() + start, entries.begin() + end,
+                [&](const build_entry& e) { return bin_of(e.centroid(best_axis), centroids, best_axis) <= best_bin; });
+            mid = split - entries.begin();
+            node.axis = static_cast<uint16_t>(best_axis);
+        }
+        else {
+            // All centroids coincide, the boxes are unbounded, or the SAH has made the tree too
+            // deep (past which the median keeps the depth logarithmic): split the run in half.
+            int axis = 0;
+            for (int a = 1; a < 3; a++)
+                if (centroids.size(a) > centroids.size(axis)) axis = a;
+            mid = start + count / 2;
+            std::nth_element(entries.begin() + start, entries.begin() + mid, entries.begin() + end,
+                [axis](const build_entry& a, const build_entry& b) { return a.centroid(axis) < b.centroid(axis); });
+            node.axis = static_cast<uint16_t>(axis);
+        }
+
+        node.offset = build_children(out, threads, count, [&](bool right, int child_threads, std::vector<flat_node>& child_out) {
+            if (right) build(entries, mid, end, depth + 1, child_threads, child_out);
+            else build(entries, start, mid, depth + 1, child_threads, child_out);
+        });
+        out[node_index] = node;
     }
 
-    // Static helper function for comparing bounding boxes along the z-axis
-    static bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-        return box_compare(a, b, 2);
+    // Build the two children of a node that was just added to `out`, by calling
+    // build_child(right, threads, out): the left child right after the node, then the right
+    // child. Large nodes build the right child on a new thread into its own array, which is then
+    // appended, moving its child links along with it. Returns the index of the right child.
+    template <class F>
+    static uint32_t build_children(std::vector<flat_node>& out, int threads, size_t count, F build_child) {
+        if (threads <= 1 || count < parallel_task_size) {
+            build_child(false, 1, out);
+            auto right = static_cast<uint32_t>(out.size());
+            build_child(true, 1, out);
+            return right;
+        }
+
+        std::vector<flat_node> right_nodes;
+        auto right_threads = threads / 2;
+        std::thread worker([&] {
+            trace_scope trace("bvh_node subtree build");
+            build_child(true, right_threads, right_nodes);
+        });
+        build_child(false, threads - right_threads, out);
+        worker.join();
+
+        auto right = static_cast<uint32_t>(out.size());
+        for (auto n : right_nodes) {
+            if (n.count == 0) n.offset += right;
+            out.push_back(n);
+        }
+        return right;
     }
 
+    // LBVH build of the whole tree into `nodes`.
+    void build_lbvh(std::vector<build_entry>& entries, int threads) {
+        auto count = entries.size();
+        int chunks = count >= parallel_bin_size ? threads : 1;
+
+        std::vector<bounds> chunk_centroids(chunks);
+        for_chunks(0, count, chunks, [&](size_t first, size_t last, int c) {
+            for (size_t i = first; i < last; i++) {
+                double centroid[3] = { entries[i].centroid(0), entries[i].centroid(1), entries[i].centroid(2) };
+                chunk_centroids[c].grow_point(centroid);
+            }
+        });
+        bounds centroids;
+        for (const auto& b : chunk_centroids)
+            centroids.grow(b);
+
+        // 30-bit codes (10 bits per axis) take half the sort passes of 63-bit ones and resolve
+        // smaller scenes well enough.
+        int axis_bits = count < (size_t(1) << 20) ? 10 : 21;
+        std::vector<uint64_t> keys(count);
+        std::vector<uint32_t> order(count);
+        for_chunks(0, count, chunks, [&](size_t first, size_t last, int) {
+            for (size_t i = first; i < last; i++) {
+                keys[i] = morton_code(entries[i], centroids, axis_bits);
+                order[i] = static_cast<uint32_t>(i);
+            }
+        });
+        {
+            trace_scope trace("bvh_node radix sort");
+            radix_sort(keys, order, 3 * axis_bits, chunks);
+        }
+
+        std::vector<build_entry> sorted(count);
+        for_chunks(0, count, chunks, [&](size_t first, size_t last, int) {
+            for (size_t i = first; i < last; i++)
+                sorted[i] = entries[order[i]];
+        });
+        entries.swap(sorted);
+
+        emit_lbvh(entries, keys, 0, count, 3 * axis_bits - 1, threads, nodes);
+    }
+
+    // Morton code of an entry's centroid: its position in `centroids` quantized to `axis_bits`
+    // bits per axis, with the bits interleaved x, y, z from the top. All axes share the cell size
+    // of the longest one; stretching a flat scene's short axis instead would make the top splits
+    // cut it into thin layers spanning the whole scene.
+    static uint64_t morton_code(const build_entry& e, const bounds& centroids, int axis_bits) {
+        uint64_t code = 0;
+        auto cells = double(uint64_t(1) << axis_bits);
+        auto size = std::max({ centroids.size(0), centroids.size(1), centroids.size(2) });
+        for (int axis = 0; axis < 3; axis++) {
+            auto x = size > 0 ? (e.centroid(axis) - centroids.lo[axis]) / size * cells : 0.0;
+            auto cell = static_cast<uint64_t>(std::clamp(x, 0.0, cells - 1));
+            code |= spread_bits(cell) << (2 - axis);
+        }
+        return code;
+    }
+
+    // Move the low 21 bits of x to every third bit.
+    static uint64_t spread_bits(uint64_t x) {
+        x &= 0x1fffff;
+        x = (x | x << 32) & 0x1f00000000ffffull;
+        x = (x | x << 16) & 0x1f0000ff0000ffull;
+        x = (x | x << 8) & 0x100f00f00f00f00full;
+        x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+        x = (x | x << 2) & 0x1249249249249249ull;
+        return x;
+    }
+
+    // Stable least-significant-digit radix sort of `keys` (the low `key_bits` bits), moving
+    // `values` along, eight bits per pass. Each pass counts digits per chunk, then scatters each
+    // chunk into its own slots, in parallel.
+    static void radix_sort(std::vector<uint64_t>& keys, std::vector<uint32_t>& values, int key_bits, int chunks) {
+        auto count = keys.size();
+        std::vector<uint64_t> keys_out(count);
+        std::vector<uint32_t> values_out(count);
+        std::vector<std::array<size_t, 256>> offsets(chunks);
+
+        for (int shift = 0; shift < key_bits; shift += 8) {
+            for_chunks(0, count, chunks, [&](size_t first, size_t last, int c) {
+                auto& histogram = offsets[c];
+                histogram.fill(0);
+                for (size_t i = first; i < last; i++)
+                    histogram[(keys[i] >> shift) & 0xff]++;
+            });
+
+            // Exclusive prefix sum over (digit, chunk): chunk c's digit d goes after every lower
+            // digit and after digit d of the chunks before it.
+            size_t sum = 0;
+            for (int digit = 0; digit < 256; digit++) {
+                for (int c = 0; c < chunks; c++) {
+                    auto n = offsets[c][digit];
+                    offsets[c][digit] = sum;
+                    sum += n;
+                }
+            }
+
+            for_chunks(0, count, chunks, [&](size_t first, size_t last, int c) {
+                auto& next = offsets[c];
+                for (size_t i = first; i < last; i++) {
+                    auto to = next[(keys[i] >> shift) & 0xff]++;
+                    keys_out[to] = keys[i];
+                    values_out[to] = values[i];
+                }
+            });
+            keys.swap(keys_out);
+            values.swap(values_out);
+        }
+    }
+
+    // Emit the LBVH subtree over the sorted entries[start, end), whose codes agree above bit
+    // `bit`, into `out`, and return its bounds. Bounds are gathered bottom-up, so each entry is
+    // visited once.
+    bounds emit_lbvh(const std::vector<build_entry>& entries, const std::vector<uint64_t>& keys, size_t start,
+                     size_t end, int bit, int threads, std::vector<flat_node>& out) {
+        auto node_index = out.size();
+        out.emplace_back();
+        auto count = end - start;
+        flat_node node{ aabb(), static_cast<uint32_t>(start), 0, 0 };
+
+        // The run splits at the highest bit where its first and last codes differ.
+        while (bit >= 0 && !(((keys[start] ^ keys[end - 1]) >> bit) & 1))
+            bit--;
+
+        if (count <= lbvh_leaf_size || (bit < 0 && count <= max_leaf_size)) {
+            bounds box;
+            for (size_t i = start; i < end; i++)
+                box.grow(entries[i].box);
+            node.bbox = box.box();
+            node.count = static_cast<uint16_t>(count);
+            out[node_index] = node;
+            return box;
+        }
+
+        size_t mid;
+        if (bit >= 0) {
+            mid = std::partition_point(keys.begin() + start, keys.begin() + end,
+                [bit](uint64_t key) { return !((key >> bit) & 1); }) - keys.begin();
+            node.axis = static_cast<uint16_t>(2 - bit % 3);
+        }
+        else {
+            // Identical codes: split the run in half.
+            mid = start + count / 2;
+        }
+
+        bounds left, right;
+        node.offset = build_children(out, threads, count, [&](bool second, int child_threads, std::vector<flat_node>& child_out) {
+            if (second) right = emit_lbvh(entries, keys, mid, end, bit - 1, child_threads, child_out);
+            else left = emit_lbvh(entries, keys, start, mid, bit - 1, child_threads, child_out);
+        });
+
+        left.grow(right);
+        node.bbox = left.box();
+        out[node_index] = node;
+        return left;
+    }
+
+    // Fill `packed_nodes` from the built tree in `nodes`. Interior nodes keep their depth-first
+    // order; leaves become links in their parents.
+    void pack_tree(int threads) {
+        std::vector<uint32_t> packed_index(nodes.size());
+        uint32_t count = 0;
+        for (size_t i = 0; i < nodes.size(); i++) {
+            if (nodes[i].count == 0) packed_index[i] = count++;
+        }
+
+        packed_nodes.resize(count);
+        for_chunks(0, nodes.size(), nodes.size() >= parallel_bin_size ? threads : 1, [&](size_t first, size_t last, int) {
+            for (size_t i = first; i < last; i++) {
+                if (nodes[i].count > 0) continue;
+                const auto& left = nodes[i + 1];
+                const auto& right = nodes[nodes[i].offset];
+
+                packed_node node;
+                node.split = static_cast<uint8_t>(nodes[i].axis | left.count << 2);
+                if (left.count > 0) node.link = left.offset;
+                else if (right.count > 0) node.link = right.offset;
+                else node.link = packed_index[nodes[i].offset];
+                node.link |= uint32_t(right.count) << count_shift;
+
+                bounds children[2];
+                children[0].grow(left.bbox);
+                children[1].grow(right.bbox);
+                quantize(node, children);
+                packed_nodes[packed_index[i]] = node;
+            }
+        });
+    }
+
+    void refit_compact() {
+        if (packed_nodes.empty()) {
+            bbox = object_bounds(0, static_cast<uint32_t>(objects.size())).box();
+            return;
+        }
+
+        // Children follow their parent, so a reverse sweep sees both children before the parent.
+        std::vector<bounds> boxes(packed_nodes.size());
+        for (auto i = packed_nodes.size(); i-- > 0;) {
+            auto& node = packed_nodes[i];
+            bounds children[2];
+            for (int c = 0; c < 2; c++) {
+                uint32_t count, index;
+                child_of(node, static_cast<uint32_t>(i), c, count, index);
+                children[c] = count > 0 ? object_bounds(index, count) : boxes[index];
+            }
+            quantize(node, children);
+            boxes[i] = children[0];
+            boxes[i].grow(children[1]);
+        }
+        bbox = boxes[0].box();
+    }
+
+    // sah_cost() of a compact BVH, over the quantized boxes.
+    double compact_sah_cost() const {
+        if (packed_nodes.empty()) return static_cast<double>(objects.size());
+        auto root_area = bbox.surface_area();
+        double cost = traversal_cost;
+        for (uint32_t i = 0; i < packed_nodes.size(); i++) {
+            for (int c = 0; c < 2; c++) {
+                uint32_t count, index;
+                child_of(packed_nodes[i], i, c, count, index);
+                auto weight = root_area > 0 ? child_box(packed_nodes[i], c).area() / root_area : 1.0;
+                cost += weight * (count > 0 ? count : traversal_cost);
+            }
+        }
+        return cost;
+    }
+
+    bool hit_compact(const ray& r, interval ray_t, hit_record& rec) const {
+        bool hit_anything = false;
+        auto hit_objects = [&](uint32_t first, uint32_t count) {
+            for (auto i = first; i < first + count; i++) {
+                if (objects[i]->hit(r, ray_t, rec)) {
+                    hit_anything = true;
+                    ray_t.max = rec.t;
+                }
+            }
+        };
+
+        if (packed_nodes.empty()) {
+            // The whole tree is a single leaf.
+            if (!objects.empty() && bbox.hit(r, ray_t)) hit_objects(0, static_cast<uint32_t>(objects.size()));
+            return hit_anything;
+        }
+
+        const auto& origin = r.origin();
+        const auto& direction = r.direction();
+        double inverse[3] = { 1 / direction.x(), 1 / direction.y(), 1 / direction.z() };
+
+        // Children still to visit (a leaf's objects or a node), with where the ray enters them: by
+        // the time one comes off the stack, a nearer hit may have made it unnecessary.
+        struct pending { uint32_t count, index; double t; };
+        pending stack[2 * max_sah_depth];
+        int stack_size = 0;
+        pending current = { 0, 0, ray_t.min };
+
+        while (true) {
+            if (current.count > 0) {
+                hit_objects(current.index, current.count);
+            }
+            else {
+                const auto& node = packed_nodes[current.index];
+                RT_STAT(bvh_nodes);
+
+                double base[3], step[3];
+                for (int k = 0; k < 3; k++) {
+                    base[k] = (node.origin[k] - origin[k]) * inverse[k];
+                    step[k] = cell_size(node.exponent[k]) * inverse[k];
+                }
+
+                // Visit the child on the ray's side of the split first.
+                pending next[2];
+                int next_count = 0;
+                int first = direction[node.split & 3] < 0 ? 1 : 0;
+                for (int c = first, i = 0; i < 2; i++, c ^= 1) {
+                    auto& child = next[next_count];
+                    if (!child_hit(node, c, base, step, inverse, ray_t, child.t)) continue;
+                    child_of(node, current.index, c, child.count, child.index);
+                    next_count++;
+                }
+
+                if (next_count == 2) stack[stack_size++] = next[1];
+                if (next_count > 0) {
+                    current = next[0];
+                    continue;
+                }
+            }
+
+            while (stack_size > 0 && !(stack[stack_size - 1].t < ray_t.max))
+                stack_size--;
+            if (stack_size == 0) break;
+            current = stack[--stack_size];
+        }
+
+        return hit_anything;
+    }
+
+    static double cell_start(float origin, double cell_size, int q) { return origin + q * cell_size; }
+
+    // 2^exponent, for exponents in [-126, 127].
+    static double cell_size(int8_t exponent) { return std::bit_cast<double>(static_cast<uint64_t>(exponent + 1023) << 52); }
+
+    // Store the children's exact boxes in a node.
+    static void quantize(packed_node& node, const bounds children[2]) {
+        for (int k = 0; k < 3; k++) {
+            auto lo = std::min(children[0].lo[k], children[1].lo[k]);
+            auto hi = std::max(children[0].hi[k], children[1].hi[k]);
+
+            // The smallest grid whose 255 cells reach from the rounded-down minimum to the maximum.
+            node.origin[k] = 0;
+            node.exponent[k] = 0;
+            if (lo <= hi) {
+                auto origin = static_cast<float>(lo);
+                if (origin > lo) origin = std::nextafter(origin, -INFINITY);
+                int exponent = -126;
+                if (hi > origin) {
+                    std::frexp((hi - origin) / 255, &exponent);
+                    exponent = std::clamp(exponent, -126, 127);
+                }
+                while (exponent < 127 && cell_start(origin, cell_size(static_cast<int8_t>(exponent)), 255) < hi)
+                    exponent++;
+                node.origin[k] = origin;
+                node.exponent[k] = static_cast<int8_t>(exponent);
+            }
+
+            auto origin = node.origin[k];
+            auto size = cell_size(node.exponent[k]);
+            for (int c = 0; c < 2; c++) {
+                const auto& b = children[c];
+                if (!(b.lo[k] <= b.hi[k])) {
+                    // Empty: an inverted box that no ray hits.
+                    node.lo[c][k] = 255;
+                    node.hi[c][k] = 0;
+                    continue;
+                }
+                auto q_lo = static_cast<int>(std::clamp(std::floor((b.lo[k] - origin) / size), 0.0, 255.0));
+                while (q_lo > 0 && cell_start(origin, size, q_lo) > b.lo[k]) q_lo--;
+                auto q_hi = static_cast<int>(std::clamp(std::ceil((b.hi[k] - origin) / size), 0.0, 255.0));
+                while (q_hi < 255 && cell_start(origin, size, q_hi) < b.hi[k]) q_hi++;
+                node.lo[c][k] = static_cast<uint8_t>(q_lo);
+                node.hi[c][k] = static_cast<uint8_t>(q_hi);
+            }
+        }
+    }
+
+    static bounds child_box(const packed_node& node, int c) {
+        bounds b;
+        for (int k = 0; k < 3; k++) {
+            auto size = cell_size(node.exponent[k]);
+            b.lo[k] = cell_start(node.origin[k], size, node.lo[c][k]);
+            b.hi[k] = cell_start(node.origin[k], size, node.hi[c][k]);
+        }
+        return b;
+    }
+
+    // Whether the ray hits child c's box within ray_t, and if so where it enters it: the slab
+    // test of aabb::hit, with the ray in the node's grid (where grid coordinate q on axis k is at
+    // t = base[k] + q * step[k]).
+    static bool child_hit(const packed_node& node, int c, const double base[3], const double step[3],
+                          const double inverse[3], interval ray_t, double& t_enter) {
+        RT_STAT(box_tests);
+        for (int k = 0; k < 3; k++) {
+            auto t0 = base[k] + node.lo[c][k] * step[k];
+            auto t1 = base[k] + node.hi[c][k] * step[k];
+            if (inverse[k] < 0) std::swap(t0, t1);
+            if (t0 > ray_t.min) ray_t.min = t0;
+            if (t1 < ray_t.max) ray_t.max = t1;
+            if (ray_t.max <= ray_t.min) return false;
+        }
+        t_enter = ray_t.min;
+        return true;
+    }
+
+    // Union of the boxes of objects [first, first + count).
+    bounds object_bounds(uint32_t first, uint32_t count) const {
+        bounds b;
+        for (auto i = first; i < first + count; i++)
+            b.grow(objects[i]->bounding_box());
+        return b;
+    }
+
+    static int bin_of(double x, const bounds& extent, int axis) {
+        auto b = static_cast<int>(bin_count * (x - extent.lo[axis]) / extent.size(axis));
+        return std::clamp(b, 0, bin_count - 1);
+    }
+
+    // Fill in the tree's shape and SAH cost in `stats`.
+    void measure_tree() {
+        stats.nodes = node_count();
+        stats.node_bytes = stats.compact ? packed_nodes.size() * sizeof(packed_node) : nodes.size() * sizeof(flat_node);
+        stats.sah_cost = sah_cost();
+
+        struct pending { uint32_t index; int depth; };
+        std::vector<pending> stack = { { 0, 0 } };
+        auto leaf = [&](int depth) {
+            stats.leaves++;
+            stats.max_depth = std::max(stats.max_depth, depth);
+        };
+
+        if (stats.compact && packed_nodes.empty()) {
+            leaf(0);
+            return;
+        }
+        while (!stack.empty()) {
+            auto [node_index, depth] = stack.back();
+            stack.pop_back();
+            if (stats.compact) {
+                for (int c = 0; c < 2; c++) {
+                    uint32_t count, index;
+                    child_of(packed_nodes[node_index], node_index, c, count, index);
+                    if (count > 0) leaf(depth + 1);
+                    else stack.push_back({ index, depth + 1 });
+                }
+            }
+            else if (nodes[node_index].count > 0) {
+                leaf(depth);
+            }
+            else {
+                stack.push_back({ node_index + 1, depth + 1 });
+                stack.push_back({ nodes[node_index].offset, depth + 1 });
+            }
+        }
+    }
 };
 
 #endif
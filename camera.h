@@ -1,15 +1,34 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
-
 #include "helper.h"
+#include "checkpoint.h"
 #include "color.h"
 #include "hittable.h"
+#include "image_output.h"
 #include "material.h"
-
+#include "stats.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A rectangle of pixels [x0, x1) x [y0, y1) and a range of samples, rendered separately from the
+// rest of the image and merged into it later (see distributed.h).
+struct camera_tile {
+    int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+    int first_sample = 0, samples = 0;
+    std::vector<color> accumulated;        // Sample sums, row-major over the tile
+    std::vector<double> luminance_squared; // Sums of squared sample luminances
+};
 
 // Class representing a camera in a ray tracing system.
 class camera {
@@ -18,6 +37,7 @@ public:
 
     double aspect_ratio = 1.0;     // Ratio of image width over height
     int    image_width = 100;      // Rendered image width in pixel count
+    int    fixed_height = 0;       // Rendered image height; overrides aspect_ratio when set
     int    samples_per_pixel = 10; // Count of random samples for each pixel
     int    max_depth = 10;         // Maximum number of ray bounces into scene
     color  background;             // Scene background color
@@ -30,40 +50,166 @@ public:
     double defocus_angle = 0;  // Variation angle of rays through each pixel
     double focus_dist = 10;    // Distance from camera lookfrom point to plane of perfect focus
 
+    std::string output_file = "image.jpg"; // Image file written after rendering (format from extension)
+    bool   ppm_to_stdout = true; // Also write the image as PPM text to standard output
+    int    threads = 0;          // Render threads (0 = one per hardware thread)
+    uint64_t seed = 0;           // Base random seed; the same seed gives the same image
+    uint64_t scene_hash = 0;     // Identifies the scene (e.g. a hash of its file); set by the loaders
+
+    // Progressive rendering: render the whole image in passes of pass_samples samples per pixel,
+    // rewriting output_file after every pass, until samples_per_pixel is reached or one of the
+    // stopping conditions below is met. The first pass always completes.
+    int    pass_samples = 0;     // Samples per pixel per pass (0 = a single pass, or
+                                 // default_limited_pass_samples with a time or noise limit)
+    double time_budget = 0;      // Wall-clock limit in seconds (0 = none)
+    double target_noise = 0;     // Stop once estimate_noise() drops to this (0 = never)
+
+    // Checkpointing: with checkpoint_file set, the accumulation buffers are saved after a pass
+    // once checkpoint_interval seconds have passed since the last save, and when rendering stops.
+    // With resume set, a checkpoint from the same scene and camera settings is loaded and the
+    // render continues from its last pass, giving the same image as an uninterrupted render.
+    std::string checkpoint_file;
+    double checkpoint_interval = 0; // Seconds between checkpoints (0 = after every pass)
+    bool   resume = false;
+
+    std::string stats_file;      // Write render statistics here as JSON (counters need RT_STATS)
+
 
 
     // Render the scene using the specified hittable world.
     void render(const hittable& world) {
         initialize();
+        reset_accumulation();
+        stats_collector::global().reset();
+
+        auto start = std::chrono::steady_clock::now();
+        auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(time_budget));
+        auto pass_size = this->pass_size();
+
+        int samples_done = 0;
+        int first_pass = 1;
+        if (resume && !checkpoint_file.empty())
+            load_checkpoint(samples_done, first_pass);
+        auto last_checkpoint = start;
+
+        for (int pass = first_pass; samples_done < samples_per_pixel; pass++) {
+            auto target = std::min(samples_done + pass_size, samples_per_pixel);
+            bool complete;
+            {
+                trace_scope trace("pass", pass);
+                complete = render_pass(world, target, pass, (pass > first_pass && time_budget > 0) ? &deadline : nullptr);
+            }
+            // A pass cut short leaves some pixels below target; the next one (or a resumed
+            // render) brings them up first.
+            if (complete)
+                samples_done = target;
+
+            write_output_image();
+
+            if (pass_size < samples_per_pixel || time_budget > 0) {
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                std::clog << "\rPass " << pass << ": " << samples_done << " spp, noise " << estimate_noise()
+                          << ", " << elapsed.count() << " s" << (complete ? "" : " (time limit, pass incomplete)")
+                          << "          \n";
+            }
 
-        unsigned char* data = new unsigned char[image_width * image_height * 3];
-        int index = 0;
+            auto now = std::chrono::steady_clock::now();
+            bool stop = !complete || samples_done >= samples_per_pixel
+                     || (time_budget > 0 && now >= deadline)
+                     || (target_noise > 0 && estimate_noise() <= target_noise);
 
-        std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-        //#pragma omp parallel for schedule(dynamic)
-        for (int j = 0; j < image_height; ++j) {
-            std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
-            for (int i = 0; i < image_width; ++i) {
-                color pixel_color(0, 0, 0);
-                for (int sample = 0; sample < samples_per_pixel; ++sample) {
-                    ray r = get_ray(i, j);
-                    pixel_color += ray_color(r, max_depth, world);
-                }
+            std::chrono::duration<double> since_checkpoint = now - last_checkpoint;
+            if (!checkpoint_file.empty() && (stop || since_checkpoint.count() >= checkpoint_interval)) {
+                trace_scope trace("write checkpoint");
+                save_checkpoint(samples_done, pass);
+                last_checkpoint = now;
+            }
+
+            if (stop)
+                break;
+        }
+
+        if (!stats_file.empty()) {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            write_stats(elapsed.count());
+        }
+
+        finish_output();
+    }
+
+    // Tile rendering, for splitting a render across processes. Call begin_tiles() first; then
+    // render_tile() renders a tile's samples and add_tile() merges a rendered tile into the image,
+    // which finish_tiles() writes out.
+    void begin_tiles() {
+        initialize();
+        reset_accumulation();
+    }
+
+    int height() const { return image_height; }
 
-                // Perform the write_color function steps but to save a jpg
-                static const interval intensity(0.000, 0.999);
-                data[index++] = static_cast<unsigned char> (255.999 * intensity.clamp(sqrt((pixel_color.x()) / samples_per_pixel)));
-                data[index++] = static_cast<unsigned char> (255.999 * intensity.clamp(sqrt((pixel_color.y()) / samples_per_pixel)));
-                data[index++] = static_cast<unsigned char> (255.999 * intensity.clamp(sqrt((pixel_color.z()) / samples_per_pixel)));
+    // Samples per pixel of each pass. A time or noise limit is only checked between passes, so
+    // with one set and no pass_samples the passes are kept small.
+    static constexpr int default_limited_pass_samples = 4;
+    int pass_size() const {
+        auto size = pass_samples;
+        if (size <= 0)
+            size = (time_budget > 0 || target_noise > 0) ? default_limited_pass_samples : samples_per_pixel;
+        return std::min(size, samples_per_pixel);
+    }
 
+    void render_tile(const hittable& world, camera_tile& tile) const {
+        trace_scope trace("tile", [&] {
+            return std::to_string(tile.x0) + "," + std::to_string(tile.y0) + " samples "
+                 + std::to_string(tile.first_sample) + "+" + std::to_string(tile.samples);
+        });
+        auto width = tile.x1 - tile.x0;
+        tile.accumulated.assign(static_cast<size_t>(width) * (tile.y1 - tile.y0), color(0, 0, 0));
+        tile.luminance_squared.assign(tile.accumulated.size(), 0);
+
+        for_each_row(tile.y0, tile.y1, [&](int j) {
+            for (int i = tile.x0; i < tile.x1; ++i) {
+                auto index = static_cast<size_t>(j - tile.y0) * width + (i - tile.x0);
+                sample_pixel(world, i, j, tile.first_sample, tile.samples,
+                             tile.accumulated[index], tile.luminance_squared[index]);
+            }
+            return true;
+        });
+    }
 
-                write_color(std::cout, pixel_color, samples_per_pixel);
+    void add_tile(const camera_tile& tile) {
+        auto width = tile.x1 - tile.x0;
+        for (int j = tile.y0; j < tile.y1; ++j) {
+            for (int i = tile.x0; i < tile.x1; ++i) {
+                auto index = static_cast<size_t>(j) * image_width + i;
+                auto tile_index = static_cast<size_t>(j - tile.y0) * width + (i - tile.x0);
+                accumulated[index] += tile.accumulated[tile_index];
+                luminance_squared[index] += tile.luminance_squared[tile_index];
+                sample_counts[index] += tile.samples;
             }
         }
-        stbi_write_jpg("image.jpg", image_width, image_height, 3, data, 100);
-        delete[] data;
+    }
 
-        std::clog << "\rDone.                 \n";
+    void finish_tiles() {
+        write_output_image();
+        finish_output();
+    }
+
+    // Relative noise of the current image: the root mean square standard error of the pixel
+    // luminances, divided by the mean luminance.
+    double estimate_noise() const {
+        double error_sum = 0, luminance_sum = 0;
+        for (size_t p = 0; p < sample_counts.size(); p++) {
+            auto n = static_cast<double>(sample_counts[p]);
+            if (n < 2) return infinity;
+            auto mean = luminance(accumulated[p]) / n;
+            auto variance = std::max(0.0, (luminance_squared[p] / n - mean * mean) * n / (n - 1));
+            error_sum += variance / n;
+            luminance_sum += mean;
+        }
+        if (luminance_sum <= 0) return 0;
+        auto pixels = static_cast<double>(sample_counts.size());
+        return sqrt(error_sum / pixels) / (luminance_sum / pixels);
     }
 
 private:
@@ -78,11 +224,15 @@ private:
     vec3   defocus_disk_u; // Defocus disk horizontal radius
     vec3   defocus_disk_v; // Defocus disk vertical radius
 
+    std::vector<color>    accumulated;       // Sum of the samples of each pixel
+    std::vector<double>   luminance_squared; // Sum of squared sample luminances of each pixel
+    std::vector<uint32_t> sample_counts;     // Samples taken of each pixel
+
 
 
     // Initialize camera parameters and calculate viewport dimensions.
     void initialize() {
-        image_height = static_cast<int>(image_width / aspect_ratio);
+        image_height = (fixed_height > 0) ? fixed_height : static_cast<int>(image_width / aspect_ratio);
         image_height = (image_height < 1) ? 1 : image_height;
 
         center = lookfrom;
@@ -118,6 +268,198 @@ private:
 
     }
 
+    void reset_accumulation() {
+        auto pixels = static_cast<size_t>(image_width) * image_height;
+        accumulated.assign(pixels, color(0, 0, 0));
+        luminance_squared.assign(pixels, 0);
+        sample_counts.assign(pixels, 0);
+    }
+
+    static double luminance(const color& c) {
+        return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+    }
+
+    // Per-pixel averages of the samples accumulated so far.
+    std::vector<color> average() const {
+        std::vector<color> pixels(accumulated.size());
+        for (size_t p = 0; p < pixels.size(); p++)
+            pixels[p] = (sample_counts[p] > 0) ? accumulated[p] / sample_counts[p] : color(0, 0, 0);
+        return pixels;
+    }
+
+    // Seed for the samples of `pixel` starting at `first_sample`. Seeding per pixel and pass keeps
+    // the image independent of the thread count, and lets a resumed render continue exactly.
+    uint64_t pixel_seed(size_t pixel, int first_sample) const {
+        return mix_bits(seed ^ mix_bits(pixel ^ (static_cast<uint64_t>(first_sample) << 40)));
+    }
+
+    // Add samples [first_sample, first_sample + count) of pixel (i, j) to the given sums.
+    void sample_pixel(const hittable& world, int i, int j, int first_sample, int count,
+                      color& pixel_color, double& pixel_luminance_squared) const {
+        seed_random(pixel_seed(static_cast<size_t>(j) * image_width + i, first_sample));
+        for (int sample = 0; sample < count; ++sample) {
+            RT_STAT(primary_rays);
+            ray r = get_ray(i, j);
+            auto sample_color = ray_color(r, max_depth, world);
+            pixel_color += sample_color;
+            pixel_luminance_squared += luminance(sample_color) * luminance(sample_color);
+        }
+    }
+
+    // Call row(j) for every scanline in [first, last) on the render threads, which take rows from
+    // a shared counter. Stops handing out rows once row() returns false; returns false if it did.
+    template <typename F>
+    bool for_each_row(int first, int last, F row) const {
+        std::atomic<int> next_row{ first };
+        std::atomic<bool> stopped{ false };
+
+        auto render_rows = [&]() {
+            for (int j = next_row++; j < last && !stopped; j = next_row++)
+                if (!row(j)) stopped = true;
+            stats_collector::global().flush_thread();
+            texture_cache::global().flush_thread();
+        };
+
+        int thread_count = (threads > 0) ? threads : static_cast<int>(std::thread::hardware_concurrency());
+        thread_count = std::max(1, std::min(thread_count, last - first));
+
+        std::vector<std::thread> workers;
+        for (int t = 1; t < thread_count; t++)
+            workers.emplace_back([&, t]() {
+                trace_log::global().set_worker(t);
+                render_rows();
+            });
+        render_rows();
+        for (auto& worker : workers)
+            worker.join();
+
+        return !stopped;
+    }
+
+    // Bring every pixel up to `target` samples. Returns false if the deadline stopped the pass
+    // early, leaving the remaining scanlines behind; the next pass catches them up.
+    bool render_pass(const hittable& world, int target, int pass,
+                     const std::chrono::steady_clock::time_point* deadline) {
+        int rows_left = image_height;
+        std::mutex progress_mutex;
+
+        return for_each_row(0, image_height, [&](int j) {
+            if (deadline && std::chrono::steady_clock::now() >= *deadline)
+                return false;
+
+            trace_scope trace("scanline", j);
+
+            for (int i = 0; i < image_width; ++i) {
+                auto index = static_cast<size_t>(j) * image_width + i;
+                auto count = target - static_cast<int>(sample_counts[index]);
+                if (count <= 0) continue;
+
+                sample_pixel(world, i, j, sample_counts[index], count, accumulated[index], luminance_squared[index]);
+                sample_counts[index] += count;
+            }
+
+            std::lock_guard<std::mutex> lock(progress_mutex);
+            std::clog << "\rPass " << pass << ", scanlines remaining: " << --rows_left << ' ' << std::flush;
+            return true;
+        });
+    }
+
+    void write_stats(double seconds) const {
+        std::ofstream out(stats_file);
+        if (!out) {
+            std::cerr << "ERROR: Could not write statistics '" << stats_file << "'.\n";
+            return;
+        }
+        if (!RT_STATS)
+            std::clog << "Ray counters are compiled out; configure with -DRT_STATS=ON to collect them.\n";
+
+        int thread_count = (threads > 0) ? threads : static_cast<int>(std::thread::hardware_concurrency());
+        stats_collector::global().snapshot().write_json(out, seconds, std::max(1, thread_count));
+    }
+
+    void write_output_image() const {
+        if (output_file.empty()) return;
+        trace_scope trace("write image", output_file);
+        write_image_atomic(output_file, image_width, image_height, average());
+    }
+
+    // Write the finished image to standard output if asked, and report completion.
+    void finish_output() const {
+        if (ppm_to_stdout) {
+            trace_scope trace("write ppm");
+            std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+            for (const auto& pixel_color : average())
+                write_color(std::cout, pixel_color, 1);
+        }
+
+        std::clog << "\rDone.                 \n";
+        texture_cache::global().print_stats(std::clog);
+    }
+
+    // Hash of the settings that change what a pixel's samples are; a checkpoint is only resumed
+    // under the same settings.
+    uint64_t settings_hash() const {
+        const double values[] = {
+            aspect_ratio, double(image_width), double(fixed_height), double(max_depth), background.x(), background.y(), background.z(),
+            vfov, lookfrom.x(), lookfrom.y(), lookfrom.z(), lookat.x(), lookat.y(), lookat.z(),
+            vup.x(), vup.y(), vup.z(), defocus_angle, focus_dist
+        };
+        uint64_t hash = mix_bits(seed);
+        for (auto value : values) {
+            uint64_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            hash = mix_bits(hash ^ bits);
+        }
+        return hash;
+    }
+
+    void save_checkpoint(int samples_done, int passes_done) const {
+        render_checkpoint checkpoint;
+        memcpy(checkpoint.header.magic, render_checkpoint_magic, sizeof(checkpoint.header.magic));
+        checkpoint.header.version = render_checkpoint_version;
+        checkpoint.header.width = image_width;
+        checkpoint.header.height = image_height;
+        checkpoint.header.samples_done = samples_done;
+        checkpoint.header.passes_done = passes_done;
+        checkpoint.header.seed = seed;
+        checkpoint.header.settings_hash = settings_hash();
+        checkpoint.header.scene_hash = scene_hash;
+        checkpoint.accumulated = accumulated;
+        checkpoint.luminance_squared = luminance_squared;
+        checkpoint.sample_counts = sample_counts;
+        checkpoint.save(checkpoint_file);
+    }
+
+    // Load the accumulation buffers from checkpoint_file if it matches this render. On success
+    // sets the samples and the pass to continue from; otherwise leaves everything untouched.
+    bool load_checkpoint(int& samples_done, int& next_pass) {
+        render_checkpoint checkpoint;
+        if (!checkpoint.load(checkpoint_file)) {
+            std::clog << "No usable checkpoint '" << checkpoint_file << "', starting from scratch.\n";
+            return false;
+        }
+
+        const auto& h = checkpoint.header;
+        if (h.width != image_width || h.height != image_height || h.seed != seed || h.settings_hash != settings_hash()) {
+            std::clog << "Checkpoint '" << checkpoint_file << "' is from different render settings, starting from scratch.\n";
+            return false;
+        }
+        if (h.scene_hash != scene_hash) {
+            std::clog << "Checkpoint '" << checkpoint_file << "' is from a different scene, starting from scratch.\n";
+            return false;
+        }
+
+        accumulated = std::move(checkpoint.accumulated);
+        luminance_squared = std::move(checkpoint.luminance_squared);
+        sample_counts = std::move(checkpoint.sample_counts);
+        // Every pixel has at least the fewest samples any pixel has, whatever the header says.
+        samples_done = static_cast<int>(*std::min_element(sample_counts.begin(), sample_counts.end()));
+        next_pass = h.passes_done + 1;
+        std::clog << "Resuming from '" << checkpoint_file << "' after pass " << h.passes_done
+                  << " (" << samples_done << " spp).\n";
+        return true;
+    }
+
     // Get a ray corresponding to the specified pixel coordinates (i, j).
     ray get_ray(int i, int j) const {
         // Get a randomly-sampled camera ray for the pixel at location i,j, originating from
@@ -190,6 +532,7 @@ private:
         if (!rec.mat->scatter(r, rec, attenuation, scattered))
             return color_from_emission;
 
+        RT_STAT(secondary_rays);
         color color_from_scatter = attenuation * ray_color(scattered, depth - 1, world);
 
         return color_from_emission + color_from_scatter;
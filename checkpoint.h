@@ -0,0 +1,108 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "helper.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Render checkpoint (".rtck"): the camera's accumulation buffers, written between passes so an
+// interrupted render can be resumed. The random state needs no saving: every pixel is reseeded
+// from (seed, pixel, sample count) before each batch of samples, so the header's seed plus the
+// per-pixel sample counts determine all samples still to come. Layout, in host byte order:
+//
+//     render_checkpoint_header
+//     color    accumulated[width * height]
+//     double   luminance_squared[width * height]
+//     uint32_t sample_counts[width * height]
+
+const char render_checkpoint_magic[8] = { 'R', 'T', 'W', 'C', 'K', 'P', '\0', '\1' };
+const uint32_t render_checkpoint_version = 2;
+
+struct render_checkpoint_header {
+    char magic[8];
+    uint32_t version;
+    int32_t width, height;
+    int32_t samples_done;     // Samples per pixel every pixel has (the last finished pass)
+    int32_t passes_done;
+    uint32_t pad;
+    uint64_t seed;
+    uint64_t settings_hash;   // Hash of the camera settings that affect the image
+    uint64_t scene_hash;      // camera::scene_hash of the rendered scene
+};
+
+struct render_checkpoint {
+    render_checkpoint_header header{};
+    std::vector<color> accumulated;
+    std::vector<double> luminance_squared;
+    std::vector<uint32_t> sample_counts;
+
+    // Write the checkpoint to a temporary file and rename it over `filename`, so a render killed
+    // while saving still leaves the previous checkpoint intact. Returns true on success.
+    bool save(const std::string& filename) const {
+        auto temp = filename + ".partial";
+        FILE* out = fopen(temp.c_str(), "wb");
+        if (!out) {
+            std::cerr << "ERROR: Could not write checkpoint '" << temp << "'.\n";
+            return false;
+        }
+
+        auto pixels = accumulated.size();
+        bool ok = fwrite(&header, sizeof(header), 1, out) == 1
+               && fwrite(accumulated.data(), sizeof(color), pixels, out) == pixels
+               && fwrite(luminance_squared.data(), sizeof(double), pixels, out) == pixels
+               && fwrite(sample_counts.data(), sizeof(uint32_t), pixels, out) == pixels;
+        ok = (fclose(out) == 0) && ok;
+
+        std::error_code ec;
+        if (ok)
+            std::filesystem::rename(temp, filename, ec);
+        if (!ok || ec) {
+            std::cerr << "ERROR: Could not write checkpoint '" << filename << "'.\n";
+            std::filesystem::remove(temp, ec);
+            return false;
+        }
+        return true;
+    }
+
+    // Read a checkpoint. Returns false if the file is missing or malformed, including when the
+    // file is not exactly as long as its header's size says, so a corrupt size is never allocated.
+    bool load(const std::string& filename) {
+        std::error_code ec;
+        auto file_size = std::filesystem::file_size(filename, ec);
+        if (ec) return false;
+
+        FILE* in = fopen(filename.c_str(), "rb");
+        if (!in) return false;
+
+        bool ok = fread(&header, sizeof(header), 1, in) == 1
+               && memcmp(header.magic, render_checkpoint_magic, sizeof(header.magic)) == 0
+               && header.version == render_checkpoint_version
+               && header.width > 0 && header.height > 0;
+
+        auto pixels = ok ? static_cast<uint64_t>(header.width) * static_cast<uint64_t>(header.height) : 0;
+        const uint64_t pixel_size = sizeof(color) + sizeof(double) + sizeof(uint32_t);
+        ok = ok && file_size >= sizeof(header)
+                && (file_size - sizeof(header)) % pixel_size == 0
+                && (file_size - sizeof(header)) / pixel_size == pixels;
+
+        if (ok) {
+            accumulated.resize(pixels);
+            luminance_squared.resize(pixels);
+            sample_counts.resize(pixels);
+            ok = fread(accumulated.data(), sizeof(color), pixels, in) == pixels
+              && fread(luminance_squared.data(), sizeof(double), pixels, in) == pixels
+              && fread(sample_counts.data(), sizeof(uint32_t), pixels, in) == pixels;
+        }
+
+        fclose(in);
+        return ok;
+    }
+};
+
+#endif
@@ -0,0 +1,979 @@
+#ifndef COMPILED_SCENE_H
+#define COMPILED_SCENE_H
+
+#include "helper.h"
+
+#include "hittable.h"
+#include "mapped_file.h"
+#include "material.h"
+#include "scene_loader.h"
+#include "sphere.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Compiled scene cache (".rtsc")
+// ------------------------------
+// A scene_description flattened into plain arrays that can be written once and then used straight
+// out of a memory mapping: a flat BVH, primitives as structure-of-arrays, and small texture and
+// material tables. Loading maps the file, checks the header, and points compiled_scene at the
+// sections ("pointer fix-up"); only the handful of texture and material objects are rebuilt.
+//
+// Transforms are folded into the primitives: each primitive may carry a rigid world-to-object
+// transform, so a rotated, translated box becomes six quads sharing one transform record. Media
+// are primitives too, whose boundary is a list of ordinary primitives kept outside the BVH.
+//
+// The header stores a hash of the scene text, so a cache is only used for the exact scene file it
+// was compiled from. Files are written in host byte order and are not meant to be portable.
+
+const char compiled_scene_magic[8] = { 'R', 'T', 'W', 'S', 'C', 'N', '\0', '\1' };
+const uint32_t compiled_scene_version = 3;
+
+// Section ids. Sphere and quad geometry are structure-of-arrays: section `sphere_geometry` holds
+// sphere_fields arrays of sphere_count doubles each, one after another.
+enum compiled_section {
+    cs_sphere_geometry, cs_sphere_material, cs_sphere_transform,
+    cs_quad_geometry, cs_quad_material, cs_quad_transform,
+    cs_media, cs_transforms, cs_primitives, cs_boundaries, cs_nodes,
+    cs_textures, cs_materials, cs_strings,
+    cs_section_count
+};
+
+// Sphere fields: center1 xyz, motion vector xyz, radius
+const int sphere_fields = 7;
+// Quad fields: Q xyz, u xyz, v xyz, normal xyz, D, w xyz
+const int quad_fields = 16;
+
+// Primitive references pack a type into the top bits and an index into the rest.
+const uint32_t prim_sphere = 0u << 30;
+const uint32_t prim_quad = 1u << 30;
+const uint32_t prim_medium = 2u << 30;
+const uint32_t prim_index_mask = (1u << 30) - 1;
+
+struct compiled_section_entry {
+    uint64_t offset;    // Byte offset from the start of the file
+    uint64_t count;     // Number of elements (doubles for geometry, records otherwise)
+};
+
+struct compiled_camera {
+    double aspect_ratio;
+    int32_t image_width, samples_per_pixel, max_depth, fixed_height;
+    double background[3];
+    double vfov;
+    double lookfrom[3], lookat[3], vup[3];
+    double defocus_angle, focus_dist;
+};
+
+struct compiled_scene_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t section_count;
+    uint64_t source_hash;   // Hash of the scene text this was compiled from
+    uint64_t sphere_count;
+    uint64_t quad_count;
+    compiled_camera camera;
+    compiled_section_entry sections[cs_section_count];
+};
+
+// Rigid transform from world to object space: object = m * world + t. Its inverse is the
+// transpose, so object-space hit points go back with world = m^T * (object - t).
+struct compiled_transform {
+    double m[9];
+    double t[3];
+};
+
+struct compiled_medium {
+    uint32_t first_boundary;  // Range of boundary primitives in the cs_boundaries section
+    uint32_t boundary_count;
+    int32_t texture;          // Phase function albedo
+    uint32_t pad;
+    double neg_inv_density;
+};
+
+// Flat BVH node. Leaves (count > 0) cover primitives [offset, offset + count) of cs_primitives;
+// interior nodes have their left child right after them and their right child at `offset`.
+struct compiled_bvh_node {
+    double bounds[6];         // min xyz, max xyz
+    uint32_t offset;
+    uint32_t count;
+};
+
+struct compiled_texture {
+    uint32_t kind;
+    int32_t even, odd;
+    uint32_t seed;
+    int32_t bake_resolution;
+    uint32_t filename;        // Offset of the image file name in cs_strings
+    double value[3];
+    double scale;
+    double bake_period;
+    double bake_origin[3];
+};
+
+struct compiled_material {
+    uint32_t kind;
+    int32_t texture;
+    double param;
+};
+
+// Ties a cache to the exact scene text it was compiled from (see fnv1a_hash in scene_loader.h).
+inline uint64_t scene_text_hash(const std::string& text) {
+    auto hash = fnv1a_hash(&compiled_scene_version, sizeof(compiled_scene_version));
+    return fnv1a_hash(text.data(), text.size(), hash);
+}
+
+// Flattens a scene_description into the compiled scene byte layout.
+class scene_compiler {
+public:
+    // Compile the scene into `bytes`. Returns false (after printing why) if the description
+    // can't be compiled.
+    bool compile(const scene_description& desc, uint64_t source_hash, std::vector<unsigned char>& bytes) {
+        this->desc = &desc;
+
+        compiled_transform identity{};
+        identity.m[0] = identity.m[4] = identity.m[8] = 1;
+
+        for (auto index : desc.world)
+            emit(index, identity, primitives);
+
+        build_bvh();
+        write(desc, source_hash, bytes);
+        return true;
+    }
+
+private:
+    struct primitive_info {
+        uint32_t ref;
+        aabb box;
+        point3 centroid;
+    };
+
+    const scene_description* desc = nullptr;
+    std::vector<double> sphere_data[sphere_fields];
+    std::vector<uint32_t> sphere_material;
+    std::vector<int32_t> sphere_transform;
+    std::vector<double> quad_data[quad_fields];
+    std::vector<uint32_t> quad_material;
+    std::vector<int32_t> quad_transform;
+    std::vector<compiled_medium> media;
+    std::vector<compiled_transform> transforms;
+    std::vector<primitive_info> primitives;   // Top-level primitives, reordered by the BVH build
+    std::vector<uint32_t> boundaries;
+    std::vector<aabb> medium_boxes;
+    std::vector<compiled_bvh_node> nodes;
+
+    // Compose a wrapper's world-to-object transform `outer` with the next one in, `inner`.
+    static compiled_transform compose(const compiled_transform& inner, const compiled_transform& outer) {
+        compiled_transform r{};
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++)
+                for (int k = 0; k < 3; k++)
+                    r.m[3 * i + j] += inner.m[3 * i + k] * outer.m[3 * k + j];
+            r.t[i] = inner.t[i];
+            for (int k = 0; k < 3; k++)
+                r.t[i] += inner.m[3 * i + k] * outer.t[k];
+        }
+        return r;
+    }
+
+    static compiled_transform rotation(int axis, double degrees) {
+        auto radians = degrees_to_radians(degrees);
+        auto s = sin(radians), c = cos(radians);
+        compiled_transform x{};
+        // Matches the world-to-object rotations applied by rotate_x, rotate_y and rotate_z
+        double rx[9] = { 1, 0, 0,  0, c, s,  0, -s, c };
+        double ry[9] = { c, 0, -s,  0, 1, 0,  s, 0, c };
+        double rz[9] = { c, s, 0,  -s, c, 0,  0, 0, 1 };
+        memcpy(x.m, axis == 0 ? rx : axis == 1 ? ry : rz, sizeof(x.m));
+        return x;
+    }
+
+    static bool is_identity(const compiled_transform& x) {
+        static const double identity[9] = { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+        return memcmp(x.m, identity, sizeof(identity)) == 0 && x.t[0] == 0 && x.t[1] == 0 && x.t[2] == 0;
+    }
+
+    // World-space bounds of an object-space box under transform x.
+    static aabb to_world(const aabb& box, const compiled_transform& x) {
+        point3 min(infinity, infinity, infinity);
+        point3 max(-infinity, -infinity, -infinity);
+        for (int i = 0; i < 8; i++) {
+            vec3 p((i & 1) ? box.x.max : box.x.min, (i & 2) ? box.y.max : box.y.min, (i & 4) ? box.z.max : box.z.min);
+            vec3 q = p - vec3(x.t[0], x.t[1], x.t[2]);
+            for (int c = 0; c < 3; c++) {
+                auto w = x.m[c] * q[0] + x.m[3 + c] * q[1] + x.m[6 + c] * q[2];
+                min[c] = fmin(min[c], w);
+                max[c] = fmax(max[c], w);
+            }
+        }
+        return aabb(min, max);
+    }
+
+    int32_t transform_id(const compiled_transform& x) {
+        if (is_identity(x)) return -1;
+        transforms.push_back(x);
+        return static_cast<int32_t>(transforms.size() - 1);
+    }
+
+    void add_primitive(uint32_t ref, const aabb& box, std::vector<primitive_info>& out) {
+        primitive_info info;
+        info.ref = ref;
+        info.box = box;
+        info.centroid = point3(0.5 * (box.x.min + box.x.max), 0.5 * (box.y.min + box.y.max), 0.5 * (box.z.min + box.z.max));
+        out.push_back(info);
+    }
+
+    void add_quad(const point3& Q, const vec3& u, const vec3& v, uint32_t material, int32_t xform,
+                  const compiled_transform& x, std::vector<primitive_info>& out) {
+        auto n = cross(u, v);
+        auto normal = unit_vector(n);
+        auto w = n / dot(n, n);
+        double fields[quad_fields] = {
+            Q.x(), Q.y(), Q.z(), u.x(), u.y(), u.z(), v.x(), v.y(), v.z(),
+            normal.x(), normal.y(), normal.z(), dot(normal, Q), w.x(), w.y(), w.z()
+        };
+        for (int f = 0; f < quad_fields; f++)
+            quad_data[f].push_back(fields[f]);
+        quad_material.push_back(material);
+        quad_transform.push_back(xform);
+
+        auto ref = prim_quad | static_cast<uint32_t>(quad_material.size() - 1);
+        add_primitive(ref, to_world(aabb(Q, Q + u + v).pad(), x), out);
+    }
+
+    // Append the primitives of shape `index`, under world-to-object transform x, to out.
+    void emit(int index, const compiled_transform& x, std::vector<primitive_info>& out) {
+        const auto& s = desc->shapes[index];
+        switch (s.kind) {
+        case scene_shape_desc::sphere:
+        case scene_shape_desc::moving_sphere: {
+            auto motion = (s.kind == scene_shape_desc::moving_sphere) ? s.b - s.a : vec3(0, 0, 0);
+            double fields[sphere_fields] = { s.a.x(), s.a.y(), s.a.z(), motion.x(), motion.y(), motion.z(), s.value };
+            for (int f = 0; f < sphere_fields; f++)
+                sphere_data[f].push_back(fields[f]);
+            sphere_material.push_back(static_cast<uint32_t>(s.material));
+            sphere_transform.push_back(transform_id(x));
+
+            auto rvec = vec3(s.value, s.value, s.value);
+            aabb box(aabb(s.a - rvec, s.a + rvec), aabb(s.a + motion - rvec, s.a + motion + rvec));
+            add_primitive(prim_sphere | static_cast<uint32_t>(sphere_material.size() - 1), to_world(box, x), out);
+            break;
+        }
+        case scene_shape_desc::quad:
+            add_quad(s.a, s.b, s.c, s.material, transform_id(x), x, out);
+            break;
+        case scene_shape_desc::box: {
+            // Same six sides as box() in quad.h
+            auto xform = transform_id(x);
+            auto mat = static_cast<uint32_t>(s.material);
+            auto min = point3(fmin(s.a.x(), s.b.x()), fmin(s.a.y(), s.b.y()), fmin(s.a.z(), s.b.z()));
+            auto max = point3(fmax(s.a.x(), s.b.x()), fmax(s.a.y(), s.b.y()), fmax(s.a.z(), s.b.z()));
+            auto dx = vec3(max.x() - min.x(), 0, 0);
+            auto dy = vec3(0, max.y() - min.y(), 0);
+            auto dz = vec3(0, 0, max.z() - min.z());
+            add_quad(point3(min.x(), min.y(), max.z()), dx, dy, mat, xform, x, out);
+            add_quad(point3(max.x(), min.y(), max.z()), -dz, dy, mat, xform, x, out);
+            add_quad(point3(max.x(), min.y(), min.z()), -dx, dy, mat, xform, x, out);
+            add_quad(point3(min.x(), min.y(), min.z()), dz, dy, mat, xform, x, out);
+            add_quad(point3(min.x(), max.y(), max.z()), dx, -dz, mat, xform, x, out);
+            add_quad(point3(min.x(), min.y(), min.z()), dx, dz, mat, xform, x, out);
+            break;
+        }
+        case scene_shape_desc::translate: {
+            compiled_transform inner{};
+            inner.m[0] = inner.m[4] = inner.m[8] = 1;
+            inner.t[0] = -s.a.x();
+            inner.t[1] = -s.a.y();
+            inner.t[2] = -s.a.z();
+            emit(s.child, compose(inner, x), out);
+            break;
+        }
+        case scene_shape_desc::rotate_x:
+        case scene_shape_desc::rotate_y:
+        case scene_shape_desc::rotate_z: {
+            auto axis = s.kind - scene_shape_desc::rotate_x;
+            emit(s.child, compose(rotation(axis, s.value), x), out);
+            break;
+        }
+        case scene_shape_desc::medium: {
+            std::vector<primitive_info> boundary;
+            emit(s.child, x, boundary);
+
+            compiled_medium medium{};
+            medium.first_boundary = static_cast<uint32_t>(boundaries.size());
+            medium.boundary_count = static_cast<uint32_t>(boundary.size());
+            medium.texture = s.texture;
+            medium.neg_inv_density = -1 / s.value;
+
+            aabb box;
+            for (const auto& b : boundary) {
+                boundaries.push_back(b.ref);
+                box = aabb(box, b.box);
+            }
+            media.push_back(medium);
+            add_primitive(prim_medium | static_cast<uint32_t>(media.size() - 1), box, out);
+            break;
+        }
+        }
+    }
+
+    // Median-split BVH over the top-level primitives, with up to four primitives per leaf.
+    void build_bvh() {
+        nodes.clear();
+        if (primitives.empty()) return;
+        build_node(0, primitives.size());
+    }
+
+    uint32_t build_node(size_t start, size_t end) {
+        auto node_index = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+
+        aabb box, centroids;
+        for (size_t i = start; i < end; i++) {
+            box = aabb(box, primitives[i].box);
+            centroids = aabb(centroids, aabb(primitives[i].centroid, primitives[i].centroid));
+        }
+
+        compiled_bvh_node node{};
+        double bounds[6] = { box.x.min, box.y.min, box.z.min, box.x.max, box.y.max, box.z.max };
+        memcpy(node.bounds, bounds, sizeof(bounds));
+
+        const size_t max_leaf_size = 4;
+        if (end - start <= max_leaf_size) {
+            node.offset = static_cast<uint32_t>(start);
+            node.count = static_cast<uint32_t>(end - start);
+            nodes[node_index] = node;
+            return node_index;
+        }
+
+        int axis = 0;
+        for (int a = 1; a < 3; a++)
+            if (centroids.axis(a).size() > centroids.axis(axis).size()) axis = a;
+
+        auto mid = start + (end - start) / 2;
+        std::nth_element(primitives.begin() + start, primitives.begin() + mid, primitives.begin() + end,
+            [axis](const primitive_info& a, const primitive_info& b) { return a.centroid[axis] < b.centroid[axis]; });
+
+        build_node(start, mid);
+        node.offset = build_node(mid, end);
+        node.count = 0;
+        nodes[node_index] = node;
+        return node_index;
+    }
+
+    template <typename T>
+    static void append_section(std::vector<unsigned char>& bytes, compiled_section_entry& entry,
+                               const T* data, size_t count, size_t element_count) {
+        while (bytes.size() % 64) bytes.push_back(0);
+        entry.offset = bytes.size();
+        entry.count = element_count;
+        auto p = reinterpret_cast<const unsigned char*>(data);
+        bytes.insert(bytes.end(), p, p + count * sizeof(T));
+    }
+
+    template <typename T>
+    static void append_section(std::vector<unsigned char>& bytes, compiled_section_entry& entry,
+                               const std::vector<T>& data) {
+        append_section(bytes, entry, data.data(), data.size(), data.size());
+    }
+
+    void write(const scene_description& d, uint64_t source_hash, std::vector<unsigned char>& bytes) {
+        compiled_scene_header header{};
+        memcpy(header.magic, compiled_scene_magic, sizeof(header.magic));
+        header.version = compiled_scene_version;
+        header.section_count = cs_section_count;
+        header.source_hash = source_hash;
+        header.sphere_count = sphere_material.size();
+        header.quad_count = quad_material.size();
+
+        auto& c = header.camera;
+        c.aspect_ratio = d.cam.aspect_ratio;
+        c.image_width = d.cam.image_width;
+        c.fixed_height = d.cam.fixed_height;
+        c.samples_per_pixel = d.cam.samples_per_pixel;
+        c.max_depth = d.cam.max_depth;
+        c.vfov = d.cam.vfov;
+        c.defocus_angle = d.cam.defocus_angle;
+        c.focus_dist = d.cam.focus_dist;
+        for (int i = 0; i < 3; i++) {
+            c.background[i] = d.cam.background[i];
+            c.lookfrom[i] = d.cam.lookfrom[i];
+            c.lookat[i] = d.cam.lookat[i];
+            c.vup[i] = d.cam.vup[i];
+        }
+
+        std::vector<double> sphere_soa, quad_soa;
+        for (const auto& field : sphere_data) sphere_soa.insert(sphere_soa.end(), field.begin(), field.end());
+        for (const auto& field : quad_data) quad_soa.insert(quad_soa.end(), field.begin(), field.end());
+
+        std::vector<uint32_t> refs;
+        for (const auto& p : primitives) refs.push_back(p.ref);
+
+        std::vector<compiled_texture> textures;
+        std::string strings(1, '\0');
+        for (const auto& t : d.textures) {
+            compiled_texture ct{};
+            ct.kind = t.kind;
+            ct.even = t.even;
+            ct.odd = t.odd;
+            ct.seed = t.seed;
+            ct.bake_resolution = t.bake_resolution;
+            ct.bake_period = t.bake_period;
+            for (int i = 0; i < 3; i++) ct.bake_origin[i] = t.bake_origin[i];
+            ct.scale = t.scale;
+            for (int i = 0; i < 3; i++) ct.value[i] = t.value[i];
+            if (!t.filename.empty()) {
+                ct.filename = static_cast<uint32_t>(strings.size());
+                strings += t.filename;
+                strings += '\0';
+            }
+            textures.push_back(ct);
+        }
+
+        std::vector<compiled_material> materials;
+        for (const auto& m : d.materials) {
+            compiled_material cm{};
+            cm.kind = m.kind;
+            cm.texture = m.texture;
+            cm.param = m.param;
+            materials.push_back(cm);
+        }
+
+        bytes.assign(sizeof(header), 0);
+        auto* s = header.sections;
+        append_section(bytes, s[cs_sphere_geometry], sphere_soa);
+        append_section(bytes, s[cs_sphere_material], sphere_material);
+        append_section(bytes, s[cs_sphere_transform], sphere_transform);
+        append_section(bytes, s[cs_quad_geometry], quad_soa);
+        append_section(bytes, s[cs_quad_material], quad_material);
+        append_section(bytes, s[cs_quad_transform], quad_transform);
+        append_section(bytes, s[cs_media], media);
+        append_section(bytes, s[cs_transforms], transforms);
+        append_section(bytes, s[cs_primitives], refs);
+        append_section(bytes, s[cs_boundaries], boundaries);
+        append_section(bytes, s[cs_nodes], nodes);
+        append_section(bytes, s[cs_textures], textures);
+        append_section(bytes, s[cs_materials], materials);
+        append_section(bytes, s[cs_strings], strings.data(), strings.size(), strings.size());
+        memcpy(bytes.data(), &header, sizeof(header));
+    }
+};
+
+// A compiled scene used in place: a hittable that traverses the flat BVH and intersects the SoA
+// primitive arrays directly from the mapped (or in-memory) compiled bytes.
+class compiled_scene : public hittable {
+public:
+    // Use a compiled scene held in memory.
+    compiled_scene(std::vector<unsigned char> bytes, uint64_t source_hash) : owned(std::move(bytes)) {
+        valid = attach(owned.data(), owned.size(), source_hash);
+    }
+
+    // Use a compiled scene file, if it exists and was compiled from text with the given hash.
+    compiled_scene(const std::string& filename, uint64_t source_hash) {
+        valid = file.open(filename) && attach(file.data(), file.size(), source_hash);
+    }
+
+    bool is_valid() const { return valid; }
+
+    // Apply the camera settings stored with the scene.
+    void apply_camera(camera& cam) const {
+        const auto& c = header->camera;
+        cam.aspect_ratio = c.aspect_ratio;
+        cam.image_width = c.image_width;
+        cam.fixed_height = c.fixed_height;
+        cam.samples_per_pixel = c.samples_per_pixel;
+        cam.max_depth = c.max_depth;
+        cam.background = color(c.background[0], c.background[1], c.background[2]);
+        cam.vfov = c.vfov;
+        cam.lookfrom = point3(c.lookfrom[0], c.lookfrom[1], c.lookfrom[2]);
+        cam.lookat = point3(c.lookat[0], c.lookat[1], c.lookat[2]);
+        cam.vup = vec3(c.vup[0], c.vup[1], c.vup[2]);
+        cam.defocus_angle = c.defocus_angle;
+        cam.focus_dist = c.focus_dist;
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (node_count == 0) return false;
+
+        uint32_t stack[64];     // Deep enough for any tree attach() accepts
+        int stack_size = 0;
+        uint32_t node_index = 0;
+        bool hit_anything = false;
+
+        while (true) {
+            const auto& node = nodes[node_index];
+            RT_STAT(bvh_nodes);
+            if (box_hit(node.bounds, r, ray_t)) {
+                if (node.count > 0) {
+                    for (uint32_t i = 0; i < node.count; i++) {
+                        if (hit_primitive(primitives[node.offset + i], r, ray_t, rec)) {
+                            hit_anything = true;
+                            ray_t.max = rec.t;
+                        }
+                    }
+                }
+                else {
+                    stack[stack_size++] = node.offset;
+                    node_index = node_index + 1;
+                    continue;
+                }
+            }
+
+            if (stack_size == 0) break;
+            node_index = stack[--stack_size];
+        }
+
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+private:
+    mapped_file file;
+    std::vector<unsigned char> owned;
+    bool valid = false;
+    aabb bbox;
+
+    // Views into the compiled bytes
+    const compiled_scene_header* header = nullptr;
+    size_t sphere_count = 0, quad_count = 0;
+    const double* sphere[sphere_fields] = {};
+    const uint32_t* sphere_material = nullptr;
+    const int32_t* sphere_transform = nullptr;
+    const double* quad[quad_fields] = {};
+    const uint32_t* quad_material = nullptr;
+    const int32_t* quad_transform = nullptr;
+    const compiled_medium* media = nullptr;
+    const compiled_transform* transforms = nullptr;
+    const uint32_t* primitives = nullptr;
+    const uint32_t* boundaries = nullptr;
+    const compiled_bvh_node* nodes = nullptr;
+    size_t node_count = 0;
+    size_t medium_count = 0, transform_count = 0, primitive_count = 0, boundary_count = 0;
+
+    // Rebuilt objects, owned by the arena
+    shared_ptr<scene_arena> arena;
+    std::vector<shared_ptr<material>> materials;
+    std::vector<shared_ptr<material>> phase_functions;   // One per medium
+
+    template <typename T>
+    bool section(const unsigned char* base, size_t size, compiled_section id, size_t element_size,
+                 const T*& out, size_t& count) {
+        const auto& entry = header->sections[id];
+        if (entry.offset % alignof(T) != 0 || entry.offset > size || entry.count * element_size > size - entry.offset)
+            return false;
+        out = reinterpret_cast<const T*>(base + entry.offset);
+        count = static_cast<size_t>(entry.count);
+        return true;
+    }
+
+    // Validate the header and point the views at the sections. Returns false on any mismatch.
+    bool attach(const unsigned char* base, size_t size, uint64_t source_hash) {
+        if (!base || size < sizeof(compiled_scene_header)) return false;
+        header = reinterpret_cast<const compiled_scene_header*>(base);
+        if (memcmp(header->magic, compiled_scene_magic, sizeof(header->magic)) != 0) return false;
+        if (header->version != compiled_scene_version || header->section_count != cs_section_count) return false;
+        if (header->source_hash != source_hash) return false;
+
+        sphere_count = static_cast<size_t>(header->sphere_count);
+        quad_count = static_cast<size_t>(header->quad_count);
+
+        const double* sphere_soa;
+        const double* quad_soa;
+        const compiled_texture* textures;
+        const compiled_material* material_records;
+        const char* strings;
+        size_t n, sphere_values, quad_values, texture_count, material_count, string_count;
+        bool ok = section(base, size, cs_sphere_geometry, sizeof(double), sphere_soa, sphere_values)
+               && section(base, size, cs_sphere_material, sizeof(uint32_t), sphere_material, n) && n == sphere_count
+               && section(base, size, cs_sphere_transform, sizeof(int32_t), sphere_transform, n) && n == sphere_count
+               && section(base, size, cs_quad_geometry, sizeof(double), quad_soa, quad_values)
+               && section(base, size, cs_quad_material, sizeof(uint32_t), quad_material, n) && n == quad_count
+               && section(base, size, cs_quad_transform, sizeof(int32_t), quad_transform, n) && n == quad_count
+               && section(base, size, cs_media, sizeof(compiled_medium), media, medium_count)
+               && section(base, size, cs_transforms, sizeof(compiled_transform), transforms, transform_count)
+               && section(base, size, cs_primitives, sizeof(uint32_t), primitives, primitive_count)
+               && section(base, size, cs_boundaries, sizeof(uint32_t), boundaries, boundary_count)
+               && section(base, size, cs_nodes, sizeof(compiled_bvh_node), nodes, node_count)
+               && section(base, size, cs_textures, sizeof(compiled_texture), textures, texture_count)
+               && section(base, size, cs_materials, sizeof(compiled_material), material_records, material_count)
+               && section(base, size, cs_strings, 1, strings, string_count)
+               && sphere_values == sphere_count * sphere_fields
+               && quad_values == quad_count * quad_fields
+               && string_count > 0 && strings[string_count - 1] == '\0'
+               && tables_valid(textures, texture_count, material_records, material_count, string_count)
+               && geometry_valid(material_count, texture_count)
+               && tree_valid();
+        if (!ok) return false;
+
+        for (int f = 0; f < sphere_fields; f++) sphere[f] = sphere_soa + f * sphere_count;
+        for (int f = 0; f < quad_fields; f++) quad[f] = quad_soa + f * quad_count;
+
+        if (node_count > 0) {
+            const auto& b = nodes[0].bounds;
+            bbox = aabb(point3(b[0], b[1], b[2]), point3(b[3], b[4], b[5]));
+        }
+
+        // Rebuild the texture and material objects through the regular scene builder
+        scene_description desc;
+        for (size_t i = 0; i < texture_count; i++) {
+            const auto& ct = textures[i];
+            scene_texture_desc t;
+            t.kind = static_cast<scene_texture_desc::kind_t>(ct.kind);
+            t.value = color(ct.value[0], ct.value[1], ct.value[2]);
+            t.scale = ct.scale;
+            t.even = ct.even;
+            t.odd = ct.odd;
+            t.seed = ct.seed;
+            t.bake_resolution = ct.bake_resolution;
+            t.bake_period = ct.bake_period;
+            t.bake_origin = point3(ct.bake_origin[0], ct.bake_origin[1], ct.bake_origin[2]);
+            if (ct.filename) t.filename = strings + ct.filename;
+            desc.textures.push_back(t);
+        }
+        for (size_t i = 0; i < material_count; i++) {
+            scene_material_desc m;
+            m.kind = static_cast<scene_material_desc::kind_t>(material_records[i].kind);
+            m.texture = material_records[i].texture;
+            m.param = material_records[i].param;
+            desc.materials.push_back(m);
+        }
+
+        scene_builder builder(desc);
+        arena = builder.arena;
+        for (size_t i = 0; i < material_count; i++)
+            materials.push_back(builder.material_at(static_cast<int>(i)));
+        for (size_t i = 0; i < medium_count; i++)
+            phase_functions.push_back(arena->make<isotropic>(builder.texture_at(media[i].texture)));
+
+        return true;
+    }
+
+    // The checks below run once at attach, so a corrupt cache whose hash still matches is
+    // recompiled rather than read out of bounds.
+
+    // Texture and material records: known kinds, sub-texture and texture indices in range (a
+    // checker only refers to earlier textures, so there are no cycles), names inside cs_strings,
+    // and noise bakes the parser would accept.
+    static bool tables_valid(const compiled_texture* textures, size_t texture_count,
+                             const compiled_material* material_records, size_t material_count, size_t string_count) {
+        for (size_t i = 0; i < texture_count; i++) {
+            const auto& t = textures[i];
+            if (t.kind > scene_texture_desc::image || t.filename >= string_count) return false;
+            if (t.bake_resolution < 0 || t.bake_resolution > max_bake_resolution
+                || (t.bake_resolution > 0 && !(t.bake_period > 0)))
+                return false;
+            if (t.kind == scene_texture_desc::checker
+                && (t.even < 0 || t.odd < 0 || static_cast<size_t>(t.even) >= i || static_cast<size_t>(t.odd) >= i))
+                return false;
+        }
+        for (size_t i = 0; i < material_count; i++) {
+            const auto& m = material_records[i];
+            if (m.kind > scene_material_desc::isotropic) return false;
+            if (m.kind != scene_material_desc::dielectric
+                && (m.texture < 0 || static_cast<size_t>(m.texture) >= texture_count))
+                return false;
+        }
+        return true;
+    }
+
+    // A primitive reference of a known type whose index is in range. Media may only contain
+    // media listed before them (`medium_limit`), as the compiler emits them, so there are no cycles.
+    bool ref_valid(uint32_t ref, size_t medium_limit) const {
+        auto index = ref & prim_index_mask;
+        switch (ref & ~prim_index_mask) {
+        case prim_sphere: return index < sphere_count;
+        case prim_quad:   return index < quad_count;
+        case prim_medium: return index < medium_limit;
+        default:          return false;
+        }
+    }
+
+    // Per-primitive materials and transforms, media and their boundaries, and the top-level
+    // primitive list.
+    bool geometry_valid(size_t material_count, size_t texture_count) const {
+        auto transform_valid = [&](int32_t x) { return x >= -1 && (x < 0 || static_cast<size_t>(x) < transform_count); };
+        for (size_t i = 0; i < sphere_count; i++)
+            if (sphere_material[i] >= material_count || !transform_valid(sphere_transform[i])) return false;
+        for (size_t i = 0; i < quad_count; i++)
+            if (quad_material[i] >= material_count || !transform_valid(quad_transform[i])) return false;
+
+        for (size_t i = 0; i < medium_count; i++) {
+            const auto& m = media[i];
+            if (m.texture < 0 || static_cast<size_t>(m.texture) >= texture_count) return false;
+            if (uint64_t(m.first_boundary) + m.boundary_count > boundary_count) return false;
+            for (uint32_t b = 0; b < m.boundary_count; b++)
+                if (!ref_valid(boundaries[m.first_boundary + b], i)) return false;
+        }
+
+        for (size_t i = 0; i < primitive_count; i++)
+            if (!ref_valid(primitives[i], medium_count)) return false;
+        return true;
+    }
+
+    // Walk the BVH the way hit() does: every leaf range inside cs_primitives, children after their
+    // parent and each node reached once, and the traversal stack never deeper than hit()'s.
+    bool tree_valid() const {
+        if (node_count == 0) return true;
+
+        const int max_stack = 64;
+        uint32_t stack[max_stack];
+        int stack_size = 0;
+        size_t node_index = 0, visited = 0;
+        while (true) {
+            if (++visited > node_count) return false;
+            const auto& node = nodes[node_index];
+            if (node.count > 0) {
+                if (uint64_t(node.offset) + node.count > primitive_count) return false;
+                if (stack_size == 0) break;
+                node_index = stack[--stack_size];
+                continue;
+            }
+            if (node_index + 1 >= node_count || node.offset <= node_index + 1 || node.offset >= node_count
+                || stack_size == max_stack)
+                return false;
+            stack[stack_size++] = node.offset;
+            node_index++;
+        }
+        return visited == node_count;
+    }
+
+    static bool box_hit(const double* b, const ray& r, interval ray_t) {
+        RT_STAT(box_tests);
+        for (int a = 0; a < 3; a++) {
+            auto invD = 1 / r.direction()[a];
+            auto orig = r.origin()[a];
+
+            auto t0 = (b[a] - orig) * invD;
+            auto t1 = (b[a + 3] - orig) * invD;
+
+            if (invD < 0)
+                std::swap(t0, t1);
+
+            if (t0 > ray_t.min) ray_t.min = t0;
+            if (t1 < ray_t.max) ray_t.max = t1;
+
+            if (ray_t.max <= ray_t.min)
+                return false;
+        }
+        return true;
+    }
+
+    bool hit_primitive(uint32_t ref, const ray& r, interval ray_t, hit_record& rec) const {
+        auto index = ref & prim_index_mask;
+        auto type = ref & ~prim_index_mask;
+
+        if (type == prim_medium)
+            return hit_medium(index, r, ray_t, rec);
+
+        auto xform = (type == prim_sphere) ? sphere_transform[index] : quad_transform[index];
+        if (xform < 0)
+            return (type == prim_sphere) ? hit_sphere(index, r, ray_t, rec) : hit_quad(index, r, ray_t, rec);
+
+        // Intersect in object space, then bring the hit point and normal back to world space
+        const auto& x = transforms[xform];
+        auto o = r.origin();
+        auto d = r.direction();
+        ray object_ray(
+            point3(x.m[0] * o[0] + x.m[1] * o[1] + x.m[2] * o[2] + x.t[0],
+                   x.m[3] * o[0] + x.m[4] * o[1] + x.m[5] * o[2] + x.t[1],
+                   x.m[6] * o[0] + x.m[7] * o[1] + x.m[8] * o[2] + x.t[2]),
+            vec3(x.m[0] * d[0] + x.m[1] * d[1] + x.m[2] * d[2],
+                 x.m[3] * d[0] + x.m[4] * d[1] + x.m[5] * d[2],
+                 x.m[6] * d[0] + x.m[7] * d[1] + x.m[8] * d[2]),
+            r.time());
+
+        bool hit = (type == prim_sphere) ? hit_sphere(index, object_ray, ray_t, rec) : hit_quad(index, object_ray, ray_t, rec);
+        if (!hit) return false;
+
+        auto p = rec.p - vec3(x.t[0], x.t[1], x.t[2]);
+        auto n = rec.normal;
+        for (int c = 0; c < 3; c++) {
+            rec.p[c] = x.m[c] * p[0] + x.m[3 + c] * p[1] + x.m[6 + c] * p[2];
+            rec.normal[c] = x.m[c] * n[0] + x.m[3 + c] * n[1] + x.m[6 + c] * n[2];
+        }
+        return true;
+    }
+
+    // Same math as sphere::hit
+    bool hit_sphere(size_t i, const ray& r, interval ray_t, hit_record& rec) const {
+        RT_STAT(sphere_tests);
+        point3 center(sphere[0][i] + r.time() * sphere[3][i],
+                      sphere[1][i] + r.time() * sphere[4][i],
+                      sphere[2][i] + r.time() * sphere[5][i]);
+        auto radius = sphere[6][i];
+        vec3 oc = r.origin() - center;
+
+        auto a = r.direction().length_squared();
+        auto half_b = dot(oc, r.direction());
+        auto c = oc.length_squared() - radius * radius;
+
+        auto discriminant = half_b * half_b - a * c;
+        if (discriminant < 0)
+            return false;
+
+        auto sqrtd = sqrt(discriminant);
+        auto root = (-half_b - sqrtd) / a;
+        if (!ray_t.surrounds(root)) {
+            root = (-half_b + sqrtd) / a;
+            if (!ray_t.surrounds(root))
+                return false;
+        }
+
+        rec.t = root;
+        rec.p = r.at(rec.t);
+        vec3 outward_normal = (rec.p - center) / radius;
+        rec.set_face_normal(r, outward_normal);
+        sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+        rec.mat = materials[sphere_material[i]].get();
+
+        return true;
+    }
+
+    // Same math as quad::hit
+    bool hit_quad(size_t i, const ray& r, interval ray_t, hit_record& rec) const {
+        RT_STAT(quad_tests);
+        vec3 Q(quad[0][i], quad[1][i], quad[2][i]);
+        vec3 u(quad[3][i], quad[4][i], quad[5][i]);
+        vec3 v(quad[6][i], quad[7][i], quad[8][i]);
+        vec3 normal(quad[9][i], quad[10][i], quad[11][i]);
+        auto D = quad[12][i];
+        vec3 w(quad[13][i], quad[14][i], quad[15][i]);
+
+        auto denom = dot(normal, r.direction());
+        if (fabs(denom) < 1e-8)
+            return false;
+
+        auto t = (D - dot(normal, r.origin())) / denom;
+        if (!ray_t.contains(t))
+            return false;
+
+        auto intersection = r.at(t);
+        vec3 planar_hitpt_vector = intersection - Q;
+        auto alpha = dot(w, cross(planar_hitpt_vector, v));
+        auto beta = dot(w, cross(u, planar_hitpt_vector));
+
+        if ((alpha < 0) || (1 < alpha) || (beta < 0) || (1 < beta))
+            return false;
+
+        rec.u = alpha;
+        rec.v = beta;
+        rec.t = t;
+        rec.p = intersection;
+        rec.mat = materials[quad_material[i]].get();
+        rec.set_face_normal(r, normal);
+
+        return true;
+    }
+
+    // Closest hit against a medium's boundary primitives.
+    bool hit_boundary(const compiled_medium& m, const ray& r, interval ray_t, hit_record& rec) const {
+        bool hit_anything = false;
+        for (uint32_t i = 0; i < m.boundary_count; i++) {
+            if (hit_primitive(boundaries[m.first_boundary + i], r, ray_t, rec)) {
+                hit_anything = true;
+                ray_t.max = rec.t;
+            }
+        }
+        return hit_anything;
+    }
+
+    // Same math as constant_medium::hit
+    bool hit_medium(size_t i, const ray& r, interval ray_t, hit_record& rec) const {
+        RT_STAT(medium_tests);
+        const auto& m = media[i];
+        hit_record rec1, rec2;
+
+        if (!hit_boundary(m, r, interval::universe, rec1))
+            return false;
+
+        if (!hit_boundary(m, r, interval(rec1.t + 0.0001, infinity), rec2))
+            return false;
+
+        if (rec1.t < ray_t.min) rec1.t = ray_t.min;
+        if (rec2.t > ray_t.max) rec2.t = ray_t.max;
+
+        if (rec1.t >= rec2.t)
+            return false;
+
+        if (rec1.t < 0)
+            rec1.t = 0;
+
+        auto ray_length = r.direction().length();
+        auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
+        auto hit_distance = m.neg_inv_density * log(random_double());
+
+        if (hit_distance > distance_inside_boundary)
+            return false;
+
+        rec.t = rec1.t + hit_distance / ray_length;
+        rec.p = r.at(rec.t);
+        rec.normal = vec3(1, 0, 0);  // arbitrary
+        rec.front_face = true;     // also arbitrary
+        rec.mat = phase_functions[i].get();
+
+        return true;
+    }
+};
+
+// Load the compiled form of a scene file, compiling it first if there is no up-to-date cache
+// next to it ("<scene file>.rtsc"). The scene's camera settings are applied to cam. Returns null
+// (after printing why) if the scene can't be read or parsed.
+inline shared_ptr<compiled_scene> load_compiled_scene(const std::string& scene_file, camera& cam) {
+    std::string text;
+    if (!read_text_file(scene_file, text)) {
+        std::cerr << "ERROR: Could not open scene file '" << scene_file << "'.\n";
+        return nullptr;
+    }
+
+    auto hash = scene_text_hash(text);
+    auto cache_file = scene_file + ".rtsc";
+
+    auto cached = make_shared<compiled_scene>(cache_file, hash);
+    if (cached->is_valid()) {
+        cached->apply_camera(cam);
+        cam.scene_hash = fnv1a_hash(text.data(), text.size());
+        return cached;
+    }
+
+    scene_description desc;
+    if (!scene_parser().parse(text, scene_file, desc))
+        return nullptr;
+
+    std::vector<unsigned char> bytes;
+    if (!scene_compiler().compile(desc, hash, bytes))
+        return nullptr;
+
+    // Write a temporary file and rename it over the cache: another render may have the old cache
+    // mapped, and truncating it under that render would crash it.
+    auto temp = cache_file + ".partial";
+    FILE* out = fopen(temp.c_str(), "wb");
+    bool written = out && fwrite(bytes.data(), 1, bytes.size(), out) == bytes.size();
+    written = (!out || fclose(out) == 0) && written;
+    std::error_code ec;
+    if (written)
+        std::filesystem::rename(temp, cache_file, ec);
+    if (!written || ec) {
+        std::cerr << "WARNING: Could not write scene cache '" << cache_file << "'.\n";
+        std::filesystem::remove(temp, ec);
+    }
+
+    auto compiled = make_shared<compiled_scene>(std::move(bytes), hash);
+    if (!compiled->is_valid()) {
+        std::cerr << "ERROR: Could not compile scene '" << scene_file << "'.\n";
+        return nullptr;
+    }
+
+    compiled->apply_camera(cam);
+    cam.scene_hash = fnv1a_hash(text.data(), text.size());
+    return compiled;
+}
+
+#endif
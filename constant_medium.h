@@ -4,6 +4,7 @@
 #include "helper.h"
 #include "hittable.h"
 #include "material.h"
+#include "stats.h"
 #include "texture.h"
 
 class constant_medium : public hittable {
@@ -17,6 +18,8 @@ public:
     {}
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        RT_STAT(medium_tests);
+
         // Print occasional samples when debugging. To enable, set enableDebug true.
         const bool enableDebug = false;
         const bool debugging = enableDebug && random_double() < 0.00001;
@@ -58,7 +61,7 @@ public:
 
         rec.normal = vec3(1, 0, 0);  // arbitrary
         rec.front_face = true;     // also arbitrary
-        rec.mat = phase_function;
+        rec.mat = phase_function.get();
 
         return true;
     }
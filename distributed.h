@@ -0,0 +1,544 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "camera.h"
+#include "options.h"
+#include "scene_loader.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Distributed tile rendering
+// --------------------------
+// A coordinator splits the image into tiles and sample ranges ("jobs") and hands them to worker
+// processes over TCP or Unix-domain sockets. Workers render a job with camera::render_tile and
+// send back the tile's sample sums, which the coordinator merges with camera::add_tile:
+//
+//     Raytracing --listen unix:/tmp/rt.sock [--spawn-workers 4] scene.txt     (coordinator)
+//     Raytracing --worker unix:/tmp/rt.sock                                    (each worker)
+//
+// Addresses are "unix:<path>" or "[tcp:]<host>:<port>". On connecting, a worker receives the scene
+// text with the coordinator's final camera settings appended, so workers need no scene files of
+// their own. Image textures are not sent, though: each worker loads them from its own disk, through
+// the usual search locations (see image_path_resolver), so they must be reachable there. A worker
+// that disconnects, dies, or takes longer than --job-timeout over a job is dropped and its job put
+// back in the queue. Jobs cover the same sample ranges as the passes of a local render, so a pixel
+// gets the same samples either way.
+//
+// Messages are a message_header followed by its payload, in host byte order: every process is
+// expected to run the same build on the same architecture.
+
+#ifndef _WIN32
+
+#include <arpa/inet.h>
+#include <csignal>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+enum message_type : uint32_t {
+    msg_scene = 1,   // Coordinator to worker: uint64_t seed, then the scene text
+    msg_job,         // Coordinator to worker: job_message
+    msg_result,      // Worker to coordinator: job_message, then the tile's sums
+    msg_done         // Coordinator to worker: no more jobs
+};
+
+struct message_header {
+    uint32_t type;
+    uint32_t pad;
+    uint64_t size;   // Payload bytes
+};
+
+struct job_message {
+    uint32_t id;
+    int32_t x0, y0, x1, y1;
+    int32_t first_sample, samples;
+    uint32_t pad;
+
+    bool same_job(const job_message& other) const {
+        return id == other.id && x0 == other.x0 && y0 == other.y0 && x1 == other.x1 && y1 == other.y1
+            && first_sample == other.first_sample && samples == other.samples;
+    }
+};
+
+// Largest scene message: the seed and the scene text.
+const size_t max_scene_message_size = size_t(1) << 30;
+
+// A connected stream socket carrying framed messages.
+class message_socket {
+public:
+    message_socket(int fd = -1) : fd(fd) {}
+
+    message_socket(const message_socket&) = delete;
+    message_socket& operator=(const message_socket&) = delete;
+
+    ~message_socket() { close(); }
+
+    int handle() const { return fd; }
+
+    void close() {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+    }
+
+    bool send(message_type type, const void* payload = nullptr, size_t size = 0,
+              const void* extra = nullptr, size_t extra_size = 0) {
+        message_header header{ type, 0, size + extra_size };
+        return send_all(&header, sizeof(header)) && send_all(payload, size) && send_all(extra, extra_size);
+    }
+
+    // Receive a message. Fails on a payload of more than max_size bytes, so a bad header can't
+    // make the receiver allocate an arbitrary amount.
+    bool receive(message_type& type, std::vector<unsigned char>& payload, size_t max_size) {
+        message_header header;
+        if (!receive_all(&header, sizeof(header)) || header.size > max_size) return false;
+        type = static_cast<message_type>(header.type);
+        payload.resize(static_cast<size_t>(header.size));
+        return receive_all(payload.data(), payload.size());
+    }
+
+private:
+    int fd;
+
+    bool send_all(const void* data, size_t size) {
+        auto p = static_cast<const char*>(data);
+        while (size > 0) {
+            auto n = ::send(fd, p, size, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    bool receive_all(void* data, size_t size) {
+        auto p = static_cast<char*>(data);
+        while (size > 0) {
+            auto n = ::recv(fd, p, size, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+};
+
+// Resolve an address into a socket address. Returns false (after printing why) if it's malformed.
+inline bool resolve_address(const std::string& address, sockaddr_storage& storage, socklen_t& length, int& family) {
+    memset(&storage, 0, sizeof(storage));
+
+    if (address.rfind("unix:", 0) == 0) {
+        auto path = address.substr(5);
+        auto& un = reinterpret_cast<sockaddr_un&>(storage);
+        if (path.empty() || path.size() >= sizeof(un.sun_path)) {
+            std::cerr << "ERROR: Bad socket path in '" << address << "'.\n";
+            return false;
+        }
+        un.sun_family = AF_UNIX;
+        memcpy(un.sun_path, path.c_str(), path.size() + 1);
+        length = sizeof(sockaddr_un);
+        family = AF_UNIX;
+        return true;
+    }
+
+    auto host_port = (address.rfind("tcp:", 0) == 0) ? address.substr(4) : address;
+    auto colon = host_port.find_last_of(':');
+    if (colon == std::string::npos) {
+        std::cerr << "ERROR: Address '" << address << "' needs a port.\n";
+        return false;
+    }
+    auto host = host_port.substr(0, colon);
+    auto port = host_port.substr(colon + 1);
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = host.empty() ? AI_PASSIVE : 0;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result) != 0 || !result) {
+        std::cerr << "ERROR: Could not resolve '" << address << "'.\n";
+        return false;
+    }
+    memcpy(&storage, result->ai_addr, result->ai_addrlen);
+    length = static_cast<socklen_t>(result->ai_addrlen);
+    family = result->ai_family;
+    freeaddrinfo(result);
+    return true;
+}
+
+// Open a listening socket. Returns -1 (after printing why) on failure.
+inline int listen_on(const std::string& address) {
+    sockaddr_storage storage;
+    socklen_t length;
+    int family;
+    if (!resolve_address(address, storage, length, family)) return -1;
+
+    int fd = socket(family, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    if (family == AF_UNIX) {
+        unlink(reinterpret_cast<sockaddr_un&>(storage).sun_path);
+    }
+    else {
+        int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    }
+
+    if (bind(fd, reinterpret_cast<sockaddr*>(&storage), length) != 0 || listen(fd, 64) != 0) {
+        std::cerr << "ERROR: Could not listen on '" << address << "': " << strerror(errno) << "\n";
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Connect to a coordinator, retrying for a while in case it isn't listening yet. Returns -1 (after
+// printing why) on failure.
+inline int connect_to(const std::string& address, int attempts = 50) {
+    sockaddr_storage storage;
+    socklen_t length;
+    int family;
+    if (!resolve_address(address, storage, length, family)) return -1;
+
+    for (int attempt = 0; attempt < attempts; attempt++) {
+        int fd = socket(family, SOCK_STREAM, 0);
+        if (fd < 0) break;
+        if (connect(fd, reinterpret_cast<sockaddr*>(&storage), length) == 0) return fd;
+        ::close(fd);
+        usleep(200000);
+    }
+
+    std::cerr << "ERROR: Could not connect to '" << address << "'.\n";
+    return -1;
+}
+
+// Scene text lines that reproduce the camera settings exactly when appended to a scene file.
+inline std::string camera_settings_text(const camera& cam) {
+    char line[256];
+    std::string text = "\n# Settings from the coordinator\n";
+    auto add = [&](const char* field, std::initializer_list<double> values) {
+        auto n = snprintf(line, sizeof(line), "camera %s", field);
+        for (auto value : values)
+            n += snprintf(line + n, sizeof(line) - n, " %.17g", value);
+        text += line;
+        text += '\n';
+    };
+
+    add("aspect_ratio", { cam.aspect_ratio });
+    add("image_width", { double(cam.image_width) });
+    add("fixed_height", { double(cam.fixed_height) });
+    add("samples_per_pixel", { double(cam.samples_per_pixel) });
+    add("max_depth", { double(cam.max_depth) });
+    add("background", { cam.background.x(), cam.background.y(), cam.background.z() });
+    add("vfov", { cam.vfov });
+    add("lookfrom", { cam.lookfrom.x(), cam.lookfrom.y(), cam.lookfrom.z() });
+    add("lookat", { cam.lookat.x(), cam.lookat.y(), cam.lookat.z() });
+    add("vup", { cam.vup.x(), cam.vup.y(), cam.vup.z() });
+    add("defocus_angle", { cam.defocus_angle });
+    add("focus_dist", { cam.focus_dist });
+    return text;
+}
+
+// Start a worker process running this executable. Returns its process id, or -1.
+inline pid_t spawn_worker(const char* executable, const std::string& address, int threads) {
+    auto thread_arg = std::to_string(threads);
+    pid_t pid = fork();
+    if (pid == 0) {
+        const char* args[] = { executable, "--worker", address.c_str(), "--threads", thread_arg.c_str(), nullptr };
+        execvp(executable, const_cast<char* const*>(args));
+        _exit(127);
+    }
+    return pid;
+}
+
+// Render a scene file by handing tiles to workers. Returns the process exit code.
+inline int run_coordinator(const render_options& options, const char* executable) {
+    signal(SIGPIPE, SIG_IGN);
+
+    std::string text;
+    if (!read_text_file(options.scene_file, text)) {
+        std::cerr << "ERROR: Could not open scene file '" << options.scene_file << "'.\n";
+        return 1;
+    }
+
+    scene_description scene;
+    if (!scene_parser().parse(text, options.scene_file, scene))
+        return 1;
+
+    auto& cam = scene.cam;
+    options.apply(cam);
+    cam.begin_tiles();
+    text += camera_settings_text(cam);
+    if (sizeof(uint64_t) + text.size() > max_scene_message_size) {
+        std::cerr << "ERROR: Scene file '" << options.scene_file << "' is too large to send to workers.\n";
+        return 1;
+    }
+    // A result holds the job, then a color and a squared luminance per pixel of a full tile
+    const size_t max_result_size = sizeof(job_message)
+        + static_cast<size_t>(options.tile_size) * options.tile_size * (sizeof(color) + sizeof(double));
+
+    // Jobs cover the tiles of each pass in turn
+    std::deque<job_message> queue;
+    auto pass_size = cam.pass_size();
+    uint32_t next_id = 0;
+    for (int first = 0; first < cam.samples_per_pixel; first += pass_size)
+        for (int y = 0; y < cam.height(); y += options.tile_size)
+            for (int x = 0; x < cam.image_width; x += options.tile_size) {
+                job_message job{};
+                job.id = next_id++;
+                job.x0 = x;
+                job.y0 = y;
+                job.x1 = std::min(x + options.tile_size, cam.image_width);
+                job.y1 = std::min(y + options.tile_size, cam.height());
+                job.first_sample = first;
+                job.samples = std::min(pass_size, cam.samples_per_pixel - first);
+                queue.push_back(job);
+            }
+
+    int listener = listen_on(options.listen_address);
+    if (listener < 0) return 1;
+
+    std::vector<pid_t> children;
+    for (int n = 0; n < options.spawn_workers; n++) {
+        auto pid = spawn_worker(executable, options.listen_address, options.threads >= 0 ? options.threads : 1);
+        if (pid > 0) children.push_back(pid);
+    }
+    auto reap_children = [&]() {
+        while (true) {
+            auto pid = waitpid(-1, nullptr, WNOHANG);
+            if (pid <= 0) break;
+            children.erase(std::remove(children.begin(), children.end(), pid), children.end());
+        }
+    };
+
+    struct worker {
+        std::unique_ptr<message_socket> socket;
+        bool busy = false;
+        job_message job{};
+        std::chrono::steady_clock::time_point job_start;
+    };
+    std::vector<worker> workers;
+    size_t jobs_left = queue.size();
+
+    auto assign = [&](worker& w) {
+        if (queue.empty()) return true;
+        w.job = queue.front();
+        queue.pop_front();
+        w.busy = true;
+        w.job_start = std::chrono::steady_clock::now();
+        return w.socket->send(msg_job, &w.job, sizeof(w.job));
+    };
+
+    auto drop = [&](size_t index, const char* reason) {
+        auto& w = workers[index];
+        if (w.busy) queue.push_front(w.job);
+        std::clog << "\rWorker lost (" << reason << "), " << workers.size() - 1 << " left.          \n";
+        workers.erase(workers.begin() + index);
+    };
+
+    std::uint64_t seed = cam.seed;
+    std::vector<unsigned char> payload;
+    while (jobs_left > 0) {
+        std::vector<pollfd> fds(1 + workers.size());
+        fds[0] = { listener, POLLIN, 0 };
+        for (size_t n = 0; n < workers.size(); n++)
+            fds[n + 1] = { workers[n].socket->handle(), POLLIN, 0 };
+
+        if (poll(fds.data(), fds.size(), 1000) < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "ERROR: poll failed: " << strerror(errno) << "\n";
+            break;
+        }
+
+        for (size_t n = fds.size() - 1; n-- > 0;) {
+            if (!(fds[n + 1].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+            auto& w = workers[n];
+            message_type type;
+            if (!w.socket->receive(type, payload, max_result_size) || type != msg_result
+                || payload.size() < sizeof(job_message)) {
+                drop(n, "disconnected");
+                continue;
+            }
+
+            // Only a result for exactly the job the worker was given is merged, and its tile is
+            // taken from that job, never from the payload.
+            job_message received;
+            memcpy(&received, payload.data(), sizeof(received));
+            auto job = w.job;
+            auto pixels = static_cast<size_t>(job.x1 - job.x0) * (job.y1 - job.y0);
+            if (!w.busy || !job.same_job(received) || payload.size() != sizeof(job) + pixels * (sizeof(color) + sizeof(double))) {
+                drop(n, "bad result");
+                continue;
+            }
+
+            camera_tile tile;
+            tile.x0 = job.x0;
+            tile.y0 = job.y0;
+            tile.x1 = job.x1;
+            tile.y1 = job.y1;
+            tile.first_sample = job.first_sample;
+            tile.samples = job.samples;
+            tile.accumulated.resize(pixels);
+            tile.luminance_squared.resize(pixels);
+            memcpy(tile.accumulated.data(), payload.data() + sizeof(job), pixels * sizeof(color));
+            memcpy(tile.luminance_squared.data(), payload.data() + sizeof(job) + pixels * sizeof(color), pixels * sizeof(double));
+            cam.add_tile(tile);
+
+            w.busy = false;
+            std::clog << "\rJobs remaining: " << --jobs_left << ' ' << std::flush;
+            if (!assign(w))
+                drop(n, "send failed");
+        }
+
+        // A connected worker that stalls would otherwise hold its job forever
+        if (options.job_timeout > 0) {
+            auto now = std::chrono::steady_clock::now();
+            for (size_t n = workers.size(); n-- > 0;) {
+                std::chrono::duration<double> busy_for = now - workers[n].job_start;
+                if (workers[n].busy && busy_for.count() > options.job_timeout)
+                    drop(n, "job timed out");
+            }
+        }
+
+        // Idle workers pick up jobs that were put back after another worker was lost
+        for (size_t n = workers.size(); n-- > 0;)
+            if (!workers[n].busy && !queue.empty() && !assign(workers[n]))
+                drop(n, "send failed");
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd >= 0) {
+                worker w;
+                w.socket = std::make_unique<message_socket>(fd);
+                if (w.socket->send(msg_scene, &seed, sizeof(seed), text.data(), text.size())) {
+                    // Add the worker before assigning so that a failed send puts its job back
+                    workers.push_back(std::move(w));
+                    std::clog << "\rWorker connected, " << workers.size() << " total.          \n";
+                    if (!assign(workers.back()))
+                        drop(workers.size() - 1, "send failed");
+                }
+            }
+        }
+
+        // With only spawned workers, give up once all of them have exited
+        if (!children.empty()) {
+            reap_children();
+            if (children.empty() && workers.empty()) {
+                std::cerr << "ERROR: All spawned workers exited with " << jobs_left << " jobs left.\n";
+                break;
+            }
+        }
+    }
+
+    for (auto& w : workers)
+        w.socket->send(msg_done);
+    workers.clear();
+    ::close(listener);
+    if (options.listen_address.rfind("unix:", 0) == 0)
+        unlink(options.listen_address.substr(5).c_str());
+
+    // Spawned workers exit on msg_done; one that was dropped as stalled may never get there
+    for (int attempt = 0; attempt < 50 && !children.empty(); attempt++) {
+        reap_children();
+        if (!children.empty()) usleep(100000);
+    }
+    for (auto pid : children) {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+    }
+
+    if (jobs_left > 0)
+        return 1;
+
+    cam.finish_tiles();
+    return 0;
+}
+
+// Render jobs from a coordinator until it says it's done. Returns the process exit code.
+inline int run_worker(const render_options& options) {
+    signal(SIGPIPE, SIG_IGN);
+
+    int fd = connect_to(options.worker_address);
+    if (fd < 0) return 1;
+    message_socket socket(fd);
+
+    message_type type;
+    std::vector<unsigned char> payload;
+    if (!socket.receive(type, payload, max_scene_message_size) || type != msg_scene || payload.size() < sizeof(uint64_t)) {
+        std::cerr << "ERROR: Did not receive a scene from the coordinator.\n";
+        return 1;
+    }
+
+    uint64_t seed;
+    memcpy(&seed, payload.data(), sizeof(seed));
+    std::string text(payload.begin() + sizeof(seed), payload.end());
+
+    scene_description scene;
+    if (!scene_parser().parse(text, options.worker_address, scene))
+        return 1;
+
+    auto world = scene_builder(scene).build();
+    auto& cam = scene.cam;
+    cam.seed = seed;
+    if (options.threads >= 0) cam.threads = options.threads;
+    cam.begin_tiles();
+
+    camera_tile tile;
+    while (socket.receive(type, payload, sizeof(job_message))) {
+        if (type == msg_done) return 0;
+        if (type != msg_job || payload.size() != sizeof(job_message)) break;
+
+        job_message job;
+        memcpy(&job, payload.data(), sizeof(job));
+        tile.x0 = job.x0;
+        tile.y0 = job.y0;
+        tile.x1 = job.x1;
+        tile.y1 = job.y1;
+        tile.first_sample = job.first_sample;
+        tile.samples = job.samples;
+        cam.render_tile(world, tile);
+
+        // Sums of colors, then sums of squared luminances
+        std::vector<unsigned char> result(tile.accumulated.size() * (sizeof(color) + sizeof(double)));
+        memcpy(result.data(), tile.accumulated.data(), tile.accumulated.size() * sizeof(color));
+        memcpy(result.data() + tile.accumulated.size() * sizeof(color), tile.luminance_squared.data(),
+               tile.luminance_squared.size() * sizeof(double));
+        if (!socket.send(msg_result, &job, sizeof(job), result.data(), result.size()))
+            break;
+    }
+
+    std::cerr << "ERROR: Lost the connection to the coordinator.\n";
+    return 1;
+}
+
+#else
+
+inline int run_coordinator(const render_options&, const char*) {
+    std::cerr << "ERROR: Distributed rendering is only supported on POSIX systems.\n";
+    return 1;
+}
+
+inline int run_worker(const render_options&) {
+    std::cerr << "ERROR: Distributed rendering is only supported on POSIX systems.\n";
+    return 1;
+}
+
+#endif
+
+#endif
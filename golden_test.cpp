@@ -0,0 +1,236 @@
+// golden_test: renders the reference scenes listed in <golden dir>/golden.txt with a fixed seed and
+// sample count, and compares each with its stored floating-point reference image (<name>.hdr) by
+// RMSE and relMSE. It also times each render against the best time recorded in a baseline file,
+// so that an optimization which changes the image, or a change which slows rendering down,
+// fails the test.
+//
+// Usage: golden_test [--update] [--baseline file] [--slowdown factor] golden_dir
+//        --update          (re)write the reference images instead of comparing against them
+//        --baseline file   render times of earlier runs (created if missing; the best time of each
+//                          case is kept); without it, times are only printed. Times depend on the
+//                          machine and build, so no baseline is committed: the first run with a
+//                          new file only records times, and the speed check starts with the next
+//                          one
+//        --slowdown x      fail if a render takes more than x times its baseline (default 1.5)
+
+#include "helper.h"
+
+#include "camera.h"
+#include "hittable_list.h"
+#include "image_metrics.h"
+#include "image_output.h"
+#include "scene_generators.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// One line of golden.txt.
+struct golden_case {
+    std::string name;
+    std::string source;     // Scene file (relative to the golden directory) or "generate:<kind>:<count>"
+    int image_width = 0;
+    int samples_per_pixel = 0;
+    uint64_t seed = 0;
+    double max_rmse = 0;    // Root mean square error over all color components
+    double max_relmse = 0;  // Mean of squared errors relative to the squared reference value
+    bvh_build_method bvh_method = bvh_build_method::sah;
+    bool compact_bvh = false;
+    int frame = 0;          // Frame of an animated scene file
+};
+
+// Parse the options column: "-" for none, or a comma-separated list of lbvh, compact and frame=<n>.
+bool parse_case_options(const std::string& text, golden_case& c) {
+    if (text == "-") return true;
+
+    std::istringstream list(text);
+    std::string option;
+    while (std::getline(list, option, ',')) {
+        if (option == "lbvh")
+            c.bvh_method = bvh_build_method::lbvh;
+        else if (option == "compact")
+            c.compact_bvh = true;
+        else if (option.starts_with("frame=") && option.size() > 6)
+            c.frame = atoi(option.c_str() + 6);
+        else
+            return false;
+    }
+    return true;
+}
+
+bool read_cases(const std::string& filename, std::vector<golden_case>& cases) {
+    std::ifstream in(filename);
+    if (!in) {
+        std::cerr << "ERROR: Could not open '" << filename << "'.\n";
+        return false;
+    }
+
+    std::string line;
+    int line_number = 0;
+    while (std::getline(in, line)) {
+        line_number++;
+        auto comment = line.find('#');
+        if (comment != std::string::npos) line.erase(comment);
+
+        std::istringstream fields(line);
+        golden_case c;
+        if (!(fields >> c.name)) continue;
+        std::string options;
+        if (!(fields >> c.source >> c.image_width >> c.samples_per_pixel >> c.seed >> c.max_rmse >> c.max_relmse >> options)) {
+            std::cerr << "ERROR: " << filename << ":" << line_number << ": expected "
+                      << "name source width spp seed max_rmse max_relmse options\n";
+            return false;
+        }
+        if (!parse_case_options(options, c)) {
+            std::cerr << "ERROR: " << filename << ":" << line_number << ": bad options '" << options << "'\n";
+            return false;
+        }
+        cases.push_back(c);
+    }
+    return true;
+}
+
+// Render a case into linear colors; returns the render time in seconds.
+double render_case(const golden_case& c, const hittable& world, camera& cam, std::vector<color>& pixels, int& height) {
+    cam.image_width = c.image_width;
+    cam.samples_per_pixel = c.samples_per_pixel;
+    cam.seed = c.seed;
+
+    auto start = std::chrono::steady_clock::now();
+    cam.begin_tiles();
+    camera_tile tile;
+    tile.x1 = cam.image_width;
+    tile.y1 = height = cam.height();
+    tile.samples = c.samples_per_pixel;
+    cam.render_tile(world, tile);
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    pixels.resize(tile.accumulated.size());
+    for (size_t i = 0; i < pixels.size(); i++)
+        pixels[i] = tile.accumulated[i] / c.samples_per_pixel;
+    return seconds;
+}
+
+// Best render time of each case from earlier runs.
+std::map<std::string, double> read_baseline(const std::string& filename) {
+    std::map<std::string, double> times;
+    std::ifstream in(filename);
+    std::string name;
+    double seconds;
+    while (in >> name >> seconds)
+        times[name] = seconds;
+    return times;
+}
+
+void write_baseline(const std::string& filename, const std::map<std::string, double>& times) {
+    std::ofstream out(filename);
+    for (const auto& [name, seconds] : times)
+        out << name << ' ' << seconds << '\n';
+    if (!out)
+        std::cerr << "ERROR: Could not write baseline '" << filename << "'.\n";
+}
+
+int main(int argc, char* argv[]) {
+    bool update = false;
+    std::string baseline_file, directory;
+    double max_slowdown = 1.5;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--update") == 0) {
+            update = true;
+        }
+        else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "--slowdown") == 0 && i + 1 < argc) {
+            max_slowdown = atof(argv[++i]);
+        }
+        else if (argv[i][0] != '-' && directory.empty()) {
+            directory = argv[i];
+        }
+        else {
+            directory.clear();
+            break;
+        }
+    }
+    if (directory.empty()) {
+        std::cerr << "Usage: golden_test [--update] [--baseline file] [--slowdown factor] golden_dir\n";
+        return 1;
+    }
+
+    std::vector<golden_case> cases;
+    if (!read_cases(directory + "/golden.txt", cases))
+        return 1;
+    auto baseline = baseline_file.empty() ? std::map<std::string, double>() : read_baseline(baseline_file);
+    if (!update && !baseline_file.empty() && baseline.empty())
+        printf("No render times in '%s' yet: recording them; the speed check starts with the next run.\n",
+               baseline_file.c_str());
+
+    int failures = 0;
+    printf("%-12s %10s %10s %10s %10s  %s\n", "case", "rmse", "relmse", "seconds", "baseline", "result");
+    for (const auto& c : cases) {
+        hittable_list world;
+        camera cam;
+        if (!load_scene_source(c.source, directory, world, cam, c.bvh_method, c.compact_bvh, c.frame)) {
+            failures++;
+            continue;
+        }
+
+        std::vector<color> image;
+        int height;
+        auto seconds = render_case(c, world, cam, image, height);
+        auto reference_file = directory + "/" + c.name + ".hdr";
+
+        if (update) {
+            if (!write_image(reference_file, c.image_width, height, image)) failures++;
+            printf("%-12s %10s %10s %10.3f %10s  %s\n", c.name.c_str(), "-", "-", seconds, "-", "updated");
+            continue;
+        }
+
+        std::vector<color> reference;
+        int reference_width, reference_height;
+        if (!read_linear_image(reference_file, reference_width, reference_height, reference)) {
+            failures++;
+            continue;
+        }
+        if (reference_width != c.image_width || reference_height != height) {
+            std::cerr << "ERROR: Reference image '" << reference_file << "' is " << reference_width << "x"
+                      << reference_height << ", the render is " << c.image_width << "x" << height << ".\n";
+            failures++;
+            continue;
+        }
+
+        // The references are stored as RGBE, which rounds each component to about 1% of the
+        // pixel's largest one; with a fixed seed that rounding is all the tolerances allow for.
+        auto error = compare_images(image, reference);
+        auto rmse = error.rmse, relmse = error.relmse;
+
+        auto best = baseline.find(c.name);
+        auto baseline_seconds = best == baseline.end() ? 0.0 : best->second;
+
+        bool changed = rmse > c.max_rmse || relmse > c.max_relmse;
+        // A small absolute allowance keeps timer noise on very short renders from failing the test.
+        bool slower = baseline_seconds > 0 && seconds > max_slowdown * baseline_seconds + 0.05;
+        std::string result = changed && slower ? "IMAGE CHANGED, SLOWER"
+                           : changed ? "IMAGE CHANGED"
+                           : slower ? "SLOWER"
+                           : "ok";
+        if (result == "ok" && (baseline_seconds == 0 || seconds < baseline_seconds))
+            baseline[c.name] = seconds;
+
+        if (result != "ok") failures++;
+        printf("%-12s %10.6f %10.6f %10.3f %10.3f  %s\n", c.name.c_str(), rmse, relmse, seconds, baseline_seconds, result.c_str());
+    }
+
+    if (!update && !baseline_file.empty())
+        write_baseline(baseline_file, baseline);
+
+    if (failures)
+        std::cerr << failures << " of " << cases.size() << " golden-image cases failed.\n";
+    return failures ? 1 : 0;
+}
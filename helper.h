@@ -2,7 +2,8 @@
 #define HELPER_H
 
 #include <cmath>
-#include <cstdlib> // get rand() function
+#include <cstdint>
+#include <cstdlib>
 #include <limits>
 #include <memory>
 
@@ -24,9 +25,28 @@ inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
+// Per-thread random number state (splitmix64). The camera reseeds it for every pixel, so a render
+// depends only on its seed and not on how pixels are spread across threads.
+inline uint64_t& random_state() {
+    thread_local uint64_t state = 0x853c49e6748fea9bull;
+    return state;
+}
+
+inline void seed_random(uint64_t seed) {
+    random_state() = seed;
+}
+
+// Scramble a 64-bit value; used to derive well-separated seeds from small inputs.
+inline uint64_t mix_bits(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
 inline double random_double() {
     // Returns a random real in [0,1).
-    return rand() / (RAND_MAX + 1.0);
+    auto z = mix_bits(random_state() += 0x9e3779b97f4a7c15ull);
+    return (z >> 11) * (1.0 / 9007199254740992.0);
 }
 
 inline double random_double(double min, double max) {
@@ -4,6 +4,7 @@
 #include "ray.h"
 #include "aabb.h"
 #include "helper.h"
+#include "scene_arena.h"
 
 class material; // This will be defined later
 
@@ -13,7 +14,7 @@ class hit_record {
 public:
     point3 p;                   // Point of intersection
     vec3 normal;                // Normal vector at the point of intersection
-    shared_ptr<material> mat;   // Material pointer
+    material* mat;              // Material of the hit object (owned by the object, not the record)
     double t;                   // Parameter 't' representing the distance along the ray to the point of intersection
    
     double u; // Texture coordinates
@@ -48,8 +49,15 @@ class translate : public hittable {
 public:
 
     translate(shared_ptr<hittable> p, const vec3& displacement)
-        : object(p), offset(displacement)
+        : object(p)
     {
+        set_offset(displacement);
+    }
+
+    // Change the displacement. Also call this after the wrapped object moves, to update the
+    // bounding box.
+    void set_offset(const vec3& displacement) {
+        offset = displacement;
         bbox = object->bounding_box() + offset;
     }
 
@@ -80,6 +88,12 @@ private:
 class rotate_x : public hittable {
 public:
     rotate_x(shared_ptr<hittable> p, double angle) : object(p) {
+        set_angle(angle);
+    }
+
+    // Change the angle (in degrees). Also call this after the wrapped object moves, to update
+    // the bounding box.
+    void set_angle(double angle) {
         auto radians = degrees_to_radians(angle);
         sin_theta = sin(radians);
         cos_theta = cos(radians);
@@ -165,6 +179,12 @@ private:
 class rotate_y : public hittable {
 public:
     rotate_y(shared_ptr<hittable> p, double angle) : object(p) {
+        set_angle(angle);
+    }
+
+    // Change the angle (in degrees). Also call this after the wrapped object moves, to update
+    // the bounding box.
+    void set_angle(double angle) {
         auto radians = degrees_to_radians(angle);
         sin_theta = sin(radians);
         cos_theta = cos(radians);
@@ -250,6 +270,12 @@ private:
 class rotate_z : public hittable {
 public:
     rotate_z(shared_ptr<hittable> p, double angle) : object(p) {
+        set_angle(angle);
+    }
+
+    // Change the angle (in degrees). Also call this after the wrapped object moves, to update
+    // the bounding box.
+    void set_angle(double angle) {
         auto radians = degrees_to_radians(angle);
         sin_theta = sin(radians);
         cos_theta = cos(radians);
@@ -331,6 +357,10 @@ private:
     aabb bbox;
 };
 
-
+// The transforms only hold the object they wrap.
+template <> struct skip_arena_destructor<translate> : std::true_type {};
+template <> struct skip_arena_destructor<rotate_x> : std::true_type {};
+template <> struct skip_arena_destructor<rotate_y> : std::true_type {};
+template <> struct skip_arena_destructor<rotate_z> : std::true_type {};
 
 #endif
@@ -3,6 +3,7 @@
 
 #include "hittable.h"
 #include "aabb.h"
+#include "scene_arena.h"
 
 #include <memory>
 #include <vector>
@@ -14,10 +15,12 @@ using std::make_shared;
 class hittable_list : public hittable {
 public:
     std::vector<shared_ptr<hittable>> objects;
+    shared_ptr<scene_arena> arena;  // Owns the objects allocated from it, if any (see scene_arena.h)
 
     // Constructors
     hittable_list() {}  // Default constructor
     hittable_list(shared_ptr<hittable> object) { add(object); }  // Constructor with initial object
+    hittable_list(shared_ptr<hittable> object, shared_ptr<scene_arena> arena) : arena(arena) { add(object); }
 
     // Clear the list of hittable objects.
     void clear() { objects.clear(); }
@@ -0,0 +1,55 @@
+#ifndef IMAGE_METRICS_H
+#define IMAGE_METRICS_H
+
+#include "helper.h"
+#include "rtw_stb_image.h"
+
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Error of a rendered image against a reference, over all color components.
+struct image_error {
+    double rmse = 0;    // Root mean square error
+    double relmse = 0;  // Mean squared error relative to the squared reference value (plus 0.01,
+                        // so that black reference pixels do not dominate)
+};
+
+inline image_error compare_images(const std::vector<color>& image, const std::vector<color>& reference) {
+    double squared = 0, relative = 0;
+    for (size_t i = 0; i < image.size(); i++) {
+        for (int k = 0; k < 3; k++) {
+            auto error = image[i][k] - reference[i][k];
+            squared += error * error;
+            relative += error * error / (reference[i][k] * reference[i][k] + 0.01);
+        }
+    }
+
+    image_error result;
+    auto components = 3.0 * image.size();
+    if (components > 0) {
+        result.rmse = sqrt(squared / components);
+        result.relmse = relative / components;
+    }
+    return result;
+}
+
+// Read an image as linear colors (an .hdr keeps its float values). Returns false (after printing
+// why) if it cannot be read.
+inline bool read_linear_image(const std::string& filename, int& width, int& height, std::vector<color>& pixels) {
+    int n;
+    auto data = stbi_loadf(filename.c_str(), &width, &height, &n, 3);
+    if (!data) {
+        std::cerr << "ERROR: Could not load image '" << filename << "'.\n";
+        return false;
+    }
+
+    pixels.resize(static_cast<size_t>(width) * height);
+    for (size_t i = 0; i < pixels.size(); i++)
+        pixels[i] = color(data[3 * i], data[3 * i + 1], data[3 * i + 2]);
+    stbi_image_free(data);
+    return true;
+}
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef IMAGE_OUTPUT_H
+#define IMAGE_OUTPUT_H
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+#include "helper.h"
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Lower-case extension of a file name, without the dot ("" if there is none).
+inline std::string file_extension(const std::string& filename) {
+    auto dot = filename.find_last_of('.');
+    auto slash = filename.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) return "";
+
+    auto ext = filename.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return static_cast<char>(tolower(c)); });
+    return ext;
+}
+
+inline bool is_supported_image_format(const std::string& filename) {
+    auto ext = file_extension(filename);
+    return ext == "jpg" || ext == "jpeg" || ext == "png" || ext == "bmp" || ext == "tga" || ext == "ppm" || ext == "hdr";
+}
+
+// File name of one frame of an animation: the frame number goes before the extension, so
+// ("image.jpg", 7) gives "image_0007.jpg".
+inline std::string frame_file_name(const std::string& filename, int frame) {
+    if (filename.empty()) return filename;
+    auto number = std::to_string(frame);
+    if (number.size() < 4) number.insert(0, 4 - number.size(), '0');
+
+    auto ext = file_extension(filename);
+    auto stem = filename.substr(0, filename.size() - (ext.empty() ? 0 : ext.size() + 1));
+    return stem + "_" + number + filename.substr(stem.size());
+}
+
+// Gamma-encode a linear color component to a byte, as write_color does.
+inline unsigned char color_to_byte(double linear_component) {
+    static const interval intensity(0.000, 0.999);
+    return static_cast<unsigned char>(256 * intensity.clamp(linear_to_gamma(linear_component)));
+}
+
+// Write linear (already averaged) pixel colors to an image file, choosing the format from the
+// extension: jpg, png, bmp, tga and ppm are gamma-encoded 8-bit, hdr keeps linear floats.
+// Returns false (after printing why) on failure.
+inline bool write_image(const std::string& filename, int width, int height, const std::vector<color>& pixels) {
+    auto ext = file_extension(filename);
+    bool ok = false;
+
+    if (ext == "hdr") {
+        std::vector<float> data(pixels.size() * 3);
+        for (size_t i = 0; i < pixels.size(); i++)
+            for (int c = 0; c < 3; c++)
+                data[3 * i + c] = static_cast<float>(pixels[i][c]);
+        ok = stbi_write_hdr(filename.c_str(), width, height, 3, data.data()) != 0;
+    }
+    else {
+        std::vector<unsigned char> data(pixels.size() * 3);
+        for (size_t i = 0; i < pixels.size(); i++)
+            for (int c = 0; c < 3; c++)
+                data[3 * i + c] = color_to_byte(pixels[i][c]);
+
+        if (ext == "jpg" || ext == "jpeg")
+            ok = stbi_write_jpg(filename.c_str(), width, height, 3, data.data(), 100) != 0;
+        else if (ext == "png")
+            ok = stbi_write_png(filename.c_str(), width, height, 3, data.data(), width * 3) != 0;
+        else if (ext == "bmp")
+            ok = stbi_write_bmp(filename.c_str(), width, height, 3, data.data()) != 0;
+        else if (ext == "tga")
+            ok = stbi_write_tga(filename.c_str(), width, height, 3, data.data()) != 0;
+        else if (ext == "ppm") {
+            std::ofstream out(filename, std::ios::binary);
+            out << "P6\n" << width << ' ' << height << "\n255\n";
+            out.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+            ok = static_cast<bool>(out);
+        }
+        else {
+            std::cerr << "ERROR: Unsupported image format '" << filename << "'.\n";
+            return false;
+        }
+    }
+
+    if (!ok)
+        std::cerr << "ERROR: Could not write image '" << filename << "'.\n";
+    return ok;
+}
+
+// Write an image so that readers never see a partial file: write a temporary file next to it and
+// rename it over the target.
+inline bool write_image_atomic(const std::string& filename, int width, int height, const std::vector<color>& pixels) {
+    auto temp = filename + ".partial." + file_extension(filename);
+    if (!write_image(temp, width, height, pixels))
+        return false;
+
+    std::error_code ec;
+    std::filesystem::rename(temp, filename, ec);
+    if (ec) {
+        std::cerr << "ERROR: Could not replace image '" << filename << "': " << ec.message() << "\n";
+        std::filesystem::remove(temp, ec);
+        return false;
+    }
+    return true;
+}
+
+#endif
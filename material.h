@@ -105,6 +105,9 @@ private:
     }
 };
 
+// A dielectric holds no references.
+template <> struct skip_arena_destructor<dielectric> : std::true_type {};
+
 class diffuse_light : public material {
 public:
     diffuse_light(shared_ptr<texture> a) : emit(a) {}
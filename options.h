@@ -0,0 +1,224 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include "camera.h"
+#include "image_output.h"
+#include "scene_generators.h"
+
+#include <charconv>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+// Command-line render settings. Anything left at its default keeps the value set by the scene.
+struct render_options {
+    std::string scene_file;       // Scene file to render (empty = the built-in scene)
+    bool scene_cache = false;     // Render scene_file through its compiled cache
+    std::string generator;        // Render a generated scene of this kind (see scene_generators.h)
+    size_t generator_count = 1000;
+    int image_width = 0;
+    int image_height = 0;         // Overrides the aspect ratio
+    double aspect_ratio = 0;
+    int samples_per_pixel = 0;
+    int max_depth = 0;
+    int threads = -1;
+    bvh_build_method bvh_method = bvh_build_method::sah;
+    bool compact_bvh = false;     // Store the BVH in quantized 32-byte nodes
+    std::string output_file;
+    bool ppm_to_stdout = true;
+    bool has_seed = false;
+    uint64_t seed = 0;
+    int pass_samples = 0;
+    double time_budget = 0;
+    double target_noise = 0;
+    std::string checkpoint_file;
+    double checkpoint_interval = -1;
+    bool resume = false;
+    std::string listen_address;   // Coordinate a distributed render from this address
+    std::string worker_address;   // Render jobs for the coordinator at this address
+    int spawn_workers = 0;        // Local worker processes started by the coordinator
+    int tile_size = 32;           // Tile edge length of distributed jobs
+    double job_timeout = 300;     // Seconds before a distributed job's worker counts as stalled (0 = never)
+    std::string stats_file;
+    std::string trace_file;
+    bool help = false;
+
+    // Override the camera's scene settings with the ones given on the command line.
+    void apply(camera& cam) const {
+        if (image_width > 0) cam.image_width = image_width;
+        if (aspect_ratio > 0) {
+            cam.aspect_ratio = aspect_ratio;
+            cam.fixed_height = 0;
+        }
+        if (image_height > 0) cam.fixed_height = image_height;
+        if (samples_per_pixel > 0) cam.samples_per_pixel = samples_per_pixel;
+        if (max_depth > 0) cam.max_depth = max_depth;
+        if (threads >= 0) cam.threads = threads;
+        if (!output_file.empty()) cam.output_file = output_file;
+        if (has_seed) cam.seed = seed;
+        if (pass_samples > 0) cam.pass_samples = pass_samples;
+        if (time_budget > 0) cam.time_budget = time_budget;
+        if (target_noise > 0) cam.target_noise = target_noise;
+        if (!checkpoint_file.empty()) cam.checkpoint_file = checkpoint_file;
+        if (checkpoint_interval >= 0) cam.checkpoint_interval = checkpoint_interval;
+        if (resume) cam.resume = true;
+        if (!stats_file.empty()) cam.stats_file = stats_file;
+        cam.ppm_to_stdout = ppm_to_stdout;
+    }
+};
+
+inline void print_usage(std::ostream& out) {
+    out << "Usage: Raytracing [options] [scene file]\n"
+        << "\n"
+        << "Renders the given scene file, or the built-in scene if there is none.\n"
+        << "\n"
+        << "  --scene <file>       scene file to render\n"
+        << "  --scene-cache        use (and create) the compiled scene cache <file>.rtsc\n"
+        << "  --generate <kind>[:<count>]  render a generated scene of count objects (default 1000);\n"
+        << "                       kind is spheres, city, shells, media or particles\n"
+        << "  --width <pixels>     image width\n"
+        << "  --height <pixels>    image height (instead of the aspect ratio)\n"
+        << "  --aspect <ratio>     aspect ratio, e.g. 16/9\n"
+        << "  --spp <count>        samples per pixel\n"
+        << "  --depth <count>      maximum ray bounces\n"
+        << "  --threads <count>    render and BVH build threads (0 = one per hardware thread)\n"
+        << "  --bvh <method>       BVH build: sah (default, faster to trace) or lbvh (faster to build)\n"
+        << "  --compact-bvh        store the BVH in quantized nodes: under a third of the memory, slower to trace\n"
+        << "  --seed <n>           random seed\n"
+        << "  --pass-spp <count>   render progressively, this many samples per pixel per pass\n"
+        << "                       (default 4 with --time-budget or --target-noise)\n"
+        << "  --time-budget <s>    stop after this many seconds (the first pass always completes)\n"
+        << "  --target-noise <x>   stop once the relative noise estimate drops to x\n"
+        << "  --checkpoint <file>  save the render state to this file between passes\n"
+        << "  --checkpoint-interval <s>  minimum seconds between checkpoints (default: every pass)\n"
+        << "  --resume             continue from the checkpoint file if it matches\n"
+        << "  --listen <address>   coordinate a distributed render; address is unix:<path> or [tcp:]<host>:<port>\n"
+        << "  --worker <address>   render jobs for the coordinator at this address\n"
+        << "  --spawn-workers <n>  start n local worker processes (coordinator only)\n"
+        << "  --tile <pixels>      tile size of distributed jobs (default 32)\n"
+        << "  --job-timeout <s>    drop a worker that spends longer on one job and requeue it\n"
+        << "                       (default 300, 0 = never; coordinator only)\n"
+        << "  --stats <file>       write render statistics as JSON\n"
+        << "  --trace <file>       write a Chrome trace-event timeline of the render\n"
+        << "  -o, --output <file>  output image; jpg, png, bmp, tga, ppm or hdr (default image.jpg)\n"
+        << "  --no-stdout          don't write the PPM image to standard output\n"
+        << "  -h, --help           show this help\n";
+}
+
+// Parse the command line into options. Returns false (after printing the error) on bad input.
+inline bool parse_options(int argc, char* argv[], render_options& options) {
+    auto fail = [](const std::string& message) {
+        std::cerr << "ERROR: " << message << "\n";
+        print_usage(std::cerr);
+        return false;
+    };
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        auto value = [&](std::string& out) {
+            if (i + 1 >= argc) return false;
+            out = argv[++i];
+            return true;
+        };
+        auto number = [&](auto& out, auto min) {
+            std::string text;
+            if (!value(text)) return false;
+            auto end = text.data() + text.size();
+            auto result = std::from_chars(text.data(), end, out);
+            return result.ec == std::errc() && result.ptr == end && out >= min;
+        };
+        auto ratio = [&](double& out) {
+            // Accepts "1.5" or "16/9"
+            std::string text;
+            if (!value(text)) return false;
+            auto slash = text.find('/');
+            auto first_end = text.data() + (slash == std::string::npos ? text.size() : slash);
+            auto result = std::from_chars(text.data(), first_end, out);
+            if (result.ec != std::errc() || result.ptr != first_end) return false;
+            if (slash != std::string::npos) {
+                double denominator;
+                auto end = text.data() + text.size();
+                result = std::from_chars(first_end + 1, end, denominator);
+                if (result.ec != std::errc() || result.ptr != end || denominator == 0) return false;
+                out /= denominator;
+            }
+            return out > 0;
+        };
+
+        auto bvh_method = [&](bvh_build_method& out) {
+            std::string text;
+            if (!value(text)) return false;
+            if (text == "sah") out = bvh_build_method::sah;
+            else if (text == "lbvh") out = bvh_build_method::lbvh;
+            else return false;
+            return true;
+        };
+
+        auto generator = [&](std::string& kind, size_t& count) {
+            // Accepts "kind" or "kind:count"
+            std::string text;
+            if (!value(text)) return false;
+            auto colon = text.find(':');
+            kind = text.substr(0, colon);
+            if (colon != std::string::npos) {
+                auto end = text.data() + text.size();
+                auto result = std::from_chars(text.data() + colon + 1, end, count);
+                if (result.ec != std::errc() || result.ptr != end || count == 0) return false;
+            }
+            return is_scene_generator(kind);
+        };
+
+        bool ok = true;
+        if (arg == "-h" || arg == "--help")       options.help = true;
+        else if (arg == "--scene")                ok = value(options.scene_file);
+        else if (arg == "--scene-cache")          options.scene_cache = true;
+        else if (arg == "--generate")             ok = generator(options.generator, options.generator_count);
+        else if (arg == "--width")                ok = number(options.image_width, 1);
+        else if (arg == "--height")               ok = number(options.image_height, 1);
+        else if (arg == "--aspect")               ok = ratio(options.aspect_ratio);
+        else if (arg == "--spp")                  ok = number(options.samples_per_pixel, 1);
+        else if (arg == "--depth")                ok = number(options.max_depth, 1);
+        else if (arg == "--threads")              ok = number(options.threads, 0);
+        else if (arg == "--bvh")                  ok = bvh_method(options.bvh_method);
+        else if (arg == "--compact-bvh")          options.compact_bvh = true;
+        else if (arg == "--seed")                 ok = options.has_seed = number(options.seed, uint64_t(0));
+        else if (arg == "--pass-spp")             ok = number(options.pass_samples, 1);
+        else if (arg == "--time-budget")          ok = number(options.time_budget, 0.0);
+        else if (arg == "--target-noise")         ok = number(options.target_noise, 0.0);
+        else if (arg == "--checkpoint")           ok = value(options.checkpoint_file);
+        else if (arg == "--checkpoint-interval")  ok = number(options.checkpoint_interval, 0.0);
+        else if (arg == "--resume")               options.resume = true;
+        else if (arg == "--listen")               ok = value(options.listen_address);
+        else if (arg == "--worker")               ok = value(options.worker_address);
+        else if (arg == "--spawn-workers")        ok = number(options.spawn_workers, 0);
+        else if (arg == "--tile")                 ok = number(options.tile_size, 1);
+        else if (arg == "--job-timeout")          ok = number(options.job_timeout, 0.0);
+        else if (arg == "--stats")                ok = value(options.stats_file);
+        else if (arg == "--trace")                ok = value(options.trace_file);
+        else if (arg == "-o" || arg == "--output") ok = value(options.output_file);
+        else if (arg == "--no-stdout")            options.ppm_to_stdout = false;
+        else if (arg.size() > 1 && arg[0] == '-') return fail("unknown option '" + arg + "'");
+        else if (options.scene_file.empty())      options.scene_file = arg;
+        else return fail("more than one scene file given");
+
+        if (!ok) return fail("missing or invalid value for '" + arg + "'");
+    }
+
+    if (!options.output_file.empty() && !is_supported_image_format(options.output_file))
+        return fail("unsupported output format '" + options.output_file + "'");
+    if (options.resume && options.checkpoint_file.empty())
+        return fail("--resume needs --checkpoint");
+    if (!options.listen_address.empty() && options.scene_file.empty())
+        return fail("--listen needs a scene file");
+    if (options.spawn_workers > 0 && options.listen_address.empty())
+        return fail("--spawn-workers needs --listen");
+    if (options.scene_cache && options.scene_file.empty())
+        return fail("--scene-cache needs a scene file");
+    if (!options.generator.empty() && !options.scene_file.empty())
+        return fail("--generate renders instead of a scene file; give only one");
+
+    return true;
+}
+
+#endif
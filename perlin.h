@@ -2,143 +2,278 @@
 #define PERLIN_H
 
 #include "helper.h"
+#include "simd.h"
 
-class perlin {
-public:
-    // Constructor: Initialize the Perlin noise generator
-    perlin() {
-        // Allocate and initialize random float array for gradient vectors
-        ranvec = new vec3[point_count];
-        for (int i = 0; i < point_count; ++i) {
-            ranvec[i] = unit_vector(vec3::random(-1, 1));
+#include <cstdint>
+
+// Lattice tables shared by every perlin instance: random unit gradient vectors (split into x, y
+// and z arrays so four of them can be gathered into vector lanes at once) and one permutation per
+// axis. They are generated at compile time from a fixed seed, so every platform and every run
+// sees the same noise, and live in one contiguous, cache-line aligned block of about 3.8 KiB.
+struct perlin_tables {
+    static const int point_count = 256; // Size of gradient and permutation arrays
+
+    alignas(64) float grad_x[point_count]; // Gradient vector x components
+    float grad_y[point_count];             // Gradient vector y components
+    float grad_z[point_count];             // Gradient vector z components
+    unsigned char perm_x[point_count];     // Permutation array for x direction
+    unsigned char perm_y[point_count];     // Permutation array for y direction
+    unsigned char perm_z[point_count];     // Permutation array for z direction
+};
+
+namespace perlin_detail {
+    // splitmix64: a small, well-mixed generator that is easy to evaluate in a constant expression
+    constexpr uint64_t next_random(uint64_t& state) {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    // Random double in [min,max)
+    constexpr double random_double(uint64_t& state, double min, double max) {
+        return min + (max - min) * ((next_random(state) >> 11) * (1.0 / 9007199254740992.0));
+    }
+
+    // std::sqrt isn't usable in constant expressions, so use Newton's method
+    constexpr double sqrt(double x) {
+        double r = x > 1 ? x : 1;
+        for (int i = 0; i < 64; i++)
+            r = 0.5 * (r + x / r);
+        return r;
+    }
+
+    // Fisher-Yates shuffle of 0..n-1
+    constexpr void generate_perm(unsigned char* p, uint64_t& state) {
+        const int n = perlin_tables::point_count;
+        for (int i = 0; i < n; i++)
+            p[i] = static_cast<unsigned char>(i);
+
+        for (int i = n - 1; i > 0; i--) {
+            int target = static_cast<int>(next_random(state) % static_cast<uint64_t>(i + 1));
+            auto tmp = p[i];
+            p[i] = p[target];
+            p[target] = tmp;
+        }
+    }
+
+    constexpr perlin_tables make_tables(uint64_t seed) {
+        perlin_tables t{};
+        uint64_t state = seed;
+
+        // Uniformly distributed unit vectors, by normalizing points rejection-sampled in the ball
+        for (int i = 0; i < perlin_tables::point_count; i++) {
+            double x = 0, y = 0, z = 0, len2 = 0;
+            do {
+                x = random_double(state, -1, 1);
+                y = random_double(state, -1, 1);
+                z = random_double(state, -1, 1);
+                len2 = x * x + y * y + z * z;
+            } while (len2 > 1 || len2 < 1e-6);
+
+            auto len = perlin_detail::sqrt(len2);
+            t.grad_x[i] = static_cast<float>(x / len);
+            t.grad_y[i] = static_cast<float>(y / len);
+            t.grad_z[i] = static_cast<float>(z / len);
         }
 
-        // Generate permutation arrays for x, y, and z directions
-        perm_x = perlin_generate_perm();
-        perm_y = perlin_generate_perm();
-        perm_z = perlin_generate_perm();
+        generate_perm(t.perm_x, state);
+        generate_perm(t.perm_y, state);
+        generate_perm(t.perm_z, state);
+        return t;
     }
+}
 
-    // Destructor: Clean up memory allocated during construction
-    ~perlin() {
-        delete[] ranvec;
-        delete[] perm_x;
-        delete[] perm_y;
-        delete[] perm_z;
+inline constexpr perlin_tables perlin_table = perlin_detail::make_tables(0x9e3779b97f4a7c15ull);
+
+// Perlin gradient noise. The kernels are written on four-lane float vectors (see simd.h): a
+// single noise() evaluates its eight cube corners as two vectors of four, while turb() and the
+// batch entry points put independent sample points (octaves or shading points) in the lanes.
+//
+// All instances share perlin_table; a seed selects a different pattern by shifting the lattice
+// by a seed-dependent offset, so a perlin is just three integers and needs no allocation.
+class perlin {
+public:
+    perlin(uint32_t seed = 0) {
+        uint64_t state = seed;
+        auto bits = seed ? perlin_detail::next_random(state) : 0;
+        offset_x = static_cast<int>(bits & 255);
+        offset_y = static_cast<int>((bits >> 8) & 255);
+        offset_z = static_cast<int>((bits >> 16) & 255);
     }
 
-    // Compute Perlin noise value at a given 3D point using trilinear interpolation
+    // Compute Perlin noise value at a given 3D point, interpolating the gradient contributions of
+    // the surrounding lattice cube with Hermite-smoothed weights
     double noise(const point3& p) const {
-        // Compute fractional coordinates within the unit cube
-        auto u = p.x() - floor(p.x());
-        auto v = p.y() - floor(p.y());
-        auto w = p.z() - floor(p.z());
-        
-        // Smooth out obvious grid features with Hermitian Smoothing
-        u = u * u * (3 - 2 * u);
-        v = v * v * (3 - 2 * v);
-        w = w * w * (3 - 2 * w);
-
-        // Compute grid coordinates of surrounding 2x2x2 cube
-        auto i = static_cast<int>(floor(p.x()));
-        auto j = static_cast<int>(floor(p.y()));
-        auto k = static_cast<int>(floor(p.z()));
-
-        // Allocate and initialize array for gradient vectors at cube corners
-        vec3 c[2][2][2];
+        int i, j, k;
+        float u, v, w;
+        split(p.x(), offset_x, i, u);
+        split(p.y(), offset_y, j, v);
+        split(p.z(), offset_z, k, w);
+
+        // Lanes hold the corners (dj, dk) = (0,0), (0,1), (1,0), (1,1); `lo` is the di = 0 face
+        // of the cube and `hi` the di = 1 face.
+        int px0 = table.perm_x[i & 255], px1 = table.perm_x[(i + 1) & 255];
+        int py0 = table.perm_y[j & 255], py1 = table.perm_y[(j + 1) & 255];
+        int pz0 = table.perm_z[k & 255], pz1 = table.perm_z[(k + 1) & 255];
+        int lo_hash[4] = { px0 ^ py0 ^ pz0, px0 ^ py0 ^ pz1, px0 ^ py1 ^ pz0, px0 ^ py1 ^ pz1 };
+        int hi_hash[4] = { px1 ^ py0 ^ pz0, px1 ^ py0 ^ pz1, px1 ^ py1 ^ pz0, px1 ^ py1 ^ pz1 };
+
+        auto dy = vfloat4(v, v, v - 1, v - 1);
+        auto dz = vfloat4(w, w - 1, w, w - 1);
+        auto lo = gradient_dot(lo_hash, vfloat4(u), dy, dz);
+        auto hi = gradient_dot(hi_hash, vfloat4(u - 1), dy, dz);
+
+        // Interpolate along x in all four lanes, then along y and z
+        auto x_lerped = lo + vfloat4(hermite(u)) * (hi - lo);
+        float c[4];
+        x_lerped.store(c);
+        auto vv = hermite(v);
+        auto y0 = c[0] + vv * (c[2] - c[0]);
+        auto y1 = c[1] + vv * (c[3] - c[1]);
+        return y0 + hermite(w) * (y1 - y0);
+    }
+
+    // Noise at four points at once; lane n of the result is noise((xs[n], ys[n], zs[n])).
+    vfloat4 noise4(const double xs[4], const double ys[4], const double zs[4]) const {
+        float fx[4], fy[4], fz[4];
+        int px[2][4], py[2][4], pz[2][4];  // Permuted lattice coordinates of both cube faces
+        for (int n = 0; n < 4; n++) {
+            int i, j, k;
+            split(xs[n], offset_x, i, fx[n]);
+            split(ys[n], offset_y, j, fy[n]);
+            split(zs[n], offset_z, k, fz[n]);
+            px[0][n] = table.perm_x[i & 255];
+            px[1][n] = table.perm_x[(i + 1) & 255];
+            py[0][n] = table.perm_y[j & 255];
+            py[1][n] = table.perm_y[(j + 1) & 255];
+            pz[0][n] = table.perm_z[k & 255];
+            pz[1][n] = table.perm_z[(k + 1) & 255];
+        }
+
+        auto u = vfloat4::load(fx);
+        auto v = vfloat4::load(fy);
+        auto w = vfloat4::load(fz);
+        auto uu = hermite(u);
+        auto vv = hermite(v);
+        auto ww = hermite(w);
+        vfloat4 weight_u[2] = { vfloat4(1) - uu, uu };
+        vfloat4 weight_v[2] = { vfloat4(1) - vv, vv };
+        vfloat4 weight_w[2] = { vfloat4(1) - ww, ww };
+
+        vfloat4 accum(0.0f);
         for (int di = 0; di < 2; di++)
             for (int dj = 0; dj < 2; dj++)
-                for (int dk = 0; dk < 2; dk++)
-                    c[di][dj][dk] = ranvec[
-                        perm_x[(i + di) & 255] ^
-                        perm_y[(j + dj) & 255] ^
-                        perm_z[(k + dk) & 255]
-                    ];
-
-        return perlin_interp(c, u, v, w);
-
-        /*
-        // Perform trilinear interpolation
-        return trilinear_interp(c, u, v, w);
-        */
-
-        /* No linear interpolation:
-        // Integer grid coordinates for the surrounding cube
-        auto i = static_cast<int>(4 * p.x()) & 255;
-        auto j = static_cast<int>(4 * p.y()) & 255;
-        auto k = static_cast<int>(4 * p.z()) & 255;
-
-        // Return Perlin noise value using the precomputed permutation arrays
-        return ranfloat[perm_x[i] ^ perm_y[j] ^ perm_z[k]];
-        */
+                for (int dk = 0; dk < 2; dk++) {
+                    int hash[4];
+                    for (int n = 0; n < 4; n++)
+                        hash[n] = px[di][n] ^ py[dj][n] ^ pz[dk][n];
+
+                    auto d = gradient_dot(
+                        hash, u - vfloat4(float(di)), v - vfloat4(float(dj)), w - vfloat4(float(dk)));
+                    accum = accum + weight_u[di] * weight_v[dj] * weight_w[dk] * d;
+                }
+
+        return accum;
     }
 
-    // Turbulence -- composite noise that is the sum of multiple frequencies
+    // Turbulence -- composite noise that is the sum of multiple frequencies. The octaves are
+    // independent, so four of them are evaluated together in the lanes of noise4().
     double turb(const point3& p, int depth = 7) const {
-        auto accum = 0.0;
-        auto temp_p = p;
-        auto weight = 1.0;
+        vfloat4 accum(0.0f);
+        auto frequency = 1.0;
+        auto weight = 1.0f;
 
-        for (int i = 0; i < depth; i++) {
-            accum += weight * noise(temp_p);
-            weight *= 0.5;
-            temp_p *= 2;
+        for (int octave = 0; octave < depth; octave += 4) {
+            double xs[4], ys[4], zs[4];
+            float weights[4];
+            for (int n = 0; n < 4; n++) {
+                auto k = octave + n;
+                xs[n] = frequency * p.x();
+                ys[n] = frequency * p.y();
+                zs[n] = frequency * p.z();
+                weights[n] = (k < depth) ? weight : 0.0f;
+                frequency *= 2;
+                weight *= 0.5f;
+            }
+            accum = accum + vfloat4::load(weights) * noise4(xs, ys, zs);
         }
 
-        return fabs(accum);
+        return fabs(accum.reduce_add());
     }
 
-private:
-    static const int point_count = 256; // Size of permutation arrays
-    vec3* ranvec; // Random vector array for gradient vectors
-    int* perm_x; // Permutation array for x direction
-    int* perm_y; // Permutation array for y direction
-    int* perm_z; // Permutation array for z direction
-
-    // Generate a permutation array for one direction (x, y, or z)
-    static int* perlin_generate_perm() {
-        auto p = new int[point_count];
+    // Evaluate noise() for count points, four at a time, writing the results to out.
+    void noise_batch(const point3* points, double* out, size_t count) const {
+        for (size_t base = 0; base < count; base += 4) {
+            double xs[4], ys[4], zs[4];
+            gather_points(points, count, base, xs, ys, zs);
 
-        // Initialize permutation array with consecutive values
-        for (int i = 0; i < perlin::point_count; i++)
-            p[i] = i;
+            auto result = noise4(xs, ys, zs);
+            for (size_t n = 0; n < 4 && base + n < count; n++)
+                out[base + n] = result[static_cast<int>(n)];
+        }
+    }
 
-        // Randomly permute the array
-        permute(p, point_count);
+    // Evaluate turb() for count points, four at a time, writing the results to out.
+    void turb_batch(const point3* points, double* out, size_t count, int depth = 7) const {
+        for (size_t base = 0; base < count; base += 4) {
+            double xs[4], ys[4], zs[4];
+            gather_points(points, count, base, xs, ys, zs);
 
-        return p;
-    }
+            vfloat4 accum(0.0f);
+            auto weight = 1.0f;
+            for (int i = 0; i < depth; i++) {
+                accum = accum + vfloat4(weight) * noise4(xs, ys, zs);
+                weight *= 0.5f;
+                for (int n = 0; n < 4; n++) {
+                    xs[n] *= 2;
+                    ys[n] *= 2;
+                    zs[n] *= 2;
+                }
+            }
 
-    // Helper function to permute an array randomly
-    static void permute(int* p, int n) {
-        for (int i = n - 1; i > 0; i--) {
-            // Swap the current element with a randomly chosen element
-            int target = random_int(0, i);
-            int tmp = p[i];
-            p[i] = p[target];
-            p[target] = tmp;
+            for (size_t n = 0; n < 4 && base + n < count; n++)
+                out[base + n] = fabs(accum[static_cast<int>(n)]);
         }
     }
 
-    static double perlin_interp(vec3 c[2][2][2], double u, double v, double w) {
-        auto uu = u * u * (3 - 2 * u);
-        auto vv = v * v * (3 - 2 * v);
-        auto ww = w * w * (3 - 2 * w);
-        auto accum = 0.0;
+private:
+    static const int point_count = perlin_tables::point_count;
+    static constexpr const perlin_tables& table = perlin_table;
+    int offset_x, offset_y, offset_z; // Seed-dependent lattice offsets
 
-        for (int i = 0; i < 2; i++)
-            for (int j = 0; j < 2; j++)
-                for (int k = 0; k < 2; k++) {
-                    vec3 weight_v(u - i, v - j, w - k);
-                    accum += (i * uu + (1 - i) * (1 - uu))
-                        * (j * vv + (1 - j) * (1 - vv))
-                        * (k * ww + (1 - k) * (1 - ww))
-                        * dot(c[i][j][k], weight_v);
-                }
+    // Split a coordinate into its lattice cell (shifted by the seed offset) and the fractional
+    // position inside it. The subtraction is done in double so large coordinates keep their
+    // fractional bits.
+    static void split(double x, int offset, int& cell, float& fraction) {
+        cell = static_cast<int>(x);
+        if (x < cell) cell--;
+        fraction = static_cast<float>(x - cell);
+        cell += offset;
+    }
 
-        return accum;
+    // Hermite smoothing of a fractional lattice coordinate
+    static float hermite(float t) { return t * t * (3 - 2 * t); }
+    static vfloat4 hermite(vfloat4 t) { return t * t * (vfloat4(3) - vfloat4(2) * t); }
+
+    // Dot products of four gathered gradients with four offset vectors
+    vfloat4 gradient_dot(const int hash[4], vfloat4 dx, vfloat4 dy, vfloat4 dz) const {
+        return vfloat4::gather(table.grad_x, hash) * dx
+             + vfloat4::gather(table.grad_y, hash) * dy
+             + vfloat4::gather(table.grad_z, hash) * dz;
     }
 
+    // Copy four points starting at base into coordinate arrays, repeating the last point to pad.
+    static void gather_points(
+        const point3* points, size_t count, size_t base, double xs[4], double ys[4], double zs[4]
+    ) {
+        for (size_t n = 0; n < 4; n++) {
+            const auto& p = points[(base + n < count) ? base + n : count - 1];
+            xs[n] = p.x();
+            ys[n] = p.y();
+            zs[n] = p.z();
+        }
+    }
 
     static double trilinear_interp(double c[2][2][2], double u, double v, double w) {
         auto accum = 0.0;
@@ -4,6 +4,7 @@
 #include "helper.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "stats.h"
 
 
 // 2D quadrilateral (parallelogram) class
@@ -28,6 +29,8 @@ public:
     aabb bounding_box() const override { return bbox; }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        RT_STAT(quad_tests);
+
         // Find the plane that contains that quad
 
         auto denom = dot(normal, r.direction());
@@ -57,7 +60,7 @@ public:
         // Ray hits the 2D shape; set the rest of the hit record and return true.
         rec.t = t;
         rec.p = intersection;
-        rec.mat = mat;
+        rec.mat = mat.get();
         rec.set_face_normal(r, normal);
 
         return true;
@@ -87,12 +90,16 @@ private:
 
 };
 
+// A quad only holds its material.
+template <> struct skip_arena_destructor<quad> : std::true_type {};
+
 
-inline shared_ptr<hittable_list> box(const point3& a, const point3& b, shared_ptr<material> mat)
+inline shared_ptr<hittable_list> box(const point3& a, const point3& b, shared_ptr<material> mat, scene_arena* arena = nullptr)
 {
-    // Returns the 3D box (six sides) that contains the two opposite vertices a & b.
+    // Returns the 3D box (six sides) that contains the two opposite vertices a & b, allocated
+    // from `arena` if one is given.
 
-    auto sides = make_shared<hittable_list>();
+    auto sides = make_in<hittable_list>(arena);
 
     // Construct the two opposite vertices with the minimum and maximum coordinates.
     auto min = point3(fmin(a.x(), b.x()), fmin(a.y(), b.y()), fmin(a.z(), b.z()));
@@ -102,12 +109,12 @@ inline shared_ptr<hittable_list> box(const point3& a, const point3& b, shared_pt
     auto dy = vec3(0, max.y() - min.y(), 0);
     auto dz = vec3(0, 0, max.z() - min.z());
 
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), max.z()), dx, dy, mat)); // front
-    sides->add(make_shared<quad>(point3(max.x(), min.y(), max.z()), -dz, dy, mat)); // right
-    sides->add(make_shared<quad>(point3(max.x(), min.y(), min.z()), -dx, dy, mat)); // back
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), min.z()), dz, dy, mat)); // left
-    sides->add(make_shared<quad>(point3(min.x(), max.y(), max.z()), dx, -dz, mat)); // top
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), min.z()), dx, dz, mat)); // bottom
+    sides->add(make_in<quad>(arena, point3(min.x(), min.y(), max.z()), dx, dy, mat)); // front
+    sides->add(make_in<quad>(arena, point3(max.x(), min.y(), max.z()), -dz, dy, mat)); // right
+    sides->add(make_in<quad>(arena, point3(max.x(), min.y(), min.z()), -dx, dy, mat)); // back
+    sides->add(make_in<quad>(arena, point3(min.x(), min.y(), min.z()), dz, dy, mat)); // left
+    sides->add(make_in<quad>(arena, point3(min.x(), max.y(), max.z()), dx, -dz, mat)); // top
+    sides->add(make_in<quad>(arena, point3(min.x(), min.y(), min.z()), dx, dz, mat)); // bottom
 
     return sides;
 }
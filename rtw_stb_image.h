@@ -10,67 +10,310 @@
 #define STBI_FAILURE_USERMSG
 #include "stb_image.h"
 
+#include "mapped_file.h"
+#include "texture_cache.h"
+#include "texture_file.h"
+#include "trace.h"
+
+#include <cstdio>
 #include <cstdlib>
+#include <filesystem>
 #include <iostream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
-class rtw_image {
+// Finds image files in the usual search locations and remembers the answer, so a name used by
+// several textures is looked up once instead of with up to nine failed opens each time.
+class image_path_resolver {
 public:
-    rtw_image() : data(nullptr) {}
+    static image_path_resolver& global() {
+        static image_path_resolver resolver;
+        return resolver;
+    }
+
+    // Return the first path of the given image file for which usable(path) succeeds, or an
+    // empty string if there is none, so a copy that fails to decode doesn't hide a good one
+    // further down. If the RTW_IMAGES environment variable is defined, that directory is
+    // searched first; then the current directory, the images/ subdirectory, the _parent's_
+    // images/ subdirectory, and so on for six levels up. usable() runs without the lock held.
+    template <typename F>
+    std::string resolve(const std::string& filename, F usable) {
+        std::string cached;
+        bool known = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = resolved.find(filename);
+            if (found != resolved.end()) {
+                cached = found->second;
+                known = true;
+            }
+        }
+        if (known && (cached.empty() || usable(cached)))
+            return cached;
+
+        std::string found;
+        for (const auto& prefix : prefixes) {
+            auto path = prefix + filename;
+            if (exists(path) && usable(path)) {
+                found = path;
+                break;
+            }
+        }
 
-    rtw_image(const char* image_filename) {
-        // Loads image data from the specified file. If the RTW_IMAGES environment variable is
-        // defined, looks only in that directory for the image file. If the image was not found,
-        // searches for the specified image file first from the current directory, then in the
-        // images/ subdirectory, then the _parent's_ images/ subdirectory, and then _that_
-        // parent, on so on, for six levels up. If the image was not loaded successfully,
-        // width() and height() will return 0.
+        std::lock_guard<std::mutex> lock(mutex);
+        resolved[filename] = found;
+        return found;
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<std::string> prefixes;                      // Search locations, in order (fixed)
+    std::unordered_map<std::string, std::string> resolved;  // Past results ("" = not found)
 
-        auto filename = std::string(image_filename);
+    image_path_resolver() {
         auto imagedir = getenv("RTW_IMAGES");
+        if (imagedir) prefixes.push_back(std::string(imagedir) + "/");
+        prefixes.push_back("");
+        std::string up = "images/";
+        for (int level = 0; level <= 6; level++) {
+            prefixes.push_back(up);
+            up = "../" + up;
+        }
+    }
+
+    static bool exists(const std::string& path) {
+        std::error_code ec;
+        return std::filesystem::is_regular_file(path, ec);
+    }
+};
+
+// An image loaded from disk, stored as Morton-ordered square tiles (see texture_cache.h).
+//
+// If a pre-decoded texture container (see texture_file.h) is found, either because the file named
+// is one or because an up-to-date "<image>.rtwt" sits next to the image, it is memory-mapped and
+// sampled in place with no decoding; rtw_image::convert() writes such containers. Otherwise the
+// image is decoded, its tiles are written to a private spill file, and the decoded buffer is
+// released: texel lookups then page tiles in through the shared texture_cache, so the memory held
+// by textures is bounded by the cache capacity rather than by the size of the texture set.
+class rtw_image : public texture_tile_source {
+public:
+    rtw_image() : image_id(texture_cache::next_image_id()) {}
 
-        // Hunt for the image file in some likely locations.
-        if (imagedir && load(std::string(imagedir) + "/" + image_filename)) return;
-        if (load(filename)) return;
-        if (load("images/" + filename)) return;
-        if (load("../images/" + filename)) return;
-        if (load("../../images/" + filename)) return;
-        if (load("../../../images/" + filename)) return;
-        if (load("../../../../images/" + filename)) return;
-        if (load("../../../../../images/" + filename)) return;
-        if (load("../../../../../../images/" + filename)) return;
+    rtw_image(const char* image_filename) : rtw_image() {
+        // Loads image data from the specified file, searching the locations listed in
+        // image_path_resolver::resolve(). If the image was not loaded successfully, width() and
+        // height() will return 0.
+
+        auto path = image_path_resolver::global().resolve(image_filename, [this](const std::string& p) { return load(p); });
+        if (!path.empty()) return;
 
         std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
     }
 
-    ~rtw_image() { STBI_FREE(data); }
+    rtw_image(const rtw_image&) = delete;
+    rtw_image& operator=(const rtw_image&) = delete;
+
+    ~rtw_image() {
+        texture_cache::global().evict_image(image_id);
+        if (spill) fclose(spill);
+    }
 
     bool load(const std::string filename) {
         // Loads image data from the given file name. Returns true if the load succeeded.
+        trace_scope trace("texture load", filename);
+        if (filename.ends_with(".rtwt")) return map_container(filename);
+        if (map_container(texture_file_name(filename), filename)) return true;
+
         auto n = bytes_per_pixel; // Dummy out parameter: original components per pixel
-        data = stbi_load(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
-        bytes_per_scanline = image_width * bytes_per_pixel;
-        return data != nullptr;
+        auto data = stbi_load(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
+        if (data == nullptr) return false;
+
+        store_tiles(data);
+        STBI_FREE(data);
+        loaded = true;
+        return true;
+    }
+
+    // Decode an image file and write it, with its mip chain, as a texture container. Returns
+    // true on success.
+    static bool convert(const std::string& image_filename, const std::string& container_filename) {
+        int width, height, n;
+        auto data = stbi_load(image_filename.c_str(), &width, &height, &n, texture_bytes_per_pixel);
+        if (data == nullptr) return false;
+
+        uint64_t size;
+        int64_t mtime;
+        source_stamp(image_filename, size, mtime);
+        auto ok = write_texture_file(container_filename, data, width, height, size, mtime);
+        STBI_FREE(data);
+        return ok;
+    }
+
+    // The container name rtw_image looks for next to an image file.
+    static std::string texture_file_name(const std::string& image_filename) {
+        return image_filename + ".rtwt";
     }
 
-    int width()  const { return (data == nullptr) ? 0 : image_width; }
-    int height() const { return (data == nullptr) ? 0 : image_height; }
+    int width()  const { return loaded ? image_width : 0; }
+    int height() const { return loaded ? image_height : 0; }
+
+    // Number of mip levels available (only containers carry more than one).
+    int levels() const { return loaded ? (mapped_levels ? mapped_level_count : 1) : 0; }
 
-    const unsigned char* pixel_data(int x, int y) const {
-        // Return the address of the three bytes of the pixel at x,y (or magenta if no data).
+    const unsigned char* pixel_data(int x, int y, int level = 0) const {
+        // Return the address of the three bytes of the pixel at x,y (or magenta if no data). The
+        // address stays valid until the next pixel_data() call on the same thread. Coordinates
+        // are in texels of the requested mip level.
         static unsigned char magenta[] = { 255, 0, 255 };
-        if (data == nullptr) return magenta;
+        if (!loaded) return magenta;
+
+        if (mapped_levels) {
+            level = clamp(level, 0, mapped_level_count);
+            const auto& info = mapped_levels[level];
+            x = clamp(x, 0, static_cast<int>(info.width));
+            y = clamp(y, 0, static_cast<int>(info.height));
+            auto tile_index = static_cast<uint64_t>(y >> texture_tile_log2) * info.tiles_x + (x >> texture_tile_log2);
+            return container.data() + info.offset + tile_index * texture_tile_bytes + texture_tile_offset(x, y);
+        }
 
         x = clamp(x, 0, image_width);
         y = clamp(y, 0, image_height);
 
-        return data + y * bytes_per_scanline + x * bytes_per_pixel;
+        auto tile_index = (y >> texture_tile_log2) * tiles_x + (x >> texture_tile_log2);
+
+        // Consecutive lookups mostly land in the same tile, so each thread remembers the last tile
+        // it used and only goes through the shared cache (and its lock) when that changes.
+        thread_local uint32_t last_image = 0;
+        thread_local int last_tile = -1;
+        thread_local shared_ptr<const texture_tile> last;
+
+        if (last_image != image_id || last_tile != tile_index) {
+            last = texture_cache::global().fetch(*this, image_id, tile_index);
+            last_image = image_id;
+            last_tile = tile_index;
+        }
+        else {
+            texture_cache::count_held_hit();
+        }
+
+        return last->texels + texture_tile_offset(x, y);
+    }
+
+    void read_tile(int tile_index, texture_tile& dst) const override {
+        if (!spill) {
+            dst = resident_tiles[tile_index];
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(spill_mutex);
+        fseek(spill, static_cast<long>(tile_index) * texture_tile_bytes, SEEK_SET);
+        if (fread(dst.texels, texture_tile_bytes, 1, spill) != 1)
+            std::cerr << "ERROR: Could not read texture tile " << tile_index << ".\n";
     }
 
 private:
-    const int bytes_per_pixel = 3;
-    unsigned char* data;
-    int image_width, image_height;
-    int bytes_per_scanline;
+    const int bytes_per_pixel = texture_bytes_per_pixel;
+    uint32_t image_id;         // Key of this image's tiles in the texture cache (new on each load)
+    bool loaded = false;
+    int image_width = 0, image_height = 0;
+    int tiles_x = 0, tiles_y = 0;
+
+    mapped_file container;                               // Mapped texture container, if any
+    const texture_file_level* mapped_levels = nullptr;   // Level table inside the container
+    int mapped_level_count = 0;
+
+    FILE* spill = nullptr;                      // Backing store for tiles evicted from the cache
+    mutable std::mutex spill_mutex;             // Serializes seek+read on the spill file
+    std::vector<texture_tile> resident_tiles;   // Fallback backing store if no spill file
+
+    // Map a texture container. If source_filename is given, the container is only used if it was
+    // converted from the current version of that file. Returns true on success.
+    bool map_container(const std::string& filename, const std::string& source_filename = "") {
+        std::error_code ec;
+        if (!std::filesystem::is_regular_file(filename, ec)) return false;
+        if (!container.open(filename)) return false;
+
+        auto levels = validate_texture_file(container.data(), container.size());
+        texture_file_header header;
+        if (levels) memcpy(&header, container.data(), sizeof(header));
+
+        if (levels && !source_filename.empty()) {
+            uint64_t size;
+            int64_t mtime;
+            source_stamp(source_filename, size, mtime);
+            if (header.source_size != size || header.source_mtime != mtime) levels = nullptr;
+        }
+
+        if (!levels) {
+            container.close();
+            return false;
+        }
+
+        replace_image_id();
+        mapped_levels = levels;
+        mapped_level_count = static_cast<int>(header.level_count);
+        image_width = static_cast<int>(levels[0].width);
+        image_height = static_cast<int>(levels[0].height);
+        tiles_x = static_cast<int>(levels[0].tiles_x);
+        tiles_y = static_cast<int>(levels[0].tiles_y);
+        loaded = true;
+        return true;
+    }
+
+    // Size and modification time of a file, recorded in containers to detect stale conversions.
+    static void source_stamp(const std::string& filename, uint64_t& size, int64_t& mtime) {
+        std::error_code ec;
+        size = static_cast<uint64_t>(std::filesystem::file_size(filename, ec));
+        if (ec) size = 0;
+        auto time = std::filesystem::last_write_time(filename, ec);
+        mtime = ec ? 0 : static_cast<int64_t>(time.time_since_epoch().count());
+    }
+
+    // Drop the tiles of an earlier load from the cache and key this image's tiles anew, so that
+    // a tile another thread still holds from the old image (see pixel_data) can't be returned.
+    void replace_image_id() {
+        texture_cache::global().evict_image(image_id);
+        image_id = texture_cache::next_image_id();
+    }
+
+    // Rearrange a decoded row-major image into tiles and write them to the backing store: the
+    // spill file, or memory if the spill file can't be created or written.
+    void store_tiles(const unsigned char* data) {
+        replace_image_id();
+        container.close();
+        mapped_levels = nullptr;
+        mapped_level_count = 0;
+
+        tiles_x = (image_width + texture_tile_size - 1) >> texture_tile_log2;
+        tiles_y = (image_height + texture_tile_size - 1) >> texture_tile_log2;
+
+        if (spill) fclose(spill);
+        spill = tmpfile();
+        resident_tiles.clear();
+
+        texture_tile tile;
+        if (spill) {
+            bool written = true;
+            for (int ty = 0; ty < tiles_y && written; ty++) {
+                for (int tx = 0; tx < tiles_x && written; tx++) {
+                    copy_image_tile(data, image_width, image_height, tx, ty, tile);
+                    written = fwrite(tile.texels, texture_tile_bytes, 1, spill) == 1;
+                }
+            }
+            if (written && fflush(spill) == 0) return;
+
+            std::cerr << "WARNING: Could not write texture spill file, keeping the texture in memory.\n";
+            fclose(spill);
+            spill = nullptr;
+        }
+
+        resident_tiles.resize(static_cast<size_t>(tiles_x) * tiles_y);
+        for (int ty = 0; ty < tiles_y; ty++)
+            for (int tx = 0; tx < tiles_x; tx++)
+                copy_image_tile(data, image_width, image_height, tx, ty, resident_tiles[static_cast<size_t>(ty) * tiles_x + tx]);
+    }
 
     static int clamp(int x, int low, int high) {
         // Return the value clamped to the range [low, high).
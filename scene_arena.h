@@ -0,0 +1,94 @@
+#ifndef SCENE_ARENA_H
+#define SCENE_ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+using std::shared_ptr;
+
+// True for types whose destructor has nothing to do when every object they refer to was also
+// allocated from the arena: the arena then skips it, so tearing down a scene of millions of such
+// objects is a handful of chunk frees. Specialized next to the classes it applies to.
+template <class T>
+struct skip_arena_destructor : std::is_trivially_destructible<T> {};
+
+// Bump allocator that owns the objects of a scene (hittables, materials, textures). Objects are
+// placed one after another in large chunks instead of in one heap block (plus control block)
+// each, and are handed out as non-owning shared_ptrs, so they plug into every interface that takes
+// a shared_ptr but copying them never touches a reference count. The arena must outlive every
+// handle to its objects; hittable_list::arena keeps it alive alongside the world built from it.
+// Objects whose destructor is skipped (see above) must only be given handles from the same arena.
+//
+// Not thread-safe: build a scene from one thread.
+class scene_arena {
+public:
+    scene_arena() = default;
+    scene_arena(const scene_arena&) = delete;
+    scene_arena& operator=(const scene_arena&) = delete;
+
+    ~scene_arena() {
+        // Later objects may refer to earlier ones, so destroy in reverse order of construction.
+        for (auto d = destructors.rbegin(); d != destructors.rend(); ++d)
+            d->destroy(d->object);
+    }
+
+    // Construct a T in the arena.
+    template <class T, class... Args>
+    shared_ptr<T> make(Args&&... args) {
+        auto object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if constexpr (!skip_arena_destructor<T>::value)
+            destructors.push_back({ object, [](void* p) { static_cast<T*>(p)->~T(); } });
+        objects++;
+
+        // Aliasing constructor with an empty owner: a non-null pointer with no control block.
+        return shared_ptr<T>(shared_ptr<T>(), object);
+    }
+
+    size_t object_count() const { return objects; }
+    size_t bytes_used() const { return used; }
+    size_t bytes_reserved() const { return reserved; }
+
+private:
+    static constexpr size_t chunk_size = size_t(1) << 20;
+
+    struct destructor {
+        void* object;
+        void (*destroy)(void*);
+    };
+
+    std::vector<std::unique_ptr<std::byte[]>> chunks;
+    std::byte* next = nullptr;   // Free space in the current chunk
+    size_t left = 0;
+    std::vector<destructor> destructors;
+    size_t objects = 0, used = 0, reserved = 0;
+
+    void* allocate(size_t size, size_t alignment) {
+        void* p = next;
+        if (!std::align(alignment, size, p, left)) {
+            auto bytes = std::max(chunk_size, size + alignment);
+            chunks.emplace_back(new std::byte[bytes]);
+            reserved += bytes;
+            p = chunks.back().get();
+            left = bytes;
+            std::align(alignment, size, p, left);
+        }
+        next = static_cast<std::byte*>(p) + size;
+        left -= size;
+        used += size;
+        return p;
+    }
+};
+
+// Construct a T in `arena`, or with make_shared when there is none.
+template <class T, class... Args>
+shared_ptr<T> make_in(scene_arena* arena, Args&&... args) {
+    if (arena) return arena->make<T>(std::forward<Args>(args)...);
+    return std::make_shared<T>(std::forward<Args>(args)...);
+}
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef SCENE_GENERATORS_H
+#define SCENE_GENERATORS_H
+
+#include "helper.h"
+
+#include "bvh.h"
+#include "camera.h"
+#include "constant_medium.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "quad.h"
+#include "scene_loader.h"
+#include "sphere.h"
+#include "sphere_set.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Procedural scenes of any size, for measuring how build time, memory and render speed scale with
+// the number of objects. Each generator lays `count` objects out on a square grid (so the scene's
+// extent grows with sqrt(count)) over a ground, lit by the sky, and frames the camera on it. The
+// objects come from a fixed seed, so a given kind and count always gives the same scene.
+//
+//     spheres   a field of diffuse, metal and glass spheres
+//     city      a city of boxes of random heights (six quads each)
+//     shells    clusters of four nested hollow glass shells (two spheres each)
+//     media     dense constant-density fog balls
+//     particles a cloud of small spheres, packed into one sphere_set
+
+const uint64_t scene_generator_seed = 0x5ca1ab1e;
+
+inline const std::vector<std::string>& scene_generator_names() {
+    static const std::vector<std::string> names = { "spheres", "city", "shells", "media", "particles" };
+    return names;
+}
+
+inline bool is_scene_generator(const std::string& kind) {
+    for (const auto& name : scene_generator_names())
+        if (name == kind) return true;
+    return false;
+}
+
+// Grid cell of the n-th object: centers spaced one unit apart, the whole grid centered on the origin.
+inline point3 grid_cell_center(size_t n, size_t side) {
+    auto offset = (side - 1) / 2.0;
+    return point3(double(n % side) - offset, 0, double(n / side) - offset);
+}
+
+// Materials shared by all the objects of a generated scene, so per-object memory stays small.
+inline std::vector<shared_ptr<material>> generated_palette(scene_arena& arena) {
+    std::vector<shared_ptr<material>> palette;
+    for (int n = 0; n < 8; n++)
+        palette.push_back(arena.make<lambertian>(arena.make<solid_color>(color::random(0.1, 0.9))));
+    for (int n = 0; n < 3; n++)
+        palette.push_back(arena.make<metal>(arena.make<solid_color>(color::random(0.5, 1.0)), random_double(0, 0.3)));
+    palette.push_back(arena.make<dielectric>(1.5));
+    return palette;
+}
+
+// Fill `world` with `count` objects of the given kind (plus the ground), allocated from a new arena
+// that the world owns, and point `cam` at them. Returns false if there is no generator of that kind.
+inline bool generate_scene(const std::string& kind, size_t count, hittable_list& world, camera& cam) {
+    if (!is_scene_generator(kind) || count == 0) return false;
+
+    world.clear();
+    world.arena = make_shared<scene_arena>();
+    auto& arena = *world.arena;
+
+    seed_random(scene_generator_seed);
+    auto side = static_cast<size_t>(std::ceil(std::sqrt(static_cast<double>(count))));
+    auto palette = generated_palette(arena);
+    auto random_material = [&]() { return palette[random_int(0, static_cast<int>(palette.size()) - 1)]; };
+    auto glass = arena.make<dielectric>(1.5);
+
+    world.objects.reserve(count + 1);
+    auto ground = arena.make<lambertian>(arena.make<solid_color>(color(0.5, 0.5, 0.5)));
+    auto half = side / 2.0 + 1;
+    world.add(arena.make<quad>(point3(-half, 0, -half), vec3(2 * half, 0, 0), vec3(0, 0, 2 * half), ground));
+
+    if (kind == "spheres") {
+        for (size_t n = 0; n < count; n++) {
+            auto radius = random_double(0.15, 0.4);
+            auto center = grid_cell_center(n, side) + vec3(random_double(-0.1, 0.1), radius, random_double(-0.1, 0.1));
+            world.add(arena.make<sphere>(center, radius, random_material()));
+        }
+    }
+    else if (kind == "city") {
+        world.objects.reserve(6 * count + 1);
+        for (size_t n = 0; n < count; n++) {
+            auto base = grid_cell_center(n, side);
+            auto width = random_double(0.5, 0.9), depth = random_double(0.5, 0.9);
+            auto height = 0.3 + 3 * random_double() * random_double();
+            auto building = box(base - vec3(width / 2, 0, depth / 2), base + vec3(width / 2, height, depth / 2),
+                                random_material(), &arena);
+            for (const auto& face : building->objects)
+                world.add(face);
+        }
+    }
+    else if (kind == "shells") {
+        // Count is the number of shells; each cluster holds four, the innermost with a solid core.
+        auto clusters = (count + 3) / 4;
+        side = static_cast<size_t>(std::ceil(std::sqrt(static_cast<double>(clusters))));
+        world.objects.reserve(2 * count + clusters + 1);
+        for (size_t c = 0; c < clusters; c++) {
+            auto center = grid_cell_center(c, side) + vec3(0, 0.45, 0);
+            auto shells = std::min<size_t>(4, count - 4 * c);
+            for (size_t s = 0; s < shells; s++) {
+                auto radius = 0.45 - 0.1 * s;
+                world.add(arena.make<sphere>(center, radius, glass));
+                world.add(arena.make<sphere>(center, -0.9 * radius, glass));
+            }
+            if (shells == 4)
+                world.add(arena.make<sphere>(center, 0.08, random_material()));
+        }
+    }
+    else if (kind == "media") {
+        for (size_t n = 0; n < count; n++) {
+            auto radius = random_double(0.25, 0.45);
+            auto center = grid_cell_center(n, side) + vec3(0, radius, 0);
+            auto boundary = arena.make<sphere>(center, radius, glass);
+            world.add(arena.make<constant_medium>(boundary, random_double(5, 50), color::random(0.2, 1.0)));
+        }
+    }
+    else if (kind == "particles") {
+        // Four particles per unit of volume, in a layer two units deep over a smaller grid.
+        side = static_cast<size_t>(std::ceil(std::sqrt(count / 8.0)));
+        auto particles = arena.make<sphere_set>();
+        particles->reserve(count);
+        auto extent = side / 2.0;
+        for (size_t n = 0; n < count; n++) {
+            auto center = point3(random_double(-extent, extent), random_double(0.1, 2.1), random_double(-extent, extent));
+            particles->add(center, random_double(0.04, 0.12), random_material());
+        }
+        particles->build();
+        world.add(particles);
+    }
+
+    // Look down on the grid from one side, far enough back to see all of it.
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 400;
+    cam.samples_per_pixel = 32;
+    cam.max_depth = 16;
+    cam.vfov = 40;
+    cam.background = color(0.70, 0.80, 1.00);
+    cam.lookfrom = point3(0, 0.55 * side + 1.5, 1.1 * side + 2);
+    cam.lookat = point3(0, 0, -0.1 * side);
+    cam.vup = vec3(0, 1, 0);
+    cam.defocus_angle = 0;
+    cam.focus_dist = (cam.lookfrom - cam.lookat).length();
+    return true;
+}
+
+// Build the world (wrapped in a BVH) and camera of a scene source: either a scene file, relative to
+// `directory` unless absolute or `directory` is empty, or "generate:<kind>[:<count>]". The BVH is
+// built with `method`, in compact nodes if `compact` is set; an animated scene file is posed at
+// `frame` (by refitting its BVH, as an animation render would). Returns false (after printing
+// why) on failure.
+inline bool load_scene_source(const std::string& source, const std::string& directory, hittable_list& world, camera& cam,
+                              bvh_build_method method = bvh_build_method::sah, bool compact = false, int frame = 0) {
+    if (source.starts_with("generate:")) {
+        auto spec = source.substr(strlen("generate:"));
+        auto colon = spec.find(':');
+        auto kind = spec.substr(0, colon);
+        auto count = colon == std::string::npos ? 1000 : strtoull(spec.c_str() + colon + 1, nullptr, 10);
+        if (!generate_scene(kind, count, world, cam)) {
+            std::cerr << "ERROR: Unknown scene generator '" << spec << "'.\n";
+            return false;
+        }
+        if (frame != 0) {
+            std::cerr << "ERROR: Generated scene '" << spec << "' has no frames.\n";
+            return false;
+        }
+        world = hittable_list(make_shared<bvh_node>(world, 0, method, compact), world.arena);
+        return true;
+    }
+
+    scene_description scene;
+    auto path = (directory.empty() || source.starts_with("/")) ? source : directory + "/" + source;
+    if (!load_scene_description(path, scene))
+        return false;
+    if (frame < 0 || frame >= scene.frames) {
+        std::cerr << "ERROR: Scene '" << path << "' has no frame " << frame << ".\n";
+        return false;
+    }
+    scene_builder builder(scene);
+    builder.bvh_method = method;
+    builder.bvh_compact = compact;
+    world = builder.build();
+    cam = scene.cam;
+    if (frame != 0)
+        builder.set_frame(frame, cam);
+    return true;
+}
+
+#endif
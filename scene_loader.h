@@ -0,0 +1,820 @@
+#ifndef SCENE_LOADER_H
+#define SCENE_LOADER_H
+
+#include "helper.h"
+
+#include "bvh.h"
+#include "camera.h"
+#include "constant_medium.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "quad.h"
+#include "sphere.h"
+#include "texture.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Text scene description format
+// -----------------------------
+// One statement per line; '#' starts a comment. Numbers may be written as fractions ("9/16").
+// Wherever a texture is expected, either a texture name or a literal "r g b" color may be given.
+//
+//     camera <field> <values...>       any public camera member, e.g. "camera lookfrom -3 1 2"
+//     bvh on|off                       wrap the world in a bvh_node (default on)
+//
+//     texture <name> solid <r g b>
+//     texture <name> checker <scale> <even> <odd>
+//     texture <name> noise <scale> <r g b> [seed <n>] [bake <resolution> <period> [<x y z>]]
+//     texture <name> image <filename>
+//
+//     material <name> lambertian <texture>
+//     material <name> metal <texture> <fuzz>
+//     material <name> dielectric <index of refraction>
+//     material <name> diffuse_light <texture>
+//     material <name> isotropic <texture>
+//
+//     sphere <center> <radius> <material>
+//     moving_sphere <center1> <center2> <radius> <material>
+//     quad <Q> <u> <v> <material>
+//     box <corner a> <corner b> <material>
+//
+// A shape line on its own adds the shape to the world. Prefixing it with "object <name>" only
+// defines a named object, which can then be transformed, used as a medium boundary, or added:
+//
+//     object <name> <shape line>
+//     translate <name> <dx dy dz>      wrap the named object (the name now refers to the result)
+//     rotate_x|rotate_y|rotate_z <name> <degrees>
+//     medium <name> <boundary object> <density> <texture>
+//     add <name>
+//
+// Animation: "frames" makes the scene an animation, rendered to numbered image files. Keys set a
+// camera field, a named sphere's center, or a named translate's offset or rotation's angle at
+// a frame; values are interpolated linearly between keys and hold before the first and after
+// the last. A key on a name refers to what the name means at that point in the file. The
+// compiled cache and distributed rendering only render frame 0.
+//
+//     frames <count>                   render frames 0 to count - 1
+//     key <frame> camera <field> <values...>
+//     key <frame> <name> <values...>
+
+// Parsed scene: plain data describing textures, materials and shapes, which scene_builder turns
+// into the hittable graph. Objects refer to each other by index into these arrays.
+struct scene_texture_desc {
+    enum kind_t { solid, checker, noise, image } kind = solid;
+    color value;               // Solid color, or noise base color
+    double scale = 1;          // Checker or noise scale
+    int even = -1, odd = -1;   // Checker sub-textures
+    uint32_t seed = 0;         // Noise seed
+    int bake_resolution = 0;   // Noise bake grid size (0 = analytic, at most max_bake_resolution)
+    double bake_period = 0;    // Noise bake period in world units
+    point3 bake_origin;        // Low corner of the baked cube
+    std::string filename;      // Image file
+};
+
+const int max_bake_resolution = 1024;
+
+struct scene_material_desc {
+    enum kind_t { lambertian, metal, dielectric, diffuse_light, isotropic } kind = lambertian;
+    int texture = -1;          // Albedo or emission texture
+    double param = 0;          // Metal fuzz or dielectric index of refraction
+};
+
+struct scene_shape_desc {
+    enum kind_t {
+        sphere, moving_sphere, quad, box, translate, rotate_x, rotate_y, rotate_z, medium
+    } kind = sphere;
+    point3 a, b, c;            // Sphere center (a, moving to b), quad Q/u/v, box corners, offset
+    double value = 0;          // Radius, rotation angle in degrees, or medium density
+    int material = -1;         // Primitive material (media use `texture` instead)
+    int texture = -1;          // Medium phase function albedo
+    int child = -1;            // Object wrapped by a transform, or a medium's boundary
+};
+
+struct scene_key {
+    double frame = 0;
+    std::vector<double> values;
+};
+
+// The keys of one animated value.
+struct scene_track {
+    int shape = -1;            // Animated shape, or -1 for a camera field
+    std::string field;         // Camera field
+    std::vector<scene_key> keys;  // Sorted by frame
+
+    // Values at a frame, interpolated linearly between the keys around it.
+    std::vector<double> value_at(double frame) const {
+        auto next = std::upper_bound(keys.begin(), keys.end(), frame,
+                                     [](double f, const scene_key& key) { return f < key.frame; });
+        if (next == keys.begin()) return keys.front().values;
+        if (next == keys.end()) return keys.back().values;
+
+        auto& previous = *(next - 1);
+        auto t = (frame - previous.frame) / (next->frame - previous.frame);
+        std::vector<double> values(previous.values.size());
+        for (size_t i = 0; i < values.size(); i++)
+            values[i] = (1 - t) * previous.values[i] + t * next->values[i];
+        return values;
+    }
+};
+
+struct scene_description {
+    std::vector<scene_texture_desc> textures;
+    std::vector<scene_material_desc> materials;
+    std::vector<scene_shape_desc> shapes;
+    std::vector<int> world;    // Shapes added to the world, in order
+    bool use_bvh = true;
+    int frames = 1;            // Frames of an animation (1 = a still image)
+    std::vector<scene_track> tracks;
+    camera cam;                // Camera with all fields from the file applied, keyed ones at frame 0
+
+    std::unordered_map<std::string, int> texture_names;
+    std::unordered_map<std::string, int> material_names;
+    std::unordered_map<std::string, int> object_names;
+};
+
+// Set a public camera member by name. Returns false if the name or value count is wrong.
+inline bool set_camera_field(camera& cam, const std::string& field, const std::vector<double>& v) {
+    auto is = [&](const char* name, size_t count) { return field == name && v.size() == count; };
+
+    if (is("aspect_ratio", 1))      cam.aspect_ratio = v[0];
+    else if (is("image_width", 1))  cam.image_width = static_cast<int>(v[0]);
+    else if (is("fixed_height", 1)) cam.fixed_height = static_cast<int>(v[0]);
+    else if (is("samples_per_pixel", 1)) cam.samples_per_pixel = static_cast<int>(v[0]);
+    else if (is("max_depth", 1))    cam.max_depth = static_cast<int>(v[0]);
+    else if (is("background", 3))   cam.background = color(v[0], v[1], v[2]);
+    else if (is("vfov", 1))         cam.vfov = v[0];
+    else if (is("lookfrom", 3))     cam.lookfrom = point3(v[0], v[1], v[2]);
+    else if (is("lookat", 3))       cam.lookat = point3(v[0], v[1], v[2]);
+    else if (is("vup", 3))          cam.vup = vec3(v[0], v[1], v[2]);
+    else if (is("defocus_angle", 1)) cam.defocus_angle = v[0];
+    else if (is("focus_dist", 1))   cam.focus_dist = v[0];
+    else return false;
+
+    return true;
+}
+
+// Parses the text scene format into a scene_description.
+class scene_parser {
+public:
+    // Parse scene text. `source` names the input in error messages. Returns false (after printing
+    // the error) on the first malformed line.
+    bool parse(const std::string& text, const std::string& source, scene_description& scene) {
+        this->source = source;
+        this->scene = &scene;
+        line_number = 0;
+
+        size_t pos = 0;
+        while (pos < text.size()) {
+            auto end = text.find('\n', pos);
+            if (end == std::string::npos) end = text.size();
+            line_number++;
+
+            if (!tokenize(text.data() + pos, text.data() + end) || !parse_statement())
+                return false;
+            pos = end + 1;
+        }
+        apply_first_frame();
+        return true;
+    }
+
+private:
+    std::string source;
+    scene_description* scene = nullptr;
+    int line_number = 0;
+    std::vector<std::string_view> tokens;   // Views into the text being parsed
+    size_t next = 0;                        // Index of the next unread token
+
+    bool error(const std::string& message) {
+        std::cerr << "ERROR: " << source << ':' << line_number << ": " << message << '\n';
+        return false;
+    }
+
+    // Split a line into whitespace-separated tokens, dropping any comment.
+    bool tokenize(const char* begin, const char* end) {
+        tokens.clear();
+        next = 0;
+        auto p = begin;
+        while (p < end && *p != '#') {
+            if (isspace(static_cast<unsigned char>(*p))) {
+                p++;
+                continue;
+            }
+            auto start = p;
+            while (p < end && *p != '#' && !isspace(static_cast<unsigned char>(*p))) p++;
+            tokens.emplace_back(start, static_cast<size_t>(p - start));
+        }
+        return true;
+    }
+
+    bool at_end() const { return next >= tokens.size(); }
+
+    bool peek_number() const {
+        if (at_end()) return false;
+        auto c = tokens[next][0];
+        return isdigit(static_cast<unsigned char>(c)) || c == '-' || c == '+' || c == '.';
+    }
+
+    bool read_word(std::string& word) {
+        if (at_end()) return error("unexpected end of line");
+        word.assign(tokens[next++]);
+        return true;
+    }
+
+    bool read_number(double& value) {
+        if (at_end()) return error("expected a number");
+        auto token = tokens[next++];
+        auto begin = token.data();
+        auto end = begin + token.size();
+        if (begin != end && *begin == '+') begin++;  // from_chars doesn't accept a leading '+'
+
+        auto result = std::from_chars(begin, end, value);
+        if (result.ec == std::errc() && result.ptr != end && *result.ptr == '/') {
+            double denominator;
+            result = std::from_chars(result.ptr + 1, end, denominator);
+            value /= denominator;
+        }
+        if (result.ec != std::errc() || result.ptr != end)
+            return error("expected a number, got '" + std::string(token) + "'");
+        return true;
+    }
+
+    bool read_vec3(vec3& v) {
+        return read_number(v[0]) && read_number(v[1]) && read_number(v[2]);
+    }
+
+    bool read_name(std::string& name) {
+        if (!read_word(name)) return false;
+        if (!isalpha(static_cast<unsigned char>(name[0])) && name[0] != '_')
+            return error("names must start with a letter, got '" + name + "'");
+        return true;
+    }
+
+    bool expect_end() {
+        if (!at_end()) return error("unexpected '" + std::string(tokens[next]) + "'");
+        return true;
+    }
+
+    template <typename Map>
+    bool lookup(const Map& names, const char* what, int& index) {
+        std::string name;
+        if (!read_word(name)) return false;
+        auto found = names.find(name);
+        if (found == names.end()) return error(std::string("unknown ") + what + " '" + name + "'");
+        index = found->second;
+        return true;
+    }
+
+    // A texture reference: either a texture name or a literal color, which becomes an anonymous
+    // solid texture.
+    bool read_texture(int& index) {
+        if (!peek_number()) return lookup(scene->texture_names, "texture", index);
+
+        scene_texture_desc tex;
+        if (!read_vec3(tex.value)) return false;
+        index = static_cast<int>(scene->textures.size());
+        scene->textures.push_back(tex);
+        return true;
+    }
+
+    bool parse_statement() {
+        if (tokens.empty()) return true;
+
+        std::string keyword;
+        read_word(keyword);
+
+        if (keyword == "camera") return parse_camera();
+        if (keyword == "bvh") return parse_bvh();
+        if (keyword == "texture") return parse_texture();
+        if (keyword == "material") return parse_material();
+        if (keyword == "add") return parse_add();
+        if (keyword == "frames") return parse_frames();
+        if (keyword == "key") return parse_key();
+        if (keyword == "medium") return parse_medium();
+        if (keyword == "translate" || keyword == "rotate_x" || keyword == "rotate_y" || keyword == "rotate_z")
+            return parse_transform(keyword);
+
+        std::string name;
+        if (keyword == "object") {
+            if (!read_name(name) || !read_word(keyword)) return false;
+        }
+
+        int shape;
+        if (!parse_shape(keyword, shape) || !expect_end()) return false;
+
+        if (name.empty())
+            scene->world.push_back(shape);
+        else
+            scene->object_names[name] = shape;
+        return true;
+    }
+
+    bool parse_camera() {
+        std::string field;
+        if (!read_word(field)) return false;
+
+        std::vector<double> values;
+        while (!at_end()) {
+            double value;
+            if (!read_number(value)) return false;
+            values.push_back(value);
+        }
+
+        if (!set_camera_field(scene->cam, field, values))
+            return error("bad camera field or value count for '" + field + "'");
+        return true;
+    }
+
+    bool parse_bvh() {
+        std::string setting;
+        if (!read_word(setting)) return false;
+        if (setting != "on" && setting != "off") return error("expected 'on' or 'off'");
+        scene->use_bvh = (setting == "on");
+        return expect_end();
+    }
+
+    bool parse_texture() {
+        std::string name, kind;
+        if (!read_name(name) || !read_word(kind)) return false;
+
+        scene_texture_desc tex;
+        if (kind == "solid") {
+            tex.kind = scene_texture_desc::solid;
+            if (!read_vec3(tex.value)) return false;
+        }
+        else if (kind == "checker") {
+            tex.kind = scene_texture_desc::checker;
+            if (!read_number(tex.scale) || !read_texture(tex.even) || !read_texture(tex.odd)) return false;
+        }
+        else if (kind == "noise") {
+            tex.kind = scene_texture_desc::noise;
+            if (!read_number(tex.scale) || !read_vec3(tex.value)) return false;
+            while (!at_end()) {
+                std::string option;
+                double value;
+                read_word(option);
+                if (option == "seed") {
+                    if (!read_number(value)) return false;
+                    tex.seed = static_cast<uint32_t>(value);
+                }
+                else if (option == "bake") {
+                    if (!read_number(value) || !read_number(tex.bake_period)) return false;
+                    if (value < 1 || value > max_bake_resolution || !(tex.bake_period > 0))
+                        return error("noise bake needs a resolution of 1 to " + std::to_string(max_bake_resolution)
+                                     + " and a positive period");
+                    tex.bake_resolution = static_cast<int>(value);
+                    if (peek_number() && !read_vec3(tex.bake_origin)) return false;
+                }
+                else {
+                    return error("unknown noise option '" + option + "'");
+                }
+            }
+        }
+        else if (kind == "image") {
+            tex.kind = scene_texture_desc::image;
+            if (!read_word(tex.filename)) return false;
+        }
+        else {
+            return error("unknown texture type '" + kind + "'");
+        }
+
+        if (!expect_end()) return false;
+        scene->texture_names[name] = static_cast<int>(scene->textures.size());
+        scene->textures.push_back(tex);
+        return true;
+    }
+
+    bool parse_material() {
+        std::string name, kind;
+        if (!read_name(name) || !read_word(kind)) return false;
+
+        scene_material_desc mat;
+        bool ok;
+        if (kind == "lambertian") {
+            mat.kind = scene_material_desc::lambertian;
+            ok = read_texture(mat.texture);
+        }
+        else if (kind == "metal") {
+            mat.kind = scene_material_desc::metal;
+            ok = read_texture(mat.texture) && read_number(mat.param);
+        }
+        else if (kind == "dielectric") {
+            mat.kind = scene_material_desc::dielectric;
+            ok = read_number(mat.param);
+        }
+        else if (kind == "diffuse_light") {
+            mat.kind = scene_material_desc::diffuse_light;
+            ok = read_texture(mat.texture);
+        }
+        else if (kind == "isotropic") {
+            mat.kind = scene_material_desc::isotropic;
+            ok = read_texture(mat.texture);
+        }
+        else {
+            return error("unknown material type '" + kind + "'");
+        }
+
+        if (!ok || !expect_end()) return false;
+        scene->material_names[name] = static_cast<int>(scene->materials.size());
+        scene->materials.push_back(mat);
+        return true;
+    }
+
+    bool parse_shape(const std::string& kind, int& index) {
+        scene_shape_desc shape;
+        bool ok;
+        if (kind == "sphere") {
+            shape.kind = scene_shape_desc::sphere;
+            ok = read_vec3(shape.a) && read_number(shape.value);
+        }
+        else if (kind == "moving_sphere") {
+            shape.kind = scene_shape_desc::moving_sphere;
+            ok = read_vec3(shape.a) && read_vec3(shape.b) && read_number(shape.value);
+        }
+        else if (kind == "quad") {
+            shape.kind = scene_shape_desc::quad;
+            ok = read_vec3(shape.a) && read_vec3(shape.b) && read_vec3(shape.c);
+        }
+        else if (kind == "box") {
+            shape.kind = scene_shape_desc::box;
+            ok = read_vec3(shape.a) && read_vec3(shape.b);
+        }
+        else {
+            return error("unknown statement '" + kind + "'");
+        }
+
+        if (!ok || !lookup(scene->material_names, "material", shape.material)) return false;
+
+        index = static_cast<int>(scene->shapes.size());
+        scene->shapes.push_back(shape);
+        return true;
+    }
+
+    bool parse_transform(const std::string& kind) {
+        std::string name;
+        if (!read_word(name)) return false;
+        auto found = scene->object_names.find(name);
+        if (found == scene->object_names.end()) return error("unknown object '" + name + "'");
+
+        scene_shape_desc shape;
+        shape.child = found->second;
+        bool ok;
+        if (kind == "translate") {
+            shape.kind = scene_shape_desc::translate;
+            ok = read_vec3(shape.a);
+        }
+        else {
+            shape.kind = (kind == "rotate_x") ? scene_shape_desc::rotate_x
+                       : (kind == "rotate_y") ? scene_shape_desc::rotate_y
+                       : scene_shape_desc::rotate_z;
+            ok = read_number(shape.value);
+        }
+
+        if (!ok || !expect_end()) return false;
+        found->second = static_cast<int>(scene->shapes.size());
+        scene->shapes.push_back(shape);
+        return true;
+    }
+
+    bool parse_medium() {
+        std::string name;
+        scene_shape_desc shape;
+        shape.kind = scene_shape_desc::medium;
+        if (!read_name(name)
+            || !lookup(scene->object_names, "object", shape.child)
+            || !read_number(shape.value)
+            || !read_texture(shape.texture)
+            || !expect_end())
+            return false;
+
+        scene->object_names[name] = static_cast<int>(scene->shapes.size());
+        scene->shapes.push_back(shape);
+        return true;
+    }
+
+    bool parse_add() {
+        int shape;
+        if (!lookup(scene->object_names, "object", shape) || !expect_end()) return false;
+        scene->world.push_back(shape);
+        return true;
+    }
+
+    bool parse_frames() {
+        double count;
+        if (!read_number(count) || !expect_end()) return false;
+        if (count < 1 || count != std::floor(count)) return error("expected a whole number of frames");
+        scene->frames = static_cast<int>(count);
+        return true;
+    }
+
+    bool parse_key() {
+        double frame;
+        std::string target;
+        if (!read_number(frame) || !read_word(target)) return false;
+
+        scene_track track;
+        if (target == "camera") {
+            if (!read_word(track.field)) return false;
+        }
+        else {
+            auto found = scene->object_names.find(target);
+            if (found == scene->object_names.end()) return error("unknown object '" + target + "'");
+            track.shape = found->second;
+        }
+
+        std::vector<double> values;
+        while (!at_end()) {
+            double value;
+            if (!read_number(value)) return false;
+            values.push_back(value);
+        }
+
+        if (track.shape < 0) {
+            camera probe;
+            if (!set_camera_field(probe, track.field, values))
+                return error("bad camera field or value count for '" + track.field + "'");
+        }
+        else {
+            size_t count;
+            switch (scene->shapes[track.shape].kind) {
+            case scene_shape_desc::sphere:
+            case scene_shape_desc::translate:
+                count = 3;
+                break;
+            case scene_shape_desc::rotate_x:
+            case scene_shape_desc::rotate_y:
+            case scene_shape_desc::rotate_z:
+                count = 1;
+                break;
+            default:
+                return error("only spheres, translates and rotations can be keyed, not '" + target + "'");
+            }
+            if (values.size() != count)
+                return error("expected " + std::to_string(count) + " values for '" + target + "'");
+        }
+
+        auto existing = std::find_if(scene->tracks.begin(), scene->tracks.end(), [&](const scene_track& t) {
+            return t.shape == track.shape && t.field == track.field;
+        });
+        if (existing == scene->tracks.end())
+            existing = scene->tracks.insert(existing, track);
+
+        auto& keys = existing->keys;
+        auto at = std::lower_bound(keys.begin(), keys.end(), frame,
+                                   [](const scene_key& key, double f) { return key.frame < f; });
+        if (at != keys.end() && at->frame == frame)
+            at->values = values;
+        else
+            keys.insert(at, scene_key{ frame, values });
+        return true;
+    }
+
+    // Set the keyed camera fields and shapes to their frame 0 values, so that everything which
+    // renders the description as a still (the compiled cache, distributed workers) sees frame 0.
+    void apply_first_frame() {
+        for (const auto& track : scene->tracks) {
+            auto values = track.value_at(0);
+            if (track.shape < 0) {
+                set_camera_field(scene->cam, track.field, values);
+                continue;
+            }
+            auto& shape = scene->shapes[track.shape];
+            if (values.size() == 3) shape.a = point3(values[0], values[1], values[2]);
+            else shape.value = values[0];
+        }
+    }
+};
+
+// Turns a scene_description into textures, materials and hittables. Every description entry is
+// built once, so an object that is both added to the world and used as a medium boundary (or a
+// texture shared by several materials) is a single shared instance.
+class scene_builder {
+public:
+    shared_ptr<scene_arena> arena;  // Owns everything built (see scene_arena.h)
+    int bvh_threads = 0;            // Threads to build the BVH on (0 = one per hardware thread)
+    bvh_build_method bvh_method = bvh_build_method::sah;
+    bool bvh_compact = false;       // Store the BVH in quantized nodes (see bvh.h)
+    shared_ptr<bvh_node> bvh;       // The world's BVH once built, if it has one
+
+    scene_builder(const scene_description& desc) : arena(make_shared<scene_arena>()), desc(desc) {
+        textures.resize(desc.textures.size());
+        materials.resize(desc.materials.size());
+        shapes.resize(desc.shapes.size());
+    }
+
+    // Build the world, wrapped in a bvh_node unless the scene turned that off. An animated scene
+    // is built posed at frame 0. The world keeps the builder's arena alive.
+    hittable_list build() {
+        hittable_list world;
+        world.arena = arena;
+        for (auto index : desc.world)
+            world.add(shape(index));
+        pose(0);
+
+        if (desc.use_bvh && !world.objects.empty()) {
+            bvh = arena->make<bvh_node>(world, bvh_threads, bvh_method, bvh_compact);
+            world = hittable_list(bvh, arena);
+        }
+        return world;
+    }
+
+    // Move an animated scene to a frame after build(): set the keyed camera fields on `cam`, move
+    // the keyed shapes, and refit the BVH (or rebuild it, see bvh_node::update). Returns true if
+    // the BVH was rebuilt.
+    bool set_frame(double frame, camera& cam) {
+        for (const auto& track : desc.tracks) {
+            if (track.shape < 0)
+                set_camera_field(cam, track.field, track.value_at(frame));
+        }
+        pose(frame);
+        return bvh && bvh->update();
+    }
+
+    shared_ptr<texture> texture_at(int index) {
+        if (textures[index]) return textures[index];
+
+        const auto& t = desc.textures[index];
+        shared_ptr<texture> result;
+        switch (t.kind) {
+        case scene_texture_desc::solid:
+            result = arena->make<solid_color>(t.value);
+            break;
+        case scene_texture_desc::checker:
+            result = arena->make<checker_texture>(t.scale, texture_at(t.even), texture_at(t.odd));
+            break;
+        case scene_texture_desc::noise: {
+            auto noise = arena->make<noise_texture>(t.scale, t.value, t.seed);
+            if (t.bake_resolution > 0)
+                noise->bake(t.bake_resolution, t.bake_period, t.bake_origin).print(std::clog);
+            result = noise;
+            break;
+        }
+        case scene_texture_desc::image:
+            result = arena->make<image_texture>(t.filename.c_str());
+            break;
+        }
+
+        return textures[index] = result;
+    }
+
+    shared_ptr<material> material_at(int index) {
+        if (materials[index]) return materials[index];
+
+        const auto& m = desc.materials[index];
+        shared_ptr<material> result;
+        switch (m.kind) {
+        case scene_material_desc::lambertian:
+            result = arena->make<lambertian>(texture_at(m.texture));
+            break;
+        case scene_material_desc::metal:
+            result = arena->make<metal>(texture_at(m.texture), m.param);
+            break;
+        case scene_material_desc::dielectric:
+            result = arena->make<dielectric>(m.param);
+            break;
+        case scene_material_desc::diffuse_light:
+            result = arena->make<diffuse_light>(texture_at(m.texture));
+            break;
+        case scene_material_desc::isotropic:
+            result = arena->make<isotropic>(texture_at(m.texture));
+            break;
+        }
+
+        return materials[index] = result;
+    }
+
+    shared_ptr<hittable> shape(int index) {
+        if (shapes[index]) return shapes[index];
+
+        const auto& s = desc.shapes[index];
+        shared_ptr<hittable> result;
+        switch (s.kind) {
+        case scene_shape_desc::sphere:
+            result = arena->make<sphere>(s.a, s.value, material_at(s.material));
+            break;
+        case scene_shape_desc::moving_sphere:
+            result = arena->make<sphere>(s.a, s.b, s.value, material_at(s.material));
+            break;
+        case scene_shape_desc::quad:
+            result = arena->make<quad>(s.a, s.b, s.c, material_at(s.material));
+            break;
+        case scene_shape_desc::box:
+            result = box(s.a, s.b, material_at(s.material), arena.get());
+            break;
+        case scene_shape_desc::translate:
+            result = arena->make<translate>(shape(s.child), s.a);
+            break;
+        case scene_shape_desc::rotate_x:
+            result = arena->make<rotate_x>(shape(s.child), s.value);
+            break;
+        case scene_shape_desc::rotate_y:
+            result = arena->make<rotate_y>(shape(s.child), s.value);
+            break;
+        case scene_shape_desc::rotate_z:
+            result = arena->make<rotate_z>(shape(s.child), s.value);
+            break;
+        case scene_shape_desc::medium:
+            result = arena->make<constant_medium>(shape(s.child), s.value, texture_at(s.texture));
+            break;
+        }
+
+        return shapes[index] = result;
+    }
+
+private:
+    const scene_description& desc;
+    std::vector<shared_ptr<texture>> textures;
+    std::vector<shared_ptr<material>> materials;
+    std::vector<shared_ptr<hittable>> shapes;
+
+    // Move the keyed shapes to a frame, and update the bounding boxes of the shapes wrapping them.
+    void pose(double frame) {
+        if (desc.tracks.empty()) return;
+
+        std::vector<const scene_track*> keyed(shapes.size(), nullptr);
+        for (const auto& track : desc.tracks) {
+            if (track.shape >= 0) keyed[track.shape] = &track;
+        }
+
+        // A shape only wraps shapes defined before it, so one pass in order updates a wrapped
+        // shape before its wrappers.
+        std::vector<char> moved(shapes.size(), 0);
+        for (size_t i = 0; i < shapes.size(); i++) {
+            const auto& s = desc.shapes[i];
+            if (!shapes[i] || !(keyed[i] || (s.child >= 0 && moved[s.child]))) continue;
+            moved[i] = 1;
+
+            auto posed = s;
+            if (keyed[i]) {
+                auto values = keyed[i]->value_at(frame);
+                if (values.size() == 3) posed.a = point3(values[0], values[1], values[2]);
+                else posed.value = values[0];
+            }
+
+            switch (s.kind) {
+            case scene_shape_desc::sphere:
+                static_cast<sphere*>(shapes[i].get())->set_center(posed.a);
+                break;
+            case scene_shape_desc::translate:
+                static_cast<translate*>(shapes[i].get())->set_offset(posed.a);
+                break;
+            case scene_shape_desc::rotate_x:
+                static_cast<rotate_x*>(shapes[i].get())->set_angle(posed.value);
+                break;
+            case scene_shape_desc::rotate_y:
+                static_cast<rotate_y*>(shapes[i].get())->set_angle(posed.value);
+                break;
+            case scene_shape_desc::rotate_z:
+                static_cast<rotate_z*>(shapes[i].get())->set_angle(posed.value);
+                break;
+            default:
+                break;  // A medium's bounding box is its boundary's
+            }
+        }
+    }
+};
+
+// 64-bit FNV-1a, used to tie caches and checkpoints to the exact scene text they came from.
+inline uint64_t fnv1a_hash(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull) {
+    auto bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Read a whole file into a string. Returns false if it can't be opened.
+inline bool read_text_file(const std::string& filename, std::string& text) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) return false;
+    std::ostringstream contents;
+    contents << in.rdbuf();
+    text = contents.str();
+    return true;
+}
+
+// Parse a scene file. Returns false (after printing the error) if it can't be read or parsed.
+inline bool load_scene_description(const std::string& filename, scene_description& scene) {
+    std::string text;
+    if (!read_text_file(filename, text)) {
+        std::cerr << "ERROR: Could not open scene file '" << filename << "'.\n";
+        return false;
+    }
+    if (!scene_parser().parse(text, filename, scene))
+        return false;
+    scene.cam.scene_hash = fnv1a_hash(text.data(), text.size());
+    return true;
+}
+
+#endif
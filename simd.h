@@ -0,0 +1,114 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// Minimal four-lane float vector used by the vectorized kernels. Maps onto SSE2 where the target
+// guarantees it (every x64 build), and onto plain arrays elsewhere so the kernels still compile
+// and give the same results on other architectures.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RT_SIMD_SSE2 1
+#include <emmintrin.h>
+#else
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#endif
+
+class vfloat4 {
+public:
+    vfloat4() {}
+
+#if RT_SIMD_SSE2
+    vfloat4(float s) : v(_mm_set1_ps(s)) {}
+    vfloat4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) {}
+    explicit vfloat4(__m128 m) : v(m) {}
+
+    static vfloat4 load(const float* p) { return vfloat4(_mm_loadu_ps(p)); }
+    void store(float* p) const { _mm_storeu_ps(p, v); }
+
+    friend vfloat4 operator+(vfloat4 a, vfloat4 b) { return vfloat4(_mm_add_ps(a.v, b.v)); }
+    friend vfloat4 operator-(vfloat4 a, vfloat4 b) { return vfloat4(_mm_sub_ps(a.v, b.v)); }
+    friend vfloat4 operator*(vfloat4 a, vfloat4 b) { return vfloat4(_mm_mul_ps(a.v, b.v)); }
+
+    friend vfloat4 min(vfloat4 a, vfloat4 b) { return vfloat4(_mm_min_ps(a.v, b.v)); }
+    friend vfloat4 max(vfloat4 a, vfloat4 b) { return vfloat4(_mm_max_ps(a.v, b.v)); }
+    friend vfloat4 sqrt(vfloat4 a) { return vfloat4(_mm_sqrt_ps(a.v)); }
+
+    // Comparisons give lane masks: all bits set where true, zero where false.
+    friend vfloat4 operator<(vfloat4 a, vfloat4 b) { return vfloat4(_mm_cmplt_ps(a.v, b.v)); }
+    friend vfloat4 operator<=(vfloat4 a, vfloat4 b) { return vfloat4(_mm_cmple_ps(a.v, b.v)); }
+    friend vfloat4 operator>(vfloat4 a, vfloat4 b) { return vfloat4(_mm_cmpgt_ps(a.v, b.v)); }
+    friend vfloat4 operator>=(vfloat4 a, vfloat4 b) { return vfloat4(_mm_cmpge_ps(a.v, b.v)); }
+    friend vfloat4 operator&(vfloat4 a, vfloat4 b) { return vfloat4(_mm_and_ps(a.v, b.v)); }
+    friend vfloat4 operator|(vfloat4 a, vfloat4 b) { return vfloat4(_mm_or_ps(a.v, b.v)); }
+
+    // Bit i is set if lane i of a mask is true.
+    int mask() const { return _mm_movemask_ps(v); }
+#else
+    vfloat4(float s) : e{ s, s, s, s } {}
+    vfloat4(float a, float b, float c, float d) : e{ a, b, c, d } {}
+
+    static vfloat4 load(const float* p) { return vfloat4(p[0], p[1], p[2], p[3]); }
+    void store(float* p) const { for (int i = 0; i < 4; i++) p[i] = e[i]; }
+
+    friend vfloat4 operator+(vfloat4 a, vfloat4 b) { return a.zip(b, [](float x, float y) { return x + y; }); }
+    friend vfloat4 operator-(vfloat4 a, vfloat4 b) { return a.zip(b, [](float x, float y) { return x - y; }); }
+    friend vfloat4 operator*(vfloat4 a, vfloat4 b) { return a.zip(b, [](float x, float y) { return x * y; }); }
+
+    friend vfloat4 min(vfloat4 a, vfloat4 b) { return a.zip(b, [](float x, float y) { return x < y ? x : y; }); }
+    friend vfloat4 max(vfloat4 a, vfloat4 b) { return a.zip(b, [](float x, float y) { return x > y ? x : y; }); }
+    friend vfloat4 sqrt(vfloat4 a) { return a.zip(a, [](float x, float) { return std::sqrt(x); }); }
+
+    // Comparisons give lane masks: all bits set where true, zero where false.
+    friend vfloat4 operator<(vfloat4 a, vfloat4 b) { return a.zip(b, [](float x, float y) { return lane_mask(x < y); }); }
+    friend vfloat4 operator<=(vfloat4 a, vfloat4 b) { return a.zip(b, [](float x, float y) { return lane_mask(x <= y); }); }
+    friend vfloat4 operator>(vfloat4 a, vfloat4 b) { return a.zip(b, [](float x, float y) { return lane_mask(x > y); }); }
+    friend vfloat4 operator>=(vfloat4 a, vfloat4 b) { return a.zip(b, [](float x, float y) { return lane_mask(x >= y); }); }
+    friend vfloat4 operator&(vfloat4 a, vfloat4 b) { return a.zip(b, [](float x, float y) { return bits(bits(x) & bits(y)); }); }
+    friend vfloat4 operator|(vfloat4 a, vfloat4 b) { return a.zip(b, [](float x, float y) { return bits(bits(x) | bits(y)); }); }
+
+    // Bit i is set if lane i of a mask is true.
+    int mask() const {
+        int m = 0;
+        for (int i = 0; i < 4; i++)
+            if (bits(e[i]) >> 31) m |= 1 << i;
+        return m;
+    }
+#endif
+
+    // Load four floats from base[idx[0..3]].
+    static vfloat4 gather(const float* base, const int idx[4]) {
+        return vfloat4(base[idx[0]], base[idx[1]], base[idx[2]], base[idx[3]]);
+    }
+
+    float operator[](int i) const {
+        float lanes[4];
+        store(lanes);
+        return lanes[i];
+    }
+
+    // Sum of the four lanes.
+    float reduce_add() const {
+        float lanes[4];
+        store(lanes);
+        return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    }
+
+private:
+#if RT_SIMD_SSE2
+    __m128 v;
+#else
+    float e[4];
+
+    static uint32_t bits(float x) { return std::bit_cast<uint32_t>(x); }
+    static float bits(uint32_t x) { return std::bit_cast<float>(x); }
+    static float lane_mask(bool b) { return bits(b ? 0xffffffffu : 0u); }
+
+    template <typename F>
+    vfloat4 zip(vfloat4 b, F f) const {
+        return vfloat4(f(e[0], b.e[0]), f(e[1], b.e[1]), f(e[2], b.e[2]), f(e[3], b.e[3]));
+    }
+#endif
+};
+
+#endif
@@ -4,6 +4,7 @@
 #include "hittable.h"
 #include "vec3.h"
 #include "material.h"
+#include "stats.h"
 
 // Class representing a sphere as a hittable object
 class sphere : public hittable {
@@ -11,24 +12,41 @@ public:
     // Constructor taking center, radius, and material pointer parameters to define the sphere
     // Stationary Sphere
     sphere(point3 _center, double _radius, shared_ptr<material> _material)
-        : center1(_center), radius(_radius), mat(_material), is_moving(false)
+        : radius(_radius), mat(_material)
     {
-        auto rvec = vec3(radius, radius, radius);
-        bbox = aabb(center1 - rvec, center1 + rvec);
+        set_center(_center);
     }
 
 
 
     // Moving Sphere
     sphere(point3 _center1, point3 _center2, double _radius, shared_ptr<material> _material)
-        : center1(_center1), radius(_radius), mat(_material), is_moving(true)
+        : radius(_radius), mat(_material)
     {
+        set_motion(_center1, _center2);
+    }
+
+    // Place the sphere, stationary, at a new center (for animation; refit or rebuild any BVH
+    // holding it afterwards).
+    void set_center(point3 _center) {
+        center1 = _center;
+        is_moving = false;
+        center_vec = vec3(0, 0, 0);
+
+        auto rvec = vec3(radius, radius, radius);
+        bbox = aabb(center1 - rvec, center1 + rvec);
+    }
+
+    // Move the sphere from _center1 at time 0 to _center2 at time 1.
+    void set_motion(point3 _center1, point3 _center2) {
+        center1 = _center1;
+        is_moving = true;
+        center_vec = _center2 - _center1;
+
         auto rvec = vec3(radius, radius, radius);
         aabb box1(_center1 - rvec, _center1 + rvec);
         aabb box2(_center2 - rvec, _center2 + rvec);
         bbox = aabb(box1, box2);
-
-        center_vec = _center2 - _center1;
     }
 
 
@@ -36,6 +54,8 @@ public:
     // Function to check if a ray hits the sphere within a specified range
     // and update the hit record if a hit occurs
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        RT_STAT(sphere_tests);
+
         // Compute the direction vector from the ray's origin to the sphere's center
         point3 center = is_moving ? sphere::center(r.time()) : center1;
         vec3 oc = r.origin() - center;
@@ -69,13 +89,28 @@ public:
         vec3 outward_normal = (rec.p - center) / radius;
         rec.set_face_normal(r, outward_normal);
         get_sphere_uv(outward_normal, rec.u, rec.v);
-        rec.mat = mat;
+        rec.mat = mat.get();
 
         return true;
     }
 
     aabb bounding_box() const override { return bbox; }
 
+    static void get_sphere_uv(const point3& p, double& u, double& v) {
+        // p: a given point on the sphere of radius one, centered at the origin.
+        // u: returned value [0,1] of angle around the Y axis from X=-1.
+        // v: returned value [0,1] of angle from Y=-1 to Y=+1.
+        //     <1 0 0> yields <0.50 0.50>       <-1  0  0> yields <0.00 0.50>
+        //     <0 1 0> yields <0.50 1.00>       < 0 -1  0> yields <0.50 0.00>
+        //     <0 0 1> yields <0.25 0.50>       < 0  0 -1> yields <0.75 0.50>
+
+        auto theta = acos(-p.y());
+        auto phi = atan2(-p.z(), p.x()) + pi;
+
+        u = phi / (2 * pi);
+        v = theta / pi;
+    }
+
 
 private:
     // Center and radius of the sphere
@@ -97,22 +132,11 @@ private:
         return center1 + time * center_vec;
     }
 
-    static void get_sphere_uv(const point3& p, double& u, double& v) {
-        // p: a given point on the sphere of radius one, centered at the origin.
-        // u: returned value [0,1] of angle around the Y axis from X=-1.
-        // v: returned value [0,1] of angle from Y=-1 to Y=+1.
-        //     <1 0 0> yields <0.50 0.50>       <-1  0  0> yields <0.00 0.50>
-        //     <0 1 0> yields <0.50 1.00>       < 0 -1  0> yields <0.50 0.00>
-        //     <0 0 1> yields <0.25 0.50>       < 0  0 -1> yields <0.75 0.50>
-
-        auto theta = acos(-p.y());
-        auto phi = atan2(-p.z(), p.x()) + pi;
-
-        u = phi / (2 * pi);
-        v = theta / pi;
-    }
 
 
 };
 
+// A sphere only holds its material.
+template <> struct skip_arena_destructor<sphere> : std::true_type {};
+
 #endif
@@ -0,0 +1,301 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include "helper.h"
+
+#include "aabb.h"
+#include "hittable.h"
+#include "material.h"
+#include "simd.h"
+#include "sphere.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+// A large set of static spheres (particle data) stored as structure-of-arrays: float centers and
+// radii plus a 16-bit material index, 18 bytes per sphere instead of a heap-allocated sphere
+// object each. The set carries its own BVH, whose leaves hold four consecutive spheres that are
+// tested against a ray together on four-lane vectors (see simd.h). Those float tests only reject
+// misses, conservatively; candidates are then intersected as sphere::hit does, in double
+// precision, but on the stored float centers and radii, so the geometry differs from the
+// equivalent sphere objects by that rounding.
+//
+// Add the spheres, then call build() once before rendering.
+class sphere_set : public hittable {
+public:
+    void reserve(size_t count) {
+        xs.reserve(count + 3);
+        ys.reserve(count + 3);
+        zs.reserve(count + 3);
+        radii.reserve(count + 3);
+        material_ids.reserve(count);
+    }
+
+    // Add a sphere. As with sphere, a negative radius flips the normals inward (the inner surface
+    // of a hollow glass ball). Returns false (after printing why) if the set already uses 65536
+    // materials.
+    bool add(const point3& center, double radius, shared_ptr<material> mat) {
+        auto found = material_index.find(mat.get());
+        uint16_t id;
+        if (found != material_index.end()) {
+            id = found->second;
+        }
+        else {
+            if (materials.size() > UINT16_MAX) {
+                std::cerr << "ERROR: A sphere_set holds at most " << (UINT16_MAX + 1) << " materials.\n";
+                return false;
+            }
+            id = static_cast<uint16_t>(materials.size());
+            material_index[mat.get()] = id;
+            materials.push_back(mat);
+        }
+
+        xs.push_back(static_cast<float>(center.x()));
+        ys.push_back(static_cast<float>(center.y()));
+        zs.push_back(static_cast<float>(center.z()));
+        radii.push_back(static_cast<float>(radius));
+        material_ids.push_back(id);
+        return true;
+    }
+
+    size_t size() const { return material_ids.size(); }
+
+    // Sort the spheres into BVH leaf order and build the BVH.
+    void build() {
+        auto count = size();
+        nodes.clear();
+        if (count == 0) return;
+
+        std::vector<uint32_t> order(count);
+        for (size_t i = 0; i < count; i++) order[i] = static_cast<uint32_t>(i);
+        nodes.reserve(count / 2 + 1);
+        build_node(order, 0, static_cast<uint32_t>(count));
+
+        // Permute the arrays into leaf order, padding them so a leaf's four-lane loads stay in bounds.
+        auto permute = [&](auto& values, auto padding) {
+            std::remove_reference_t<decltype(values)> sorted(count + 3, padding);
+            for (size_t i = 0; i < count; i++) sorted[i] = values[order[i]];
+            values.swap(sorted);
+        };
+        permute(xs, 0.0f);
+        permute(ys, 0.0f);
+        permute(zs, 0.0f);
+        permute(radii, 0.0f);
+        permute(material_ids, uint16_t(0));
+        material_ids.resize(count);
+
+        const auto& root = nodes[0];
+        bbox = aabb(point3(root.bounds[0], root.bounds[1], root.bounds[2]),
+                    point3(root.bounds[3], root.bounds[4], root.bounds[5]));
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (nodes.empty()) return false;
+
+        const auto& origin = r.origin();
+        const auto& direction = r.direction();
+        double inverse[3] = { 1 / direction.x(), 1 / direction.y(), 1 / direction.z() };
+
+        // Single-precision ray for the leaf filter. Rounding the origin to float shifts it by up to
+        // about 1e-7 of its coordinates; growing the radii by more than that keeps the filter
+        // from rejecting spheres the exact test would hit.
+        vfloat4 ox(static_cast<float>(origin.x())), oy(static_cast<float>(origin.y())), oz(static_cast<float>(origin.z()));
+        vfloat4 dx(static_cast<float>(direction.x())), dy(static_cast<float>(direction.y())), dz(static_cast<float>(direction.z()));
+        auto a = static_cast<float>(direction.length_squared());
+        auto slack = static_cast<float>(1e-6 * (std::fabs(origin.x()) + std::fabs(origin.y()) + std::fabs(origin.z())));
+
+        auto closest = ray_t.max;
+        int64_t hit_index = -1;
+
+        uint32_t stack[64];
+        int top = 0;
+        uint32_t index = 0;
+        for (;;) {
+            RT_STAT(bvh_nodes);
+            const auto& n = nodes[index];
+            if (box_hit(n, origin, inverse, ray_t.min, closest)) {
+                if (n.count > 0) {
+                    test_leaf(n, r, ox, oy, oz, dx, dy, dz, a, slack, ray_t.min, closest, hit_index);
+                }
+                else {
+                    // Visit the child on the ray's side of the split first.
+                    auto first = index + 1, second = n.index;
+                    if (direction[n.axis] < 0) std::swap(first, second);
+                    stack[top++] = second;
+                    index = first;
+                    continue;
+                }
+            }
+            if (top == 0) break;
+            index = stack[--top];
+        }
+
+        if (hit_index < 0) return false;
+
+        auto center = point3(xs[hit_index], ys[hit_index], zs[hit_index]);
+        double radius = radii[hit_index];  // Signed, so a negative radius turns the normal inward
+        rec.t = closest;
+        rec.p = r.at(rec.t);
+        vec3 outward_normal = (rec.p - center) / radius;
+        rec.set_face_normal(r, outward_normal);
+        sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+        rec.mat = materials[material_ids[hit_index]].get();
+        return true;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    // Bytes held by the sphere arrays and the BVH.
+    size_t memory_used() const {
+        return (xs.capacity() + ys.capacity() + zs.capacity() + radii.capacity()) * sizeof(float)
+             + material_ids.capacity() * sizeof(uint16_t) + nodes.capacity() * sizeof(node);
+    }
+
+private:
+    // BVH node, 32 bytes. Nodes are stored depth first, so an interior node's first child follows it.
+    struct node {
+        float bounds[6];     // Min x, y, z, then max x, y, z
+        uint32_t index;      // Interior: second child; leaf: first sphere
+        uint16_t count;      // Spheres in a leaf (at most 4); 0 for interior nodes
+        uint16_t axis;       // Split axis of an interior node
+    };
+
+    std::vector<float> xs, ys, zs, radii;
+    std::vector<uint16_t> material_ids;
+    std::vector<shared_ptr<material>> materials;
+    std::unordered_map<const material*, uint16_t> material_index;
+    std::vector<node> nodes;
+    aabb bbox;
+
+    // Round outward, so float bounds still contain the double ones.
+    static float round_down(double x) {
+        auto f = static_cast<float>(x);
+        return f > x ? std::nextafter(f, -INFINITY) : f;
+    }
+    static float round_up(double x) {
+        auto f = static_cast<float>(x);
+        return f < x ? std::nextafter(f, INFINITY) : f;
+    }
+
+    // Build the subtree over order[first, last). Splits the spheres at the median centroid along
+    // the widest axis, rounded so the left part is a whole number of leaves: every leaf then
+    // starts at a multiple of four and only the last one can be partly filled.
+    uint32_t build_node(std::vector<uint32_t>& order, uint32_t first, uint32_t last) {
+        auto index = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+
+        double lo[3] = { infinity, infinity, infinity }, hi[3] = { -infinity, -infinity, -infinity };
+        double centroid_lo[3] = { infinity, infinity, infinity }, centroid_hi[3] = { -infinity, -infinity, -infinity };
+        for (auto i = first; i < last; i++) {
+            auto s = order[i];
+            double c[3] = { xs[s], ys[s], zs[s] };
+            double r = std::fabs(radii[s]);
+            for (int k = 0; k < 3; k++) {
+                lo[k] = std::min(lo[k], c[k] - r);
+                hi[k] = std::max(hi[k], c[k] + r);
+                centroid_lo[k] = std::min(centroid_lo[k], c[k]);
+                centroid_hi[k] = std::max(centroid_hi[k], c[k]);
+            }
+        }
+
+        node n;
+        for (int k = 0; k < 3; k++) {
+            n.bounds[k] = round_down(lo[k]);
+            n.bounds[3 + k] = round_up(hi[k]);
+        }
+        n.axis = 0;
+
+        auto count = last - first;
+        if (count <= 4) {
+            n.index = first;
+            n.count = static_cast<uint16_t>(count);
+            nodes[index] = n;
+            return index;
+        }
+
+        int axis = 0;
+        for (int k = 1; k < 3; k++)
+            if (centroid_hi[k] - centroid_lo[k] > centroid_hi[axis] - centroid_lo[axis]) axis = k;
+        const auto& key = axis == 0 ? xs : axis == 1 ? ys : zs;
+
+        auto mid = first + std::min(count - 1, (count / 2 + 3) / 4 * 4);
+        std::nth_element(order.begin() + first, order.begin() + mid, order.begin() + last,
+                         [&](uint32_t p, uint32_t q) { return key[p] < key[q]; });
+
+        n.count = 0;
+        n.axis = static_cast<uint16_t>(axis);
+        build_node(order, first, mid);
+        n.index = build_node(order, mid, last);
+        nodes[index] = n;
+        return index;
+    }
+
+    static bool box_hit(const node& n, const point3& origin, const double inverse[3], double t_min, double t_max) {
+        RT_STAT(box_tests);
+        for (int k = 0; k < 3; k++) {
+            auto t0 = (n.bounds[k] - origin[k]) * inverse[k];
+            auto t1 = (n.bounds[3 + k] - origin[k]) * inverse[k];
+            if (inverse[k] < 0) std::swap(t0, t1);
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+            if (t_max <= t_min) return false;
+        }
+        return true;
+    }
+
+    // Test a leaf's spheres: reject misses four at a time in float, then intersect the remaining
+    // candidates exactly, narrowing `closest` to each hit. Every sphere of the leaf counts as one
+    // sphere test, as it would as a sphere object.
+    void test_leaf(const node& n, const ray& r, vfloat4 ox, vfloat4 oy, vfloat4 oz, vfloat4 dx, vfloat4 dy,
+                   vfloat4 dz, float a, float slack, double t_min, double& closest, int64_t& hit_index) const {
+        RT_STAT_ADD(sphere_tests, n.count);
+        auto first = n.index;
+        auto ocx = vfloat4::load(&xs[first]) - ox;
+        auto ocy = vfloat4::load(&ys[first]) - oy;
+        auto ocz = vfloat4::load(&zs[first]) - oz;
+        auto radius = vfloat4::load(&radii[first]);
+        auto grown = max(radius, vfloat4(0) - radius) + vfloat4(slack);
+
+        auto h = ocx * dx + ocy * dy + ocz * dz;
+        auto oc2 = ocx * ocx + ocy * ocy + ocz * ocz;
+        auto discriminant = h * h - vfloat4(a) * (oc2 - grown * grown);
+
+        // Allow for float rounding in the discriminant itself, with a wide margin.
+        auto tolerance = vfloat4(1e-5f) * (h * h + vfloat4(a) * (oc2 + grown * grown));
+        auto candidates = (discriminant + tolerance >= vfloat4(0)).mask() & ((1 << n.count) - 1);
+
+        for (int lane = 0; candidates; lane++, candidates >>= 1) {
+            if (!(candidates & 1)) continue;
+            auto s = first + lane;
+            if (exact_hit(s, r, t_min, closest)) hit_index = s;
+        }
+    }
+
+    // sphere::hit for sphere s, without filling in a hit record.
+    bool exact_hit(uint32_t s, const ray& r, double t_min, double& closest) const {
+        vec3 oc = r.origin() - point3(xs[s], ys[s], zs[s]);
+        double radius = radii[s];
+        auto a = r.direction().length_squared();
+        auto half_b = dot(oc, r.direction());
+        auto c = oc.length_squared() - radius * radius;
+        auto discriminant = half_b * half_b - a * c;
+        if (discriminant < 0) return false;
+
+        auto sqrtd = sqrt(discriminant);
+        interval range(t_min, closest);
+        auto root = (-half_b - sqrtd) / a;
+        if (!range.surrounds(root)) {
+            root = (-half_b + sqrtd) / a;
+            if (!range.surrounds(root)) return false;
+        }
+        closest = root;
+        return true;
+    }
+};
+
+#endif
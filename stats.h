@@ -0,0 +1,101 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+
+// Render statistics. Compiled in only when RT_STATS is defined to 1 (the RT_STATS CMake option);
+// otherwise RT_STAT() and RT_STAT_ADD() expand to nothing and the counters cost nothing. Each thread counts into
+// its own thread_local block, which is folded into the totals when the thread finishes its rows.
+
+#ifndef RT_STATS
+#define RT_STATS 0
+#endif
+
+struct render_stats {
+    uint64_t primary_rays = 0;     // Camera rays
+    uint64_t secondary_rays = 0;   // Scattered rays
+    uint64_t bvh_nodes = 0;        // BVH nodes visited
+    uint64_t box_tests = 0;        // Ray/bounding box tests
+    uint64_t sphere_tests = 0;
+    uint64_t quad_tests = 0;
+    uint64_t medium_tests = 0;
+
+    void add(const render_stats& other) {
+        primary_rays += other.primary_rays;
+        secondary_rays += other.secondary_rays;
+        bvh_nodes += other.bvh_nodes;
+        box_tests += other.box_tests;
+        sphere_tests += other.sphere_tests;
+        quad_tests += other.quad_tests;
+        medium_tests += other.medium_tests;
+    }
+
+    // Write the counters and derived rates as a JSON object.
+    void write_json(std::ostream& out, double seconds, int threads) const {
+        auto rays = primary_rays + secondary_rays;
+        out << "{\n"
+            << "  \"enabled\": " << (RT_STATS ? "true" : "false") << ",\n"
+            << "  \"seconds\": " << seconds << ",\n"
+            << "  \"threads\": " << threads << ",\n"
+            << "  \"primary_rays\": " << primary_rays << ",\n"
+            << "  \"secondary_rays\": " << secondary_rays << ",\n"
+            << "  \"bvh_nodes_visited\": " << bvh_nodes << ",\n"
+            << "  \"box_tests\": " << box_tests << ",\n"
+            << "  \"primitive_tests\": {\n"
+            << "    \"sphere\": " << sphere_tests << ",\n"
+            << "    \"quad\": " << quad_tests << ",\n"
+            << "    \"constant_medium\": " << medium_tests << "\n"
+            << "  },\n"
+            << "  \"average_path_length\": " << (primary_rays ? double(rays) / primary_rays : 0.0) << ",\n"
+            << "  \"rays_per_second\": " << (seconds > 0 ? rays / seconds : 0.0) << "\n"
+            << "}\n";
+    }
+};
+
+// Totals over all threads since the last reset.
+class stats_collector {
+public:
+    static stats_collector& global() {
+        static stats_collector collector;
+        return collector;
+    }
+
+    static render_stats& local() {
+        thread_local render_stats stats;
+        return stats;
+    }
+
+    // Fold the calling thread's counters into the totals.
+    void flush_thread() {
+        std::lock_guard<std::mutex> lock(mutex);
+        totals.add(local());
+        local() = render_stats();
+    }
+
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex);
+        totals = render_stats();
+        local() = render_stats();
+    }
+
+    render_stats snapshot() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return totals;
+    }
+
+private:
+    std::mutex mutex;
+    render_stats totals;
+};
+
+#if RT_STATS
+#define RT_STAT(counter) (++stats_collector::local().counter)
+#define RT_STAT_ADD(counter, n) (stats_collector::local().counter += (n))
+#else
+#define RT_STAT(counter) ((void)0)
+#define RT_STAT_ADD(counter, n) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,45 @@
+// texconv: converts images to pre-decoded texture containers (.rtwt) that rtw_image memory-maps
+// at startup instead of decoding.
+//
+// Usage: texconv image [image...]         writes <image>.rtwt next to each image
+//        texconv -o out.rtwt image        writes a single container to the given name
+
+#include "helper.h"
+#include "rtw_stb_image.h"
+
+#include <cstring>
+#include <iostream>
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: texconv image [image...]\n"
+                  << "       texconv -o out.rtwt image\n";
+        return 1;
+    }
+
+    if (strcmp(argv[1], "-o") == 0) {
+        if (argc != 4) {
+            std::cerr << "texconv: -o takes an output name and exactly one image\n";
+            return 1;
+        }
+        if (!rtw_image::convert(argv[3], argv[2])) {
+            std::cerr << "ERROR: Could not convert '" << argv[3] << "'.\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    int failures = 0;
+    for (int i = 1; i < argc; i++) {
+        auto output = rtw_image::texture_file_name(argv[i]);
+        if (rtw_image::convert(argv[i], output)) {
+            std::clog << argv[i] << " -> " << output << '\n';
+        }
+        else {
+            std::cerr << "ERROR: Could not convert '" << argv[i] << "'.\n";
+            failures++;
+        }
+    }
+
+    return failures ? 1 : 0;
+}
@@ -5,6 +5,13 @@
 #include "helper.h"
 #include "perlin.h"
 #include "rtw_stb_image.h"
+#include "scene_arena.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
 
 // Abstract base class for textures
 class texture {
@@ -33,6 +40,9 @@ private:
     color color_value;
 };
 
+// A solid color holds no references.
+template <> struct skip_arena_destructor<solid_color> : std::true_type {};
+
 // Checker texture class
 class checker_texture : public texture {
 public:
@@ -91,21 +101,157 @@ private:
     rtw_image image;
 };
 
+// Summary of a noise_texture bake, for deciding whether the speedup is worth the error.
+struct bake_report {
+    int resolution = 0;      // Grid samples along each axis
+    size_t bytes = 0;        // Memory held by the grid
+    double seconds = 0;      // Wall time spent baking
+    double max_error = 0;    // Largest |baked - analytic| texture value over the test points
+    double mean_error = 0;   // Mean |baked - analytic| texture value over the test points
+                             // (all inside the baked cube; outside it the pattern repeats)
+
+    void print(std::ostream& out) const {
+        out << "Baked noise texture: " << resolution << "^3 grid, "
+            << (bytes / (1024.0 * 1024.0)) << " MiB, " << seconds << " s, max error "
+            << max_error << ", mean error " << mean_error << '\n';
+    }
+};
+
 // Perlin noise texture class
 class noise_texture : public texture {
 public:
 
-    noise_texture(double sc = 1.0, const color& c = color(1.0,1.0,1.0)) : scale(sc), color_value(c) {}
+    // Textures with different seeds show different noise patterns
+    noise_texture(double sc = 1.0, const color& c = color(1.0,1.0,1.0), uint32_t seed = 0)
+        : noise(seed), scale(sc), color_value(c) {}
 
     color value(double u, double v, const point3& p) const override {
         auto s = scale * p;
-        return color_value * 0.5 * (1 + sin(s.z() + 10 * noise.turb(s)));
+        auto turbulence = baked.empty() ? noise.turb(s) : baked_turb(p);
+        return color_value * 0.5 * (1 + sin(s.z() + 10 * turbulence));
+    }
+
+    // Precompute turb() on a resolution^3 grid covering a cube of side `period` (world units,
+    // with its low corner at `origin`) so that shading becomes one trilinear lookup instead of
+    // seven noise() evaluations. Points outside the cube wrap around, so the baked texture repeats
+    // with that period; place the cube over the objects that use the texture. turb() itself is not
+    // periodic, so across the last sixteenth of the cube on each axis the grid fades into the noise
+    // one period back, which hides the seam where the pattern wraps. Detail finer than one grid
+    // cell is lost. The returned report measures the cost of the bake and its error against the
+    // analytic texture at random points of the cube, the cross-fade included. A resolution or
+    // period that isn't positive leaves the texture analytic and returns an empty report.
+    bake_report bake(int resolution, double period, const point3& origin = point3(0, 0, 0)) {
+        auto start = std::chrono::steady_clock::now();
+
+        baked.clear();
+        if (resolution <= 0 || !(period > 0))
+            return bake_report();
+        bake_resolution = resolution;
+        bake_period = period;
+        bake_origin = origin;
+        cells_per_unit = resolution / period;
+
+        std::vector<float> grid(static_cast<size_t>(resolution) * resolution * resolution);
+        auto cell = period / resolution;
+        for (int k = 0; k < resolution; k++)
+            for (int j = 0; j < resolution; j++)
+                for (int i = 0; i < resolution; i++)
+                    grid[grid_index(i, j, k)] = static_cast<float>(periodic_turb(origin + cell * vec3(i, j, k)));
+
+        baked = std::move(grid);
+
+        bake_report report;
+        report.resolution = resolution;
+        report.bytes = baked.size() * sizeof(float);
+        report.seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+
+        // Compare against analytic evaluation at random points in the baked cube. Uses its own
+        // generator so that baking does not disturb the scene's random sequence.
+        const int test_points = 10000;
+        std::mt19937 generator(12345);
+        std::uniform_real_distribution<double> distribution(0.0, period);
+        double total_error = 0;
+        for (int n = 0; n < test_points; n++) {
+            auto p = origin + vec3(distribution(generator), distribution(generator), distribution(generator));
+            auto s = scale * p;
+            auto exact = 0.5 * (1 + sin(s.z() + 10 * noise.turb(s)));
+            auto approx = 0.5 * (1 + sin(s.z() + 10 * baked_turb(p)));
+            auto error = fabs(exact - approx);
+            report.max_error = fmax(report.max_error, error);
+            total_error += error;
+        }
+        report.mean_error = total_error / test_points;
+
+        return report;
     }
 
 private:
     perlin noise;
     double scale;
     color color_value;
+
+    std::vector<float> baked;   // Periodic grid of turb() values; empty if not baked
+    int bake_resolution = 0;
+    double bake_period = 0;
+    point3 bake_origin;
+    double cells_per_unit = 0;
+
+    static constexpr double bake_blend = 0.0625;  // Fraction of the period cross-faded at the wrap
+
+    // turb() at world-space point p of the baked cube, blended near the cube's far faces with the
+    // copies one period back so that the value at each far face equals the one at the near face.
+    double periodic_turb(const point3& p) const {
+        double weight[3];
+        for (int a = 0; a < 3; a++) {
+            auto t = ((p[a] - bake_origin[a]) / bake_period - (1 - bake_blend)) / bake_blend;
+            t = std::clamp(t, 0.0, 1.0);
+            weight[a] = t * t * (3 - 2 * t);
+        }
+
+        double sum = 0;
+        for (int corner = 0; corner < 8; corner++) {
+            double w = 1;
+            vec3 shift(0, 0, 0);
+            for (int a = 0; a < 3; a++) {
+                bool back = (corner >> a) & 1;
+                w *= back ? weight[a] : 1 - weight[a];
+                if (back) shift[a] = bake_period;
+            }
+            if (w > 0)
+                sum += w * noise.turb(scale * (p - shift));
+        }
+        return sum;
+    }
+
+    size_t grid_index(int i, int j, int k) const {
+        return (static_cast<size_t>(k) * bake_resolution + j) * bake_resolution + i;
+    }
+
+    // Trilinearly interpolate the baked grid at world-space point p, wrapping periodically.
+    double baked_turb(const point3& p) const {
+        int i0[3], i1[3];
+        double f[3];
+        for (int a = 0; a < 3; a++) {
+            auto x = (p[a] - bake_origin[a]) * cells_per_unit;
+            auto fl = floor(x);
+            f[a] = x - fl;
+            auto i = static_cast<long long>(fl) % bake_resolution;
+            if (i < 0) i += bake_resolution;
+            i0[a] = static_cast<int>(i);
+            i1[a] = (i0[a] + 1 == bake_resolution) ? 0 : i0[a] + 1;
+        }
+
+        auto lerp = [](double a, double b, double t) { return a + t * (b - a); };
+        auto at = [&](int i, int j, int k) { return static_cast<double>(baked[grid_index(i, j, k)]); };
+
+        auto c00 = lerp(at(i0[0], i0[1], i0[2]), at(i1[0], i0[1], i0[2]), f[0]);
+        auto c10 = lerp(at(i0[0], i1[1], i0[2]), at(i1[0], i1[1], i0[2]), f[0]);
+        auto c01 = lerp(at(i0[0], i0[1], i1[2]), at(i1[0], i0[1], i1[2]), f[0]);
+        auto c11 = lerp(at(i0[0], i1[1], i1[2]), at(i1[0], i1[1], i1[2]), f[0]);
+
+        return lerp(lerp(c00, c10, f[1]), lerp(c01, c11, f[1]), f[2]);
+    }
 };
 
 #endif
\ No newline at end of file
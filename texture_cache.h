@@ -0,0 +1,222 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include "helper.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+// Tile geometry shared by the texture cache and rtw_image. Textures are stored as square tiles
+// of tile_size x tile_size texels, and the texels inside a tile are laid out in Morton (Z-order)
+// so that texels that are close in (x, y) are also close in memory.
+const int texture_tile_log2 = 5;
+const int texture_tile_size = 1 << texture_tile_log2;   // Texels along one tile edge
+const int texture_tile_texels = texture_tile_size * texture_tile_size;
+const int texture_bytes_per_pixel = 3;
+const int texture_tile_bytes = texture_tile_texels * texture_bytes_per_pixel;
+
+// Interleave the low bits of x and y into a Morton index (x in the even bits, y in the odd bits).
+inline uint32_t morton_encode_2d(uint32_t x, uint32_t y) {
+    auto spread = [](uint32_t n) {
+        n &= 0x0000ffff;
+        n = (n | (n << 8)) & 0x00ff00ff;
+        n = (n | (n << 4)) & 0x0f0f0f0f;
+        n = (n | (n << 2)) & 0x33333333;
+        n = (n | (n << 1)) & 0x55555555;
+        return n;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+// Byte offset of texel (x, y) inside its tile.
+inline int texture_tile_offset(int x, int y) {
+    const int mask = texture_tile_size - 1;
+    return static_cast<int>(morton_encode_2d(x & mask, y & mask)) * texture_bytes_per_pixel;
+}
+
+// One resident tile of texel data.
+struct texture_tile {
+    unsigned char texels[texture_tile_bytes];
+};
+
+// Anything that can page a tile back in after the cache evicted it.
+class texture_tile_source {
+public:
+    virtual ~texture_tile_source() = default;
+
+    // Fill dst with the texels of the given tile.
+    virtual void read_tile(int tile_index, texture_tile& dst) const = 0;
+};
+
+// Fixed-size LRU cache of texture tiles shared by every image texture and every render thread.
+// Tiles are keyed by (image id, tile index); once the resident size reaches the capacity the
+// least recently used tile is dropped and will be read again from its source on the next miss.
+class texture_cache {
+public:
+    struct statistics {
+        uint64_t hits = 0;          // Lookups satisfied by a resident tile, or by the tile the
+                                    // thread held from its previous lookup (count_held_hit)
+        uint64_t misses = 0;        // Lookups that had to page a tile in
+        uint64_t evictions = 0;     // Tiles dropped to stay within capacity
+        size_t resident_bytes = 0;  // Bytes of tile data currently held
+        size_t capacity_bytes = 0;  // Configured upper bound on resident_bytes
+    };
+
+    explicit texture_cache(size_t capacity = default_capacity()) : capacity_bytes(capacity) {}
+
+    // The cache used by all rtw_image instances. Its capacity can be set in megabytes with the
+    // RTW_TEXTURE_CACHE_MB environment variable.
+    static texture_cache& global() {
+        static texture_cache cache;
+        return cache;
+    }
+
+    // Hand out a unique id for a new image; ids are never reused, so stale keys can't alias.
+    static uint32_t next_image_id() {
+        static std::atomic<uint32_t> counter{ 0 };
+        return ++counter;
+    }
+
+    void set_capacity(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        capacity_bytes = bytes;
+        evict_to_capacity();
+    }
+
+    // Count a lookup that the calling thread answered from the tile it held from its previous
+    // fetch(), without coming back to the cache. It is added to the hits on the thread's next
+    // fetch() or flush_thread().
+    static void count_held_hit() { ++held_hits(); }
+
+    // Add the calling thread's held-tile hits to the totals.
+    void flush_thread() {
+        if (held_hits() == 0) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        hits += held_hits();
+        held_hits() = 0;
+    }
+
+    // Return the requested tile, paging it in from src on a miss. The returned pointer keeps the
+    // tile alive even if it is evicted while the caller still uses it.
+    shared_ptr<const texture_tile> fetch(
+        const texture_tile_source& src, uint32_t image_id, int tile_index
+    ) {
+        auto key = make_key(image_id, tile_index);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            hits += held_hits();
+            held_hits() = 0;
+            auto found = index.find(key);
+            if (found != index.end()) {
+                ++hits;
+                lru.splice(lru.begin(), lru, found->second);
+                return found->second->tile;
+            }
+            ++misses;
+        }
+
+        // Read the tile without holding the lock so other threads can keep hitting the cache.
+        auto tile = make_shared<texture_tile>();
+        src.read_tile(tile_index, *tile);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = index.find(key);
+        if (found != index.end()) {
+            // Another thread paged the same tile in while we were reading it.
+            lru.splice(lru.begin(), lru, found->second);
+            return found->second->tile;
+        }
+
+        lru.push_front(entry{ key, tile });
+        index[key] = lru.begin();
+        resident_bytes += sizeof(texture_tile);
+        evict_to_capacity();
+        return tile;
+    }
+
+    // Drop every tile that belongs to the given image.
+    void evict_image(uint32_t image_id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = lru.begin(); it != lru.end();) {
+            if (static_cast<uint32_t>(it->key >> 32) == image_id) {
+                index.erase(it->key);
+                resident_bytes -= sizeof(texture_tile);
+                it = lru.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+
+    statistics stats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        statistics s;
+        s.hits = hits;
+        s.misses = misses;
+        s.evictions = evictions;
+        s.resident_bytes = resident_bytes;
+        s.capacity_bytes = capacity_bytes;
+        return s;
+    }
+
+    void print_stats(std::ostream& out) const {
+        auto s = stats();
+        auto lookups = s.hits + s.misses;
+        if (lookups == 0) return;
+
+        out << "Texture cache: " << s.hits << " hits, " << s.misses << " misses ("
+            << (100.0 * s.hits / lookups) << "% hit rate), " << s.evictions << " evictions, "
+            << (s.resident_bytes >> 10) << " KiB resident of " << (s.capacity_bytes >> 10)
+            << " KiB\n";
+    }
+
+private:
+    struct entry {
+        uint64_t key;
+        shared_ptr<const texture_tile> tile;
+    };
+
+    mutable std::mutex mutex;
+    std::list<entry> lru;  // Most recently used at the front
+    std::unordered_map<uint64_t, std::list<entry>::iterator> index;
+    size_t resident_bytes = 0;
+    size_t capacity_bytes;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+
+    static uint64_t& held_hits() {
+        thread_local uint64_t count = 0;
+        return count;
+    }
+
+    static uint64_t make_key(uint32_t image_id, int tile_index) {
+        return (static_cast<uint64_t>(image_id) << 32) | static_cast<uint32_t>(tile_index);
+    }
+
+    static size_t default_capacity() {
+        auto megabytes = getenv("RTW_TEXTURE_CACHE_MB");
+        if (megabytes && atoi(megabytes) > 0)
+            return static_cast<size_t>(atoi(megabytes)) << 20;
+        return size_t(64) << 20;
+    }
+
+    void evict_to_capacity() {
+        // Always keep at least one tile so a lookup can make progress with a tiny capacity.
+        while (resident_bytes > capacity_bytes && lru.size() > 1) {
+            index.erase(lru.back().key);
+            lru.pop_back();
+            resident_bytes -= sizeof(texture_tile);
+            ++evictions;
+        }
+    }
+};
+
+#endif
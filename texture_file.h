@@ -0,0 +1,168 @@
+#ifndef TEXTURE_FILE_H
+#define TEXTURE_FILE_H
+
+#include "texture_cache.h"
+
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Pre-decoded texture container (".rtwt"). The file holds a full mip chain in exactly the tiled,
+// Morton-ordered layout that rtw_image samples from, so a texture can be memory-mapped and used
+// directly with no decoding or copying. Layout, all little-endian as written by the host:
+//
+//     texture_file_header
+//     texture_file_level[level_count]     (level 0 is full resolution, each next level half)
+//     tile data for each level, starting at its page-aligned offset, tiles in row-major order
+//
+// The header records the size and modification time of the image it was converted from, so a
+// stale container next to an edited source image is ignored.
+
+const char texture_file_magic[8] = { 'R', 'T', 'W', 'T', 'E', 'X', '\0', '\1' };
+const uint32_t texture_file_version = 1;
+const uint64_t texture_file_alignment = 4096;
+
+struct texture_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t level_count;
+    uint64_t source_size;    // Bytes in the source image file (0 if unknown)
+    int64_t source_mtime;    // Source modification time, in filesystem clock ticks
+};
+
+struct texture_file_level {
+    uint32_t width, height;
+    uint32_t tiles_x, tiles_y;
+    uint64_t offset;         // Byte offset of the level's first tile from the start of the file
+};
+
+// Copy tile (tx, ty) of a row-major RGB image into dst, in the in-tile Morton order. Texels past
+// the right or bottom edge repeat the edge texels so every tile is complete.
+inline void copy_image_tile(
+    const unsigned char* rgb, int width, int height, int tx, int ty, texture_tile& dst
+) {
+    for (int j = 0; j < texture_tile_size; j++) {
+        auto y = ty * texture_tile_size + j;
+        y = (y < height) ? y : height - 1;
+        for (int i = 0; i < texture_tile_size; i++) {
+            auto x = tx * texture_tile_size + i;
+            x = (x < width) ? x : width - 1;
+            auto src = rgb + (static_cast<size_t>(y) * width + x) * texture_bytes_per_pixel;
+            auto texel = dst.texels + texture_tile_offset(i, j);
+            texel[0] = src[0];
+            texel[1] = src[1];
+            texel[2] = src[2];
+        }
+    }
+}
+
+// Halve an RGB image with a 2x2 box filter (odd edges reuse the last row or column).
+inline std::vector<unsigned char> downsample_image(
+    const std::vector<unsigned char>& rgb, int width, int height, int& new_width, int& new_height
+) {
+    new_width = (width > 1) ? width / 2 : 1;
+    new_height = (height > 1) ? height / 2 : 1;
+    std::vector<unsigned char> out(static_cast<size_t>(new_width) * new_height * 3);
+
+    for (int y = 0; y < new_height; y++) {
+        auto y0 = 2 * y < height ? 2 * y : height - 1;
+        auto y1 = 2 * y + 1 < height ? 2 * y + 1 : height - 1;
+        for (int x = 0; x < new_width; x++) {
+            auto x0 = 2 * x < width ? 2 * x : width - 1;
+            auto x1 = 2 * x + 1 < width ? 2 * x + 1 : width - 1;
+            for (int c = 0; c < 3; c++) {
+                auto at = [&](int xx, int yy) { return rgb[(static_cast<size_t>(yy) * width + xx) * 3 + c]; };
+                auto sum = at(x0, y0) + at(x1, y0) + at(x0, y1) + at(x1, y1);
+                out[(static_cast<size_t>(y) * new_width + x) * 3 + c] = static_cast<unsigned char>((sum + 2) / 4);
+            }
+        }
+    }
+
+    return out;
+}
+
+// Write a decoded RGB image and its mip chain as a texture container. Returns true on success.
+inline bool write_texture_file(
+    const std::string& filename, const unsigned char* rgb, int width, int height,
+    uint64_t source_size = 0, int64_t source_mtime = 0
+) {
+    // Build the mip chain down to 1x1
+    std::vector<std::vector<unsigned char>> images;
+    std::vector<texture_file_level> levels;
+    images.emplace_back(rgb, rgb + static_cast<size_t>(width) * height * 3);
+    int w = width, h = height;
+    while (true) {
+        texture_file_level level{};
+        level.width = w;
+        level.height = h;
+        level.tiles_x = (w + texture_tile_size - 1) / texture_tile_size;
+        level.tiles_y = (h + texture_tile_size - 1) / texture_tile_size;
+        levels.push_back(level);
+        if (w == 1 && h == 1) break;
+        images.push_back(downsample_image(images.back(), w, h, w, h));
+    }
+
+    texture_file_header header{};
+    memcpy(header.magic, texture_file_magic, sizeof(header.magic));
+    header.version = texture_file_version;
+    header.level_count = static_cast<uint32_t>(levels.size());
+    header.source_size = source_size;
+    header.source_mtime = source_mtime;
+
+    auto align = [](uint64_t n) {
+        return (n + texture_file_alignment - 1) / texture_file_alignment * texture_file_alignment;
+    };
+    uint64_t offset = align(sizeof(header) + levels.size() * sizeof(texture_file_level));
+    for (auto& level : levels) {
+        level.offset = offset;
+        offset = align(offset + uint64_t(level.tiles_x) * level.tiles_y * texture_tile_bytes);
+    }
+
+    FILE* out = fopen(filename.c_str(), "wb");
+    if (!out) return false;
+
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1
+           && fwrite(levels.data(), sizeof(texture_file_level), levels.size(), out) == levels.size();
+
+    texture_tile tile;
+    for (size_t n = 0; ok && n < levels.size(); n++) {
+        const auto& level = levels[n];
+        ok = fseek(out, static_cast<long>(level.offset), SEEK_SET) == 0;
+        for (uint32_t ty = 0; ok && ty < level.tiles_y; ty++)
+            for (uint32_t tx = 0; ok && tx < level.tiles_x; tx++) {
+                copy_image_tile(images[n].data(), level.width, level.height, tx, ty, tile);
+                ok = fwrite(tile.texels, texture_tile_bytes, 1, out) == 1;
+            }
+    }
+
+    return (fclose(out) == 0) && ok;
+}
+
+// Check that a mapped buffer holds a well-formed container and return its level table, or
+// nullptr if it doesn't. Every level's tiles must cover its texels and lie inside the buffer.
+inline const texture_file_level* validate_texture_file(const unsigned char* data, size_t size) {
+    if (size < sizeof(texture_file_header)) return nullptr;
+
+    texture_file_header header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, texture_file_magic, sizeof(header.magic)) != 0) return nullptr;
+    if (header.version != texture_file_version || header.level_count == 0) return nullptr;
+    if (size < sizeof(header) + header.level_count * sizeof(texture_file_level)) return nullptr;
+
+    auto levels = reinterpret_cast<const texture_file_level*>(data + sizeof(header));
+    for (uint32_t n = 0; n < header.level_count; n++) {
+        const auto& level = levels[n];
+        if (level.width == 0 || level.height == 0 || level.width > INT_MAX || level.height > INT_MAX) return nullptr;
+        if (uint64_t(level.tiles_x) * texture_tile_size < level.width) return nullptr;
+        if (uint64_t(level.tiles_y) * texture_tile_size < level.height) return nullptr;
+        if (level.offset > size) return nullptr;
+        if (uint64_t(level.tiles_x) * level.tiles_y > (size - level.offset) / texture_tile_bytes) return nullptr;
+    }
+
+    return levels;
+}
+
+#endif
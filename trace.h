@@ -0,0 +1,169 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Timeline tracing. When enabled (--trace <file>), trace_scope objects record named spans per
+// thread (per worker index for render threads, see set_worker), which are written as a Chrome
+// trace-event JSON file for chrome://tracing or Perfetto. Disabled, a trace_scope costs one
+// branch; details that need formatting should be passed as a number or a function, so they are
+// only built while tracing.
+
+class trace_log {
+public:
+    static trace_log& global() {
+        static trace_log log;
+        return log;
+    }
+
+    // Turn recording on; call before any threads start.
+    void enable() {
+        start = std::chrono::steady_clock::now();
+        on = true;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        thread_id(); // The enabling thread is "main"
+    }
+
+    // Record the calling thread's spans on the row of render worker `index`. Render threads are
+    // started afresh for every pass, so rows keyed by OS thread would multiply with the passes.
+    void set_worker(int index) {
+        if (!on) return;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (index >= static_cast<int>(worker_rows.size()))
+            worker_rows.resize(index + 1, -1);
+        if (worker_rows[index] < 0) {
+            worker_rows[index] = thread_count++;
+            row_names.push_back("render " + std::to_string(index));
+        }
+        current_row() = worker_rows[index];
+    }
+
+    bool enabled() const { return on; }
+
+    int64_t now_us() const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void add(const char* name, std::string detail, int64_t begin_us, int64_t end_us) {
+        std::lock_guard<std::mutex> lock(mutex);
+        events.push_back({ name, std::move(detail), begin_us, end_us - begin_us, thread_id() });
+    }
+
+    // Write the recorded spans as trace-event JSON. Returns false (after printing why) on failure.
+    bool write(const std::string& filename) const {
+        std::ofstream out(filename);
+        if (!out) {
+            std::cerr << "ERROR: Could not write trace '" << filename << "'.\n";
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        for (int tid = 0; tid < thread_count; tid++)
+            out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid
+                << ",\"args\":{\"name\":\"" << row_names[tid] << "\"}},\n";
+        for (size_t i = 0; i < events.size(); i++) {
+            const auto& e = events[i];
+            out << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.tid
+                << ",\"ts\":" << e.begin_us << ",\"dur\":" << e.duration_us;
+            if (!e.detail.empty())
+                out << ",\"args\":{\"detail\":\"" << escaped(e.detail) << "\"}";
+            out << "}" << (i + 1 < events.size() ? ",\n" : "\n");
+        }
+        out << "]}\n";
+        return static_cast<bool>(out);
+    }
+
+private:
+    struct event {
+        const char* name;
+        std::string detail;
+        int64_t begin_us, duration_us;
+        int tid;
+    };
+
+    bool on = false;
+    std::chrono::steady_clock::time_point start;
+    mutable std::mutex mutex;
+    std::vector<event> events;
+    int thread_count = 0;                 // Rows so far
+    std::vector<std::string> row_names;   // Name of each row
+    std::vector<int> worker_rows;         // Row of each render worker index (-1 = none yet)
+
+    static int& current_row() {
+        thread_local int row = -1;
+        return row;
+    }
+
+    // Row of the calling thread: its render worker's, or a new one in order of first use. Called
+    // with mutex held.
+    int thread_id() {
+        auto& row = current_row();
+        if (row < 0) {
+            row = thread_count++;
+            row_names.push_back(row == 0 ? "main" : "thread " + std::to_string(row));
+        }
+        return row;
+    }
+
+    static std::string escaped(const std::string& s) {
+        std::string out;
+        for (auto c : s) {
+            if (c == '"' || c == '\\') out += '\\';
+            if (static_cast<unsigned char>(c) >= 0x20) out += c;
+        }
+        return out;
+    }
+};
+
+// Records the span from construction to destruction under `name` (a string literal).
+class trace_scope {
+public:
+    trace_scope(const char* name, std::string detail = std::string())
+        : name(trace_log::global().enabled() ? name : nullptr)
+    {
+        if (this->name) {
+            this->detail = std::move(detail);
+            begin_us = trace_log::global().now_us();
+        }
+    }
+
+    trace_scope(const char* name, long long number) : trace_scope(name, [number] { return std::to_string(number); }) {}
+
+    // Same, with the detail made by detail() only when tracing is on.
+    template <typename F, typename = decltype(std::string(std::declval<F&>()()))>
+    trace_scope(const char* name, F detail) : name(trace_log::global().enabled() ? name : nullptr) {
+        if (this->name) {
+            this->detail = detail();
+            begin_us = trace_log::global().now_us();
+        }
+    }
+
+    trace_scope(const trace_scope&) = delete;
+    trace_scope& operator=(const trace_scope&) = delete;
+
+    ~trace_scope() { end(); }
+
+    // End the span before the scope does.
+    void end() {
+        if (name)
+            trace_log::global().add(name, std::move(detail), begin_us, trace_log::global().now_us());
+        name = nullptr;
+    }
+
+private:
+    const char* name;
+    std::string detail;
+    int64_t begin_us = 0;
+};
+
+#endif